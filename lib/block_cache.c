@@ -0,0 +1,254 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Cache of decompressed squashfs blocks, keyed by their position in the image. The cache is split into shards that
+ * each have their own lock, hash table and CLOCK ring, so concurrent readers rarely contend. A shard lock is only held
+ * for the hash lookup and the pointer updates, never while copying or decompressing data.
+ *
+ * Blocks are reference counted: evicting a block that is still being read from only removes it from the shard, the
+ * memory is freed by the last private_block_cache_release.
+ *
+ * The budget is split evenly between the shards, but a shard always keeps at least one block. Otherwise a budget
+ * below NUM_SHARDS blocks (a small cache, or one that was trimmed under memory pressure) would not cache anything at
+ * all. The cache can therefore exceed a very small budget by up to one block per shard.
+ */
+
+#include "block_cache.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_SHARDS 16
+
+typedef struct cache_shard {
+    pthread_mutex_t          lock;
+    private_cached_block_t **buckets;
+    size_t                   bucket_mask;
+    private_cached_block_t * hand; // CLOCK hand, NULL if the shard is empty
+    size_t                   bytes;
+    size_t                   budget;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+} cache_shard_t;
+
+struct private_block_cache {
+    atomic_size_t budget; // Blocks larger than this are never cached, read without any lock
+    cache_shard_t shards[NUM_SHARDS];
+};
+
+static inline uint64_t hash_key(uint64_t key) {
+    // Block positions are not evenly distributed in the low bits, mix them (Fibonacci hashing)
+    return key * UINT64_C(0x9E3779B97F4A7C15);
+}
+
+static inline cache_shard_t *key_shard(private_block_cache_t *cache, uint64_t key) {
+    return &cache->shards[hash_key(key) >> 60];
+}
+
+static inline private_cached_block_t **key_bucket(cache_shard_t *shard, uint64_t key) {
+    return &shard->buckets[(hash_key(key) >> 20) & shard->bucket_mask];
+}
+
+private_block_cache_t *private_block_cache_new(size_t budget) {
+    private_block_cache_t *cache = calloc(1, sizeof(private_block_cache_t));
+    if (!cache) return NULL;
+
+    // Expect blocks of at least 16 KiB on average, a typical squashfs block is 128 KiB
+    size_t num_buckets = 16;
+    while (num_buckets < budget / NUM_SHARDS / (16 * 1024)) num_buckets *= 2;
+
+    atomic_init(&cache->budget, budget);
+    for (size_t i = 0; i < NUM_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+        shard->budget        = budget / NUM_SHARDS;
+        shard->bucket_mask   = num_buckets - 1;
+        shard->buckets       = calloc(num_buckets, sizeof(private_cached_block_t *));
+        if (!shard->buckets || pthread_mutex_init(&shard->lock, NULL) != 0) {
+            free(shard->buckets);
+            shard->buckets = NULL;
+            private_block_cache_free(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+void private_block_cache_free(private_block_cache_t *cache) {
+    if (!cache) return;
+
+    for (size_t i = 0; i < NUM_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+        if (!shard->buckets) break; // private_block_cache_new failed here
+
+        for (size_t b = 0; b <= shard->bucket_mask; b++) {
+            while (shard->buckets[b]) {
+                private_cached_block_t *block = shard->buckets[b];
+                shard->buckets[b]             = block->hash_next;
+                private_block_cache_release(block);
+            }
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
+
+/* Must be called with the shard lock held */
+static void unlink_block(cache_shard_t *shard, private_cached_block_t *block) {
+    private_cached_block_t **it = key_bucket(shard, block->key);
+    while (*it != block) it = &(*it)->hash_next;
+    *it = block->hash_next;
+
+    if (block->clock_next == block) {
+        shard->hand = NULL;
+    } else {
+        block->clock_prev->clock_next = block->clock_next;
+        block->clock_next->clock_prev = block->clock_prev;
+        if (shard->hand == block) shard->hand = block->clock_next;
+    }
+
+    shard->bytes -= block->size;
+}
+
+/*
+ * Must be called with the shard lock held. Evicts blocks until size more bytes fit into the shard, or until it is empty
+ * if the block is larger than the share of the shard.
+ */
+static void make_room(cache_shard_t *shard, size_t size) {
+    while (shard->hand && shard->bytes + size > shard->budget) {
+        private_cached_block_t *block = shard->hand;
+        if (block->referenced) {
+            // Second chance
+            block->referenced = false;
+            shard->hand       = block->clock_next;
+            continue;
+        }
+
+        unlink_block(shard, block);
+        shard->evictions++;
+        private_block_cache_release(block);
+    }
+}
+
+private_cached_block_t *private_block_cache_get(private_block_cache_t *cache, uint64_t key) {
+    cache_shard_t *         shard = key_shard(cache, key);
+    private_cached_block_t *block;
+
+    pthread_mutex_lock(&shard->lock);
+    for (block = *key_bucket(shard, key); block && block->key != key; block = block->hash_next) {}
+    if (block) {
+        block->referenced = true;
+        atomic_fetch_add(&block->refs, 1);
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return block;
+}
+
+private_cached_block_t *
+private_block_cache_put(private_block_cache_t *cache, uint64_t key, const void *data, size_t size) {
+    cache_shard_t *shard = key_shard(cache, key);
+    if (size > atomic_load_explicit(&cache->budget, memory_order_relaxed)) return NULL;
+
+    // Copy outside of the lock
+    private_cached_block_t *block = malloc(sizeof(private_cached_block_t) + size);
+    if (!block) return NULL;
+    block->key        = key;
+    block->size       = size;
+    block->referenced = false;
+    atomic_init(&block->refs, 2); // The cache and the caller
+    memcpy(block->data, data, size);
+
+    pthread_mutex_lock(&shard->lock);
+    private_cached_block_t **bucket = key_bucket(shard, key);
+    for (private_cached_block_t *it = *bucket; it; it = it->hash_next) {
+        if (it->key == key) {
+            // Lost the race against another reader of the same block
+            atomic_fetch_add(&it->refs, 1);
+            it->referenced = true;
+            pthread_mutex_unlock(&shard->lock);
+            free(block);
+            return it;
+        }
+    }
+
+    make_room(shard, size);
+    bucket           = key_bucket(shard, key);
+    block->hash_next = *bucket;
+    *bucket          = block;
+
+    // Insert right behind the hand, so that the new block is the last one the hand reaches
+    if (shard->hand) {
+        block->clock_next             = shard->hand;
+        block->clock_prev             = shard->hand->clock_prev;
+        block->clock_prev->clock_next = block;
+        shard->hand->clock_prev       = block;
+    } else {
+        block->clock_next = block;
+        block->clock_prev = block;
+        shard->hand       = block;
+    }
+
+    shard->bytes += size;
+    shard->inserts++;
+    pthread_mutex_unlock(&shard->lock);
+    return block;
+}
+
+void private_block_cache_release(private_cached_block_t *block) {
+    if (atomic_fetch_sub(&block->refs, 1) == 1) free(block);
+}
+
+void private_block_cache_drop(private_block_cache_t *cache, uint64_t first, uint64_t last) {
+    for (size_t i = 0; i < NUM_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        for (size_t b = 0; b <= shard->bucket_mask; b++) {
+            private_cached_block_t **it = &shard->buckets[b];
+            while (*it) {
+                private_cached_block_t *block = *it;
+                if (block->key < first || block->key > last) {
+                    it = &block->hash_next;
+                    continue;
+                }
+                unlink_block(shard, block); // Replaces *it with the next block
+                private_block_cache_release(block);
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void private_block_cache_set_budget(private_block_cache_t *cache, size_t budget) {
+    atomic_store_explicit(&cache->budget, budget, memory_order_relaxed);
+    for (size_t i = 0; i < NUM_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        shard->budget = budget / NUM_SHARDS;
+        make_room(shard, 0);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void private_block_cache_get_stats(private_block_cache_t *cache, private_block_cache_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < NUM_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->inserts += shard->inserts;
+        stats->evictions += shard->evictions;
+        stats->bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    stats->budget = atomic_load_explicit(&cache->budget, memory_order_relaxed);
+}
@@ -0,0 +1,57 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct private_block_cache private_block_cache_t;
+
+// A cached block. data and size may be used until the block is released.
+typedef struct private_cached_block {
+    uint64_t    key;
+    size_t      size;
+    atomic_uint refs; // One reference is held by the cache as long as the block is not evicted
+
+    // CLOCK state, guarded by the shard lock
+    bool                         referenced;
+    struct private_cached_block *hash_next;
+    struct private_cached_block *clock_prev;
+    struct private_cached_block *clock_next;
+
+    char data[];
+} private_cached_block_t;
+
+typedef struct private_block_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+    size_t   bytes;  // Currently cached
+    size_t   budget; // Upper limit of bytes
+} private_block_cache_stats_t;
+
+// Create a cache that holds at most budget bytes of block data
+private_block_cache_t *private_block_cache_new(size_t budget);
+void                   private_block_cache_free(private_block_cache_t *cache);
+
+// Returns a referenced block or NULL on a miss
+private_cached_block_t *private_block_cache_get(private_block_cache_t *cache, uint64_t key);
+
+// Copy data into the cache and return it referenced. If another thread inserted key in the meantime, its block is
+// returned instead. Returns NULL if the block does not fit into the cache.
+private_cached_block_t *
+private_block_cache_put(private_block_cache_t *cache, uint64_t key, const void *data, size_t size);
+
+void private_block_cache_release(private_cached_block_t *block);
+
+// Remove all blocks with first <= key <= last, e.g. the blocks of an image that is no longer mounted
+void private_block_cache_drop(private_block_cache_t *cache, uint64_t first, uint64_t last);
+
+// Change the upper limit of cached bytes, blocks are evicted right away if the cache is above the new budget
+void private_block_cache_set_budget(private_block_cache_t *cache, size_t budget);
+
+void private_block_cache_get_stats(private_block_cache_t *cache, private_block_cache_stats_t *stats);
@@ -0,0 +1,291 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Decompressors with long lived contexts. The squashfuse decompressors are one shot calls: uncompress() runs
+ * inflateInit / inflateEnd, lzma_stream_buffer_decode allocates and frees the decoder and its dictionary, and
+ * ZSTD_decompress creates a DCtx, all for every single block. For 8 KiB metadata blocks that setup costs about as much
+ * as the decompression itself.
+ *
+ * Here every thread gets one context per compression type on first use. Between blocks it is only reset
+ * (inflateReset, ZSTD_decompressDCtx resets itself, and re-initializing an lzma_stream with the same decoder reuses its
+ * allocations), so zlib and zstd do not allocate anything in steady state. liblzma still allocates the filter options
+ * of every xz block header, but the decoder and its dictionary are kept. The contexts are freed when the thread exits,
+ * e.g. when the session loop reaps an idle worker.
+ *
+ * The backends are only used if the build found their library (HAVE_ZLIB, HAVE_LZMA, HAVE_LZ4, HAVE_ZSTD), everything
+ * else keeps the squashfuse decompressor. LZ4 has no context to keep, it is only here for PRIVATE_SINGLE_COMPRESSION
+ * (and without any other backend, the context code is left out).
+ *
+ * With HAVE_LIBDEFLATE, gzip blocks are decoded by libdeflate instead of zlib. A squashfs block is always decompressed
+ * as a whole into a buffer of known size, which is exactly what libdeflate is optimized for (no streaming state, no
+ * sliding window copies). Its decompressor does not allocate anything after creation either.
+ *
+ * If the runtime is built with a single compressor (-Dcompressors=zstd), PRIVATE_SINGLE_COMPRESSION is its squashfs
+ * compression id. Its decompressor is then exported as private_decompress_single, which private_decompress calls
+ * directly instead of through the function pointer. That covers extraction and the innermost call of the mount daemon
+ * hooks (statistics); the daemon still reaches the outermost hook through fs->decompressor.
+ *
+ * Those hooks wrap fs->decompressor with private_decompress_wrap. The squashfuse callback has no user data, so there
+ * is one trampoline per wrapper slot and compression type, which finds its wrapper and the wrapped decompressor in a
+ * table. The slots are shared by all images with the same compression and the same inner decompressor (the images of
+ * the per-user daemon).
+ */
+
+#include "decompress_ctx.h"
+#include "squashfs_fs.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#elif defined(HAVE_ZLIB)
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// LZ4 has no context, a runtime built only with LZ4 needs none of this
+#if defined(HAVE_LIBDEFLATE) || defined(HAVE_ZLIB) || defined(HAVE_LZMA) || defined(HAVE_ZSTD)
+typedef struct decompress_ctx {
+#ifdef HAVE_LIBDEFLATE
+    struct libdeflate_decompressor *deflate;
+#elif defined(HAVE_ZLIB)
+    z_stream zlib;
+    bool     zlib_init;
+#endif
+#ifdef HAVE_LZMA
+    lzma_stream xz;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *zstd;
+#endif
+} decompress_ctx_t;
+
+static pthread_key_t  ctx_key;
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+static bool           ctx_key_ok;
+
+static void free_ctx(void *data) {
+    decompress_ctx_t *ctx = data;
+#ifdef HAVE_LIBDEFLATE
+    if (ctx->deflate) libdeflate_free_decompressor(ctx->deflate);
+#elif defined(HAVE_ZLIB)
+    if (ctx->zlib_init) inflateEnd(&ctx->zlib);
+#endif
+#ifdef HAVE_LZMA
+    lzma_end(&ctx->xz);
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_freeDCtx(ctx->zstd);
+#endif
+    free(ctx);
+}
+
+static void create_key(void) { ctx_key_ok = pthread_key_create(&ctx_key, free_ctx) == 0; }
+
+/* Context of the calling thread, NULL if it can not be allocated */
+static decompress_ctx_t *get_ctx(void) {
+    pthread_once(&ctx_once, create_key);
+    if (!ctx_key_ok) return NULL;
+
+    decompress_ctx_t *ctx = pthread_getspecific(ctx_key);
+    if (ctx) return ctx;
+    if (!(ctx = calloc(1, sizeof(decompress_ctx_t)))) return NULL;
+#ifdef HAVE_LZMA
+    ctx->xz = (lzma_stream)LZMA_STREAM_INIT;
+#endif
+    if (pthread_setspecific(ctx_key, ctx) != 0) {
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+#endif
+
+#ifdef HAVE_LIBDEFLATE
+static sqfs_err decompress_zlib(void *in, size_t insz, void *out, size_t *outsz) {
+    decompress_ctx_t *ctx = get_ctx();
+    if (ctx && !ctx->deflate) ctx->deflate = libdeflate_alloc_decompressor();
+    if (!ctx || !ctx->deflate) return sqfs_decompressor_get(ZLIB_COMPRESSION)(in, insz, out, outsz);
+
+    size_t size;
+    if (libdeflate_zlib_decompress(ctx->deflate, in, insz, out, *outsz, &size) != LIBDEFLATE_SUCCESS) return SQFS_ERR;
+    *outsz = size;
+    return SQFS_OK;
+}
+#elif defined(HAVE_ZLIB)
+static sqfs_err decompress_zlib(void *in, size_t insz, void *out, size_t *outsz) {
+    decompress_ctx_t *ctx = get_ctx();
+    if (!ctx) return sqfs_decompressor_get(ZLIB_COMPRESSION)(in, insz, out, outsz);
+
+    z_stream *strm = &ctx->zlib;
+    if (!ctx->zlib_init) {
+        if (inflateInit(strm) != Z_OK) return SQFS_ERR;
+        ctx->zlib_init = true;
+    } else if (inflateReset(strm) != Z_OK) {
+        return SQFS_ERR;
+    }
+
+    strm->next_in   = in;
+    strm->avail_in  = (uInt)insz;
+    strm->next_out  = out;
+    strm->avail_out = (uInt)*outsz;
+    if (inflate(strm, Z_FINISH) != Z_STREAM_END) return SQFS_ERR;
+    *outsz = strm->total_out;
+    return SQFS_OK;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static sqfs_err decompress_xz(void *in, size_t insz, void *out, size_t *outsz) {
+    decompress_ctx_t *ctx = get_ctx();
+    if (!ctx) return sqfs_decompressor_get(XZ_COMPRESSION)(in, insz, out, outsz);
+
+    // Every block is a complete xz stream. Initializing the stream decoder again keeps the coder and dictionary
+    // allocations of the previous block as long as the dictionary size does not change.
+    lzma_stream *strm = &ctx->xz;
+    if (lzma_stream_decoder(strm, UINT64_MAX, 0) != LZMA_OK) return SQFS_ERR;
+
+    strm->next_in   = in;
+    strm->avail_in  = insz;
+    strm->next_out  = out;
+    strm->avail_out = *outsz;
+    if (lzma_code(strm, LZMA_FINISH) != LZMA_STREAM_END) return SQFS_ERR;
+    *outsz = (size_t)strm->total_out;
+    return SQFS_OK;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static sqfs_err decompress_lz4(void *in, size_t insz, void *out, size_t *outsz) {
+    int size = LZ4_decompress_safe(in, out, (int)insz, (int)*outsz);
+    if (size < 0) return SQFS_ERR;
+    *outsz = (size_t)size;
+    return SQFS_OK;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static sqfs_err decompress_zstd(void *in, size_t insz, void *out, size_t *outsz) {
+    decompress_ctx_t *ctx = get_ctx();
+    if (ctx && !ctx->zstd) ctx->zstd = ZSTD_createDCtx();
+    if (!ctx || !ctx->zstd) return sqfs_decompressor_get(ZSTD_COMPRESSION)(in, insz, out, outsz);
+
+    size_t size = ZSTD_decompressDCtx(ctx->zstd, out, *outsz, in, insz);
+    if (ZSTD_isError(size)) return SQFS_ERR;
+    *outsz = size;
+    return SQFS_OK;
+}
+#endif
+
+#ifdef PRIVATE_SINGLE_COMPRESSION
+#if PRIVATE_SINGLE_COMPRESSION == ZLIB_COMPRESSION
+#define SINGLE_DECOMPRESSOR decompress_zlib
+#elif PRIVATE_SINGLE_COMPRESSION == XZ_COMPRESSION
+#define SINGLE_DECOMPRESSOR decompress_xz
+#elif PRIVATE_SINGLE_COMPRESSION == LZ4_COMPRESSION
+#define SINGLE_DECOMPRESSOR decompress_lz4
+#elif PRIVATE_SINGLE_COMPRESSION == ZSTD_COMPRESSION
+#define SINGLE_DECOMPRESSOR decompress_zstd
+#else
+#error "PRIVATE_SINGLE_COMPRESSION must be a squashfs compression id with a backend"
+#endif
+
+sqfs_err private_decompress_single(void *in, size_t insz, void *out, size_t *outsz) {
+    return SINGLE_DECOMPRESSOR(in, insz, out, outsz);
+}
+#endif
+
+sqfs_decompressor private_decompressor_get(sqfs_compression_type type) {
+    // Only where squashfuse was built with the same library, otherwise the image has to be rejected like before
+    if (!sqfs_decompressor_get(type)) return NULL;
+
+#ifdef PRIVATE_SINGLE_COMPRESSION
+    return type == PRIVATE_SINGLE_COMPRESSION ? private_decompress_single : NULL;
+#else
+    switch (type) {
+#if defined(HAVE_LIBDEFLATE) || defined(HAVE_ZLIB)
+        case ZLIB_COMPRESSION: return decompress_zlib;
+#endif
+#ifdef HAVE_LZMA
+        case XZ_COMPRESSION: return decompress_xz;
+#endif
+#ifdef HAVE_LZ4
+        case LZ4_COMPRESSION: return decompress_lz4;
+#endif
+#ifdef HAVE_ZSTD
+        case ZSTD_COMPRESSION: return decompress_zstd;
+#endif
+        default: return NULL;
+    }
+#endif
+}
+
+void private_decompress_hook(sqfs *fs) {
+    sqfs_decompressor decompressor = private_decompressor_get(fs->sb.compression);
+    if (decompressor && fs->decompressor == sqfs_decompressor_get(fs->sb.compression)) fs->decompressor = decompressor;
+}
+
+#define WRAP_SLOTS 2
+#define WRAP_MAX_COMPRESSION 7
+
+typedef struct wrap_slot {
+    private_decompress_wrapper_t wrapper; // NULL if the slot is free
+    sqfs_decompressor            inner;
+} wrap_slot_t;
+
+// Only written under wrap_lock before the images using a slot are served, read without it afterwards
+static wrap_slot_t     wrap_slots[WRAP_SLOTS][WRAP_MAX_COMPRESSION];
+static pthread_mutex_t wrap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define WRAP_TRAMPOLINE(slot, id)                                                                                      \
+    static sqfs_err wrapped_##slot##_##id(void *in, size_t insz, void *out, size_t *outsz) {                           \
+        const wrap_slot_t *s = &wrap_slots[slot][id];                                                                  \
+        return s->wrapper(s->inner, id, in, insz, out, outsz);                                                         \
+    }
+#define WRAP_TRAMPOLINES(slot)                                                                                         \
+    WRAP_TRAMPOLINE(slot, 1)                                                                                           \
+    WRAP_TRAMPOLINE(slot, 2)                                                                                           \
+    WRAP_TRAMPOLINE(slot, 3)                                                                                           \
+    WRAP_TRAMPOLINE(slot, 4)                                                                                           \
+    WRAP_TRAMPOLINE(slot, 5)                                                                                           \
+    WRAP_TRAMPOLINE(slot, 6)
+
+WRAP_TRAMPOLINES(0)
+WRAP_TRAMPOLINES(1)
+
+static const sqfs_decompressor trampolines[WRAP_SLOTS][WRAP_MAX_COMPRESSION] = {
+    {NULL, wrapped_0_1, wrapped_0_2, wrapped_0_3, wrapped_0_4, wrapped_0_5, wrapped_0_6},
+    {NULL, wrapped_1_1, wrapped_1_2, wrapped_1_3, wrapped_1_4, wrapped_1_5, wrapped_1_6},
+};
+
+bool private_decompress_wrap(sqfs *fs, private_decompress_wrapper_t wrapper) {
+    const unsigned id = fs->sb.compression;
+    bool           ok = false;
+    if (id == 0 || id >= WRAP_MAX_COMPRESSION || !fs->decompressor) return false;
+
+    pthread_mutex_lock(&wrap_lock);
+    for (unsigned i = 0; !ok && i < WRAP_SLOTS; i++) {
+        wrap_slot_t *slot = &wrap_slots[i][id];
+        if (slot->wrapper == wrapper && fs->decompressor == trampolines[i][id]) {
+            ok = true; // Already wrapped
+        } else if (!slot->wrapper || (slot->wrapper == wrapper && slot->inner == fs->decompressor)) {
+            slot->wrapper    = wrapper;
+            slot->inner      = fs->decompressor;
+            fs->decompressor = trampolines[i][id];
+            ok               = true;
+        }
+    }
+    pthread_mutex_unlock(&wrap_lock);
+    return ok;
+}
@@ -0,0 +1,40 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "decompress.h"
+#include "fs.h"
+
+#include <stdbool.h>
+
+// Decompressor for type that reuses a per-thread context for every block, NULL if squashfuse has to do it
+sqfs_decompressor private_decompressor_get(sqfs_compression_type type);
+
+#ifdef PRIVATE_SINGLE_COMPRESSION
+// The only decompressor of a runtime built with a single entry in -Dcompressors
+sqfs_err private_decompress_single(void *in, size_t insz, void *out, size_t *outsz);
+#endif
+
+// Call decompressor (fs->decompressor or the inner function of a hook). With a single compiled in decompressor this is
+// a direct call that can be inlined, the pointer is only followed if something else was installed.
+static inline sqfs_err
+private_decompress(sqfs_decompressor decompressor, void *in, size_t insz, void *out, size_t *outsz) {
+#ifdef PRIVATE_SINGLE_COMPRESSION
+    if (decompressor == private_decompress_single) return private_decompress_single(in, insz, out, outsz);
+#endif
+    return decompressor(in, insz, out, outsz);
+}
+
+// Replace the squashfuse decompressor of fs. Must be called before fs is used by multiple threads and before any other
+// decompressor hook (statistics), it only replaces the plain squashfuse function.
+void private_decompress_hook(sqfs *fs);
+
+// Called instead of the decompressor of a wrapped image. inner is the decompressor it replaced, call it with
+// private_decompress.
+typedef sqfs_err (*private_decompress_wrapper_t)(
+    sqfs_decompressor inner, unsigned compression, void *in, size_t insz, void *out, size_t *outsz);
+
+// Make fs->decompressor call wrapper, wrappers added later run first. Must be called before fs is used by multiple
+// threads. Returns false if the compression of fs has no free wrapper slot left.
+bool private_decompress_wrap(sqfs *fs, private_decompress_wrapper_t wrapper);
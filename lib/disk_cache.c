@@ -0,0 +1,316 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Persistent cache of decompressed squashfs blocks, shared by all mount daemons of a user. The block reads of
+ * image_map.c look blocks up here before decompressing them, so data blocks, fragments and the preloaded metadata are
+ * covered. Metadata that squashfuse reads on its own is not.
+ *
+ * Blocks are keyed by the identity of their image (private_image_digest) and their position in it. Both are known
+ * without looking at the block, so a lookup costs no more than a hash table probe. The daemon computes the identity
+ * from the image file it opened itself, an image can therefore not produce the key of a block of another image.
+ *
+ * File layout ($XDG_CACHE_HOME/appimage/blocks-<version>-<budget>.cache, mmap'ed as a whole):
+ *
+ *   header      | magic, version, geometry and the write position of the data ring
+ *   slots       | open addressing hash table of (tag, image, position, offset, size, checksum)
+ *   data        | ring buffer of decompressed blocks, old data is overwritten once the budget is used up
+ *
+ * Nothing locks: writers reserve their range of the ring with an atomic update of the shared write position, a slot
+ * is published by setting its tag last, and every hit is verified against the checksum of the decompressed data. Two
+ * writers racing for one slot, a torn write (crash) or data that was overwritten by the ring buffer are thus never
+ * returned, they are simply a miss.
+ *
+ * Other daemons may have the file mapped at any time, so it is never truncated or resized once it was created (that
+ * would SIGBUS them). The version and the budget are part of the file name instead, a daemon with another budget uses
+ * another file. A file with an unexpected size or header is left alone and the cache is disabled. All of its space is
+ * allocated when it is created: writing to a hole of a shared mapping on a full disk would SIGBUS as well.
+ */
+
+#define _DEFAULT_SOURCE
+#include <features.h>
+
+#include "disk_cache.h"
+#include "libruntime.h"
+#include "sha256.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DC_MAGIC "AIBLKCCH"
+#define DC_VERSION 3
+#define DC_HEADER_SIZE 4096
+#define DC_SLOT_BYTES (16 * 1024) // One slot per 16 KiB of data
+#define DC_PROBES 8
+#define DC_ALIGN 64
+#define DC_IMAGE_WORDS (PRIVATE_SHA256_SIZE / sizeof(uint64_t))
+
+typedef struct dc_header {
+    char             magic[8];
+    uint32_t         version;
+    uint32_t         num_slots;
+    uint64_t         data_size;
+    _Atomic uint64_t write_pos;
+} dc_header_t;
+
+typedef struct dc_key {
+    uint64_t tag; // Hash of image and pos, never 0 (see make_key)
+    uint64_t image[DC_IMAGE_WORDS];
+    uint64_t pos;
+} dc_key_t;
+
+typedef struct dc_slot {
+    _Atomic uint64_t tag;                   // 0 = empty, written last
+    uint64_t         image[DC_IMAGE_WORDS]; // private_image_digest
+    uint64_t         pos;                   // Of the compressed block in the image
+    uint64_t         offset;
+    uint32_t         size;    // Decompressed
+    uint32_t         in_size; // Compressed
+    uint64_t         checksum;
+} dc_slot_t;
+
+typedef struct disk_cache {
+    int             fd;
+    uint8_t *       map;
+    size_t          map_size;
+    dc_header_t *   header;
+    dc_slot_t *     slots;
+    uint8_t *       data;
+
+    atomic_ullong hits;
+    atomic_ullong misses;
+    atomic_ullong inserts;
+    atomic_ullong corrupt;
+} disk_cache_t;
+
+static disk_cache_t *cache = NULL;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return h;
+}
+
+/* Fast non-cryptographic hash, four independent lanes to keep the multipliers busy. Only used as checksum against torn
+   and overwritten entries. */
+static uint64_t hash64(const void *data, size_t size, uint64_t seed) {
+    const uint8_t *p       = data;
+    const uint64_t prime1  = UINT64_C(0x9E3779B185EBCA87);
+    const uint64_t prime2  = UINT64_C(0xC2B2AE3D27D4EB4F);
+    uint64_t       lane[4] = {seed + prime1, seed ^ prime2, seed - prime1, ~seed};
+    size_t         i       = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        for (int l = 0; l < 4; l++) {
+            uint64_t w;
+            memcpy(&w, p + i + l * 8, sizeof(w));
+            lane[l] = rotl64(lane[l] + w * prime2, 31) * prime1;
+        }
+    }
+
+    uint64_t h = rotl64(lane[0], 1) + rotl64(lane[1], 7) + rotl64(lane[2], 12) + rotl64(lane[3], 18) + size;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        h = rotl64(h ^ (w * prime2), 27) * prime1;
+    }
+    for (; i < size; i++) h = rotl64(h ^ (p[i] * prime1), 11) * prime2;
+    return mix64(h);
+}
+
+static bool init_file(disk_cache_t *dc, size_t budget) {
+    const uint32_t num_slots = budget / DC_SLOT_BYTES > 1024 ? (uint32_t)(budget / DC_SLOT_BYTES) : 1024;
+    const size_t   total     = DC_HEADER_SIZE + (size_t)num_slots * sizeof(dc_slot_t) + budget;
+    struct stat    st;
+    dc_header_t    header;
+
+    if (flock(dc->fd, LOCK_EX) != 0) return false;
+
+    bool valid = fstat(dc->fd, &st) == 0;
+    if (valid && st.st_size == 0) {
+        // Created by us (or by a daemon that failed before sizing it), nobody can have it mapped yet
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, DC_MAGIC, 8);
+        header.version   = DC_VERSION;
+        header.num_slots = num_slots;
+        header.data_size = budget;
+
+        // Allocate every block now, a full disk must fail here and not in a write to the mapping
+        int res = posix_fallocate(dc->fd, 0, (off_t)total);
+        valid   = res == 0 && pwrite(dc->fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+        if (!valid) {
+            if (res != 0) fprintf(stderr, "disk cache: failed to allocate %zu bytes: %s\n", total, strerror(res));
+            // Empty again, so that the next daemon retries
+            if (ftruncate(dc->fd, 0) != 0) perror("disk cache: ftruncate error");
+        }
+    }
+    flock(dc->fd, LOCK_UN);
+    if (!valid) return false;
+
+    dc->map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, dc->fd, 0);
+    if (dc->map == MAP_FAILED) return false;
+    dc->map_size = total;
+
+    // Check what is actually mapped, the file may have been changed between the checks above and mmap
+    const dc_header_t *mapped = (const dc_header_t *)dc->map;
+    if (fstat(dc->fd, &st) != 0 || (size_t)st.st_size != total || memcmp(mapped->magic, DC_MAGIC, 8) != 0 ||
+        mapped->version != DC_VERSION || mapped->num_slots != num_slots || mapped->data_size != budget) {
+        return false;
+    }
+    dc->header = (dc_header_t *)dc->map;
+    dc->slots  = (dc_slot_t *)(dc->map + DC_HEADER_SIZE);
+    dc->data   = dc->map + DC_HEADER_SIZE + (size_t)num_slots * sizeof(dc_slot_t);
+    return true;
+}
+
+bool private_disk_cache_open(size_t budget) {
+    if (cache) return true;
+
+    char *dir = appimage_get_cache_dir("");
+    if (!dir) return false;
+
+    // One file per geometry, see the top of this file
+    const size_t path_size = strlen(dir) + 64;
+    char *       path      = malloc(path_size);
+    if (path) snprintf(path, path_size, "%s/blocks-%u-%zu.cache", dir, DC_VERSION, budget);
+    free(dir);
+    if (!path) return false;
+
+    disk_cache_t *dc = calloc(1, sizeof(disk_cache_t));
+    if (dc) {
+        dc->map = MAP_FAILED;
+        dc->fd  = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    }
+    free(path);
+
+    if (!dc || dc->fd == -1 || !init_file(dc, budget)) {
+        fprintf(stderr, "disk cache: failed to open the cache file, disabling it\n");
+        if (dc && dc->map != MAP_FAILED) munmap(dc->map, dc->map_size);
+        if (dc && dc->fd != -1) close(dc->fd);
+        free(dc);
+        return false;
+    }
+
+    cache = dc;
+    return true;
+}
+
+void private_disk_cache_close(void) {
+    if (!cache) return;
+    munmap(cache->map, cache->map_size);
+    close(cache->fd);
+    free(cache);
+    cache = NULL;
+}
+
+static void make_key(const uint8_t *image, uint64_t pos, dc_key_t *key) {
+    memcpy(key->image, image, sizeof(key->image));
+    key->pos = pos;
+    key->tag = mix64(key->image[0] ^ mix64(pos + 1));
+    if (key->tag == 0) key->tag = 1; // 0 marks empty slots
+}
+
+static bool slot_matches(const dc_slot_t *slot, const dc_key_t *key) {
+    return slot->pos == key->pos && memcmp(slot->image, key->image, sizeof(key->image)) == 0;
+}
+
+bool private_disk_cache_get(const uint8_t *image, uint64_t pos, size_t in_size, void *out, size_t *outsz) {
+    disk_cache_t *dc = cache;
+    dc_key_t      key;
+    if (!dc) return false;
+    make_key(image, pos, &key);
+
+    const uint32_t num_slots = dc->header->num_slots;
+    for (uint32_t p = 0; p < DC_PROBES; p++) {
+        dc_slot_t *slot = &dc->slots[(key.tag + p) % num_slots];
+        if (atomic_load_explicit(&slot->tag, memory_order_acquire) != key.tag) continue;
+
+        // Copy the slot first, a writer may reuse it at any time
+        uint64_t offset   = slot->offset;
+        uint32_t size     = slot->size;
+        uint64_t checksum = slot->checksum;
+        if (!slot_matches(slot, &key) || slot->in_size != in_size) continue;
+        if (size > *outsz || offset > dc->header->data_size || size > dc->header->data_size - offset) continue;
+
+        memcpy(out, dc->data + offset, size);
+        if (hash64(out, size, key.tag) != checksum) {
+            atomic_fetch_add(&dc->corrupt, 1);
+            break;
+        }
+
+        *outsz = size;
+        atomic_fetch_add(&dc->hits, 1);
+        return true;
+    }
+    atomic_fetch_add(&dc->misses, 1);
+    return false;
+}
+
+void private_disk_cache_put(const uint8_t *image, uint64_t pos, size_t in_size, const void *out, size_t size) {
+    disk_cache_t *dc = cache;
+    dc_key_t      key;
+    if (!dc) return;
+
+    dc_header_t *  header    = dc->header;
+    const uint64_t data_size = header->data_size;
+    const uint32_t num_slots = header->num_slots;
+
+    // Blocks bigger than an eighth of the budget would churn the whole ring
+    if (size == 0 || size > data_size / 8 || size > UINT32_MAX || in_size > UINT32_MAX) return;
+    make_key(image, pos, &key);
+
+    // Reserve [start, start + size) of the ring, the daemons of other images do the same through the shared header.
+    // Wrapping around overwrites the oldest entries, which then fail their checksum.
+    uint64_t next, start, cur = atomic_load(&header->write_pos);
+    do {
+        start = cur <= data_size && size <= data_size - cur ? cur : 0;
+        next  = (start + size + DC_ALIGN - 1) & ~(uint64_t)(DC_ALIGN - 1);
+    } while (!atomic_compare_exchange_weak(&header->write_pos, &cur, next));
+
+    // Prefer an empty slot or the one of the same block, otherwise replace the first one of the probe sequence
+    dc_slot_t *slot = &dc->slots[key.tag % num_slots];
+    for (uint32_t p = 0; p < DC_PROBES; p++) {
+        dc_slot_t *it  = &dc->slots[(key.tag + p) % num_slots];
+        uint64_t   tag = atomic_load(&it->tag);
+        if (tag == 0 || (tag == key.tag && slot_matches(it, &key))) {
+            slot = it;
+            break;
+        }
+    }
+
+    // Unpublish the slot while it is updated, then publish it by writing the tag last
+    atomic_store_explicit(&slot->tag, 0, memory_order_release);
+    memcpy(dc->data + start, out, size);
+    memcpy(slot->image, key.image, sizeof(slot->image));
+    slot->pos      = key.pos;
+    slot->offset   = start;
+    slot->size     = (uint32_t)size;
+    slot->in_size  = (uint32_t)in_size;
+    slot->checksum = hash64(out, size, key.tag);
+    atomic_store_explicit(&slot->tag, key.tag, memory_order_release);
+    atomic_fetch_add(&dc->inserts, 1);
+}
+
+void private_disk_cache_get_stats(private_disk_cache_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!cache) return;
+    stats->hits    = atomic_load(&cache->hits);
+    stats->misses  = atomic_load(&cache->misses);
+    stats->inserts = atomic_load(&cache->inserts);
+    stats->corrupt = atomic_load(&cache->corrupt);
+}
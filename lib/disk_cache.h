@@ -0,0 +1,28 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct private_disk_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t corrupt; // Entries that failed the checksum (overwritten or torn writes)
+} private_disk_cache_stats_t;
+
+// Open (or create) the persistent cache file of budget bytes in the user cache directory. The cache is process wide.
+bool private_disk_cache_open(size_t budget);
+void private_disk_cache_close(void);
+
+// Decompressed block at pos of image (its private_image_digest) that was compressed to in_size bytes. Returns false
+// if it is not cached or larger than *outsz. Safe to call from any thread.
+bool private_disk_cache_get(const uint8_t *image, uint64_t pos, size_t in_size, void *out, size_t *outsz);
+
+// Store the decompressed block of size bytes at pos of image. Safe to call from any thread.
+void private_disk_cache_put(const uint8_t *image, uint64_t pos, size_t in_size, const void *out, size_t size);
+
+void private_disk_cache_get_stats(private_disk_cache_stats_t *stats);
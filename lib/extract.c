@@ -4,6 +4,8 @@
 // SPDX-License-Identifier: MIT
 
 #include "libruntime.h"
+#include "image_map.h"
+#include "decompress_ctx.h"
 
 #define _GNU_SOURCE
 
@@ -17,6 +19,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fnmatch.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 /* Fill in a stat structure. Does not set st_ino */
@@ -51,15 +54,55 @@ sqfs_err private_sqfs_stat(sqfs *fs, sqfs_inode *inode, struct stat *st) {
     return SQFS_OK;
 }
 
+/*
+ * Write the full blocks of a file straight from the mapped image: uncompressed blocks without a copy, compressed ones
+ * decompressed from the mapping into buf. written is set to the size of the written part, the tail of the file in a
+ * fragment is left to sqfs_read_range, which caches the fragment blocks shared by many small files.
+ */
+static bool write_mapped_blocks(
+    sqfs *fs, const private_image_map_t *map, sqfs_inode *inode, char *buf, FILE *f, sqfs_off_t *written) {
+    const uint64_t file_size  = inode->xtra.reg.file_size;
+    const uint64_t block_size = fs->sb.block_size;
+    sqfs_blocklist bl;
+
+    *written = 0;
+    sqfs_blocklist_init(fs, inode, &bl);
+    while (bl.remain > 0) {
+        if (sqfs_blocklist_next(&bl)) return false;
+
+        const size_t   size = file_size - bl.pos < block_size ? file_size - bl.pos : block_size;
+        const uint8_t *src  = private_image_map_get(map, bl.block, bl.input_size);
+        const char *   data = buf;
+        if (bl.input_size == 0) {
+            memset(buf, 0, size); // Sparse block
+        } else if (!src) {
+            return false;
+        } else if (SQUASHFS_COMPRESSED_BLOCK(bl.header)) {
+            size_t out_size = block_size;
+            if (private_decompress(fs->decompressor, (void *)src, bl.input_size, buf, &out_size) || out_size < size) {
+                return false;
+            }
+        } else {
+            if (bl.input_size < size) return false;
+            data = (const char *)src;
+        }
+
+        if (fwrite(data, 1, size, f) != size) return false;
+        *written += (sqfs_off_t)size;
+    }
+    return true;
+}
+
 bool appimage_self_extract(appimage_context_t *const context,
                            const char *const         _prefix,
                            const char *const         _pattern,
                            const bool                overwrite,
                            const bool                verbose) {
-    sqfs_err      err = SQFS_OK;
-    sqfs_traverse trv;
-    sqfs          fs;
-    char          prefixed_path_to_extract[1024];
+    sqfs_err            err = SQFS_OK;
+    sqfs_traverse       trv;
+    sqfs                fs;
+    char                prefixed_path_to_extract[1024];
+    private_image_map_t map;
 
     // local copy we can modify safely
     // allocate 1 more byte than we would need so we can add a trailing slash if there is none yet
@@ -80,6 +123,7 @@ bool appimage_self_extract(appimage_context_t *const context,
         fprintf(stderr, "Failed to open squashfs image\n");
         return false;
     };
+    private_decompress_hook(&fs);
 
     // track duplicate inodes for hardlinks
     char **created_inode = calloc(fs.sb.inodes, sizeof(char *));
@@ -94,6 +138,14 @@ bool appimage_self_extract(appimage_context_t *const context,
         return false;
     }
 
+    // Decompress straight from the page cache, the image is mostly read front to back
+    char *block_buf = NULL;
+    if (private_image_map_open(&map, &fs)) {
+        private_image_map_advise(&map, 0, map.size, MADV_SEQUENTIAL);
+        block_buf = malloc(fs.sb.block_size);
+        if (!block_buf) private_image_map_close(&map);
+    }
+
     bool rv = true;
 
     while (sqfs_traverse_next(&trv, &err)) {
@@ -179,7 +231,11 @@ bool appimage_self_extract(appimage_context_t *const context,
                             rv = false;
                             break;
                         }
-                        while ((uint64_t)bytes_already_read < inode.xtra.reg.file_size) {
+                        if (map.data && !write_mapped_blocks(&fs, &map, &inode, block_buf, f, &bytes_already_read)) {
+                            fprintf(stderr, "Failed to extract %s\n", prefixed_path_to_extract);
+                            rv = false;
+                        }
+                        while (rv && (uint64_t)bytes_already_read < inode.xtra.reg.file_size) {
                             char buf[bytes_at_a_time];
                             if (sqfs_read_range(&fs, &inode, bytes_already_read, &bytes_at_a_time, buf)) {
                                 perror("sqfs_read_range error");
@@ -228,6 +284,8 @@ bool appimage_self_extract(appimage_context_t *const context,
         rv = false;
     }
     sqfs_traverse_close(&trv);
+    private_image_map_close(&map);
+    free(block_buf);
     sqfs_fd_close(fs.fd);
 
     return rv;
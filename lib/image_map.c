@@ -0,0 +1,183 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Memory mapped image access. squashfuse reads every block with pread into a freshly allocated buffer and then
+ * decompresses it into a second one. With the whole image mapped read only, the decompressor reads the compressed
+ * data straight from the page cache, which saves the syscall, the allocation and the copy per block. Uncompressed
+ * blocks can even be handed out as slices of the mapping (see private_image_map_get).
+ *
+ * The mapping starts at the beginning of the file since mmap offsets have to be page aligned, data points to the
+ * squashfs image behind the runtime.
+ *
+ * The block reads here are also where the disk cache is consulted: unlike a decompressor hook they know the image and
+ * the position of the block, which is its key.
+ */
+
+#include "image_map.h"
+#include "disk_cache.h"
+#include "libappimage/appimage_shared.h"
+#include "decompress_ctx.h"
+#include "squashfs_fs.h"
+#include "swap.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool private_image_map_open(private_image_map_t *map, const sqfs *fs) {
+    struct stat st;
+    memset(map, 0, sizeof(*map));
+    if (fstat(fs->fd, &st) == -1 || st.st_size <= 0 || (uint64_t)st.st_size <= fs->offset) return false;
+    if ((uint64_t)st.st_size > SIZE_MAX) return false;
+
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fs->fd, 0);
+    if (base == MAP_FAILED) return false;
+
+    map->base   = base;
+    map->length = (size_t)st.st_size;
+    map->data   = (const uint8_t *)base + fs->offset;
+    map->size   = map->length - fs->offset;
+    return true;
+}
+
+void private_image_map_close(private_image_map_t *map) {
+    if (map->base) munmap(map->base, map->length);
+    memset(map, 0, sizeof(*map));
+}
+
+const uint8_t *private_image_map_get(const private_image_map_t *map, uint64_t pos, size_t size) {
+    if (!map || !map->data || pos > map->size || size > map->size - pos) return NULL;
+    return map->data + pos;
+}
+
+void private_image_map_advise(const private_image_map_t *map, uint64_t pos, size_t size, int advice) {
+    const uint8_t *start = private_image_map_get(map, pos, size);
+    if (!start || size == 0) return;
+
+    // madvise wants a page aligned address
+    const uintptr_t page  = (uintptr_t)sysconf(_SC_PAGESIZE);
+    const uintptr_t first = (uintptr_t)start & ~(page - 1);
+    madvise((void *)first, (uintptr_t)start + size - first, advice);
+}
+
+bool private_image_map_cache(private_image_map_t *map, const sqfs *fs) {
+    map->disk_cache = private_image_digest(fs, map->id);
+    return map->disk_cache;
+}
+
+bool private_image_digest(const sqfs *fs, uint8_t digest[PRIVATE_SHA256_SIZE]) {
+    struct stat st;
+    if (fstat(fs->fd, &st) != 0) return false;
+
+    // A fixed layout instead of struct stat, which has padding and differs between architectures
+    const uint64_t fields[] = {
+        (uint64_t)st.st_dev,
+        (uint64_t)st.st_ino,
+        (uint64_t)st.st_size,
+        (uint64_t)st.st_mtim.tv_sec,
+        (uint64_t)st.st_mtim.tv_nsec,
+        (uint64_t)fs->offset,
+        fs->sb.mkfs_time,
+        fs->sb.bytes_used,
+        fs->sb.inodes,
+    };
+    private_sha256(fields, sizeof(fields), digest);
+    return true;
+}
+
+char *private_image_id(const sqfs *fs) {
+    uint8_t digest[PRIVATE_SHA256_SIZE];
+    if (!private_image_digest(fs, digest)) return NULL;
+    return appimage_hexlify(digest, sizeof(digest));
+}
+
+/* [pos, pos + size) of the image, a slice of the mapping or read into *buf (freed by the caller). NULL on errors. */
+static const uint8_t *
+image_bytes(const private_image_map_t *map, const sqfs *fs, uint64_t pos, size_t size, uint8_t **buf) {
+    *buf = NULL;
+    if (map->data) return private_image_map_get(map, pos, size);
+
+    if (!(*buf = malloc(size ? size : 1))) return NULL;
+    for (size_t done = 0; done < size;) {
+        ssize_t res = pread(fs->fd, *buf + done, size - done, (off_t)(fs->offset + pos + done));
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return NULL;
+        done += (size_t)res;
+    }
+    return *buf;
+}
+
+/* Mirrors sqfs_block_read */
+static sqfs_err block_read(const private_image_map_t *map,
+                           sqfs *                     fs,
+                           uint64_t                   pos,
+                           bool                       compressed,
+                           uint32_t                   size,
+                           size_t                     outsize,
+                           sqfs_block **              block) {
+    sqfs_err err = SQFS_ERR;
+    uint8_t *buf = NULL;
+    if (!(*block = malloc(sizeof(sqfs_block)))) return SQFS_ERR;
+    if (!compressed) outsize = size;
+    if (!((*block)->data = malloc(outsize ? outsize : 1))) goto error;
+
+    const bool cached = compressed && map->disk_cache;
+    if (cached && private_disk_cache_get(map->id, pos, size, (*block)->data, &outsize)) {
+        (*block)->size = outsize;
+        return SQFS_OK;
+    }
+
+    const uint8_t *src = image_bytes(map, fs, pos, size, &buf);
+    if (!src) goto error;
+    if (compressed) {
+        // The decompressors do not write to their input, it is only not declared const
+        if ((err = private_decompress(fs->decompressor, (void *)src, size, (*block)->data, &outsize))) goto error;
+        if (cached) private_disk_cache_put(map->id, pos, size, (*block)->data, outsize);
+    } else {
+        memcpy((*block)->data, src, size);
+    }
+    free(buf);
+    (*block)->size = outsize;
+    return SQFS_OK;
+
+error:
+    free(buf);
+    free((*block)->data);
+    free(*block);
+    *block = NULL;
+    return err;
+}
+
+sqfs_err private_image_md_block_read(const private_image_map_t *map,
+                                     sqfs *                     fs,
+                                     uint64_t                   pos,
+                                     size_t *                   data_size,
+                                     sqfs_block **              block) {
+    uint8_t *      buf;
+    const uint8_t *raw_hdr = image_bytes(map, fs, pos, sizeof(uint16_t), &buf);
+    uint16_t       hdr, size;
+    bool           compressed;
+    if (raw_hdr) memcpy(&hdr, raw_hdr, sizeof(hdr));
+    free(buf);
+    if (!raw_hdr) return SQFS_ERR;
+
+    sqfs_swapin16(&hdr);
+    sqfs_md_header(hdr, &compressed, &size);
+    *data_size = sizeof(hdr) + size;
+    return block_read(map, fs, pos + sizeof(hdr), compressed, size, SQUASHFS_METADATA_SIZE, block);
+}
+
+sqfs_err private_image_data_block_read(const private_image_map_t *map,
+                                       sqfs *                     fs,
+                                       uint64_t                   pos,
+                                       uint32_t                   header,
+                                       sqfs_block **              block) {
+    uint32_t size;
+    bool     compressed;
+    sqfs_data_header(header, &compressed, &size);
+    return block_read(map, fs, pos, compressed, size, fs->sb.block_size, block);
+}
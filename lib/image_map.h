@@ -0,0 +1,56 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "fs.h"
+#include "sha256.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Read only mapping of a squashfs image. All functions accept an unmapped (zeroed) map and then fall back to pread.
+typedef struct private_image_map {
+    void *         base;                    // Mapping of the whole image file, NULL if not mapped
+    size_t         length;                  // Of the mapping
+    const uint8_t *data;                    // Start of the squashfs image (fs->offset)
+    size_t         size;                    // Bytes from data to the end of the file
+    bool           disk_cache;              // Decompressed blocks go through the disk cache (private_image_map_cache)
+    uint8_t        id[PRIVATE_SHA256_SIZE]; // private_image_digest, the disk cache key of the image
+} private_image_map_t;
+
+// Map the image of fs. Fails for empty files and if there is not enough address space.
+bool private_image_map_open(private_image_map_t *map, const sqfs *fs);
+void private_image_map_close(private_image_map_t *map);
+
+// Slice of size bytes at pos in the image, NULL if the image is not mapped or pos is out of range
+const uint8_t *private_image_map_get(const private_image_map_t *map, uint64_t pos, size_t size);
+
+// madvise(2) the pages covering [pos, pos + size) of the image
+void private_image_map_advise(const private_image_map_t *map, uint64_t pos, size_t size, int advice);
+
+// Look up and store the decompressed blocks read through map in the disk cache, which must be open already. Call after
+// private_image_map_open.
+bool private_image_map_cache(private_image_map_t *map, const sqfs *fs);
+
+// Identity of the image of fs: SHA-256 of the device, inode, size and mtime of the image file, the offset of the
+// squashfs image and its super block
+bool private_image_digest(const sqfs *fs, uint8_t digest[PRIVATE_SHA256_SIZE]);
+
+// private_image_digest as hex string for naming per-image cache files. Returns a malloc'ed string, NULL on errors.
+char *private_image_id(const sqfs *fs);
+
+// Like sqfs_md_block_read and sqfs_data_block_read, but the compressed data is decompressed straight from the mapping
+// and uncompressed blocks are copied from it (without a mapping, they pread like squashfuse). Decompressed blocks go
+// through the disk cache if it is enabled for map. Safe to call concurrently.
+sqfs_err private_image_md_block_read(const private_image_map_t *map,
+                                     sqfs *                     fs,
+                                     uint64_t                   pos,
+                                     size_t *                   data_size,
+                                     sqfs_block **              block);
+sqfs_err private_image_data_block_read(const private_image_map_t *map,
+                                       sqfs *                     fs,
+                                       uint64_t                   pos,
+                                       uint32_t                   header,
+                                       sqfs_block **              block);
@@ -0,0 +1,175 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Kernel squashfs mounts for privileged launches. With APPIMAGE_KERNEL_MOUNT=1 and CAP_SYS_ADMIN (root, CI containers,
+ * system services), the image is attached to a read only loop device at fs_offset and mounted with the squashfs
+ * driver of the kernel. Reads are then served from the page cache by the multi-threaded kernel decompressors, without
+ * a round trip through a FUSE daemon per request.
+ *
+ * There is no daemon that could unmount when the application exits, a small watcher process takes over that part: it
+ * holds the write end of a pipe whose read end is inherited by the application (like the keepalive pipe of a FUSE
+ * mount) and detaches the mount once all readers are gone. The loop device is set up with LO_FLAGS_AUTOCLEAR and
+ * vanishes with the mount.
+ */
+
+#define _GNU_SOURCE
+
+#include "private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/capability.h>
+#include <linux/loop.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#define LOOP_ATTEMPTS 8
+
+bool private_kernel_mount_enabled(void) {
+    struct __user_cap_header_struct header = {_LINUX_CAPABILITY_VERSION_3, 0};
+    struct __user_cap_data_struct   data[_LINUX_CAPABILITY_U32S_3];
+
+    // Opt-in: the kernel squashfs driver would parse an image that may come from anywhere with full privileges
+    const char *env = getenv("APPIMAGE_KERNEL_MOUNT");
+    if (!env || strcmp(env, "1") != 0) return false;
+    return syscall(SYS_capget, &header, data) == 0 && (data[0].effective & (UINT32_C(1) << CAP_SYS_ADMIN));
+}
+
+/* Attach [offset, end) of image_fd to a free loop device, returns the loop device fd */
+static int attach_loop(int image_fd, size_t offset, char *dev, size_t size) {
+    struct loop_info64 info;
+    int                loop_fd = -1;
+    int                ctl_fd  = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+    if (ctl_fd == -1) return -1;
+
+    memset(&info, 0, sizeof(info));
+    info.lo_offset = offset;
+    info.lo_flags  = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR;
+
+    // Another process may grab the free device between LOOP_CTL_GET_FREE and attaching it
+    for (int attempt = 0; attempt < LOOP_ATTEMPTS && loop_fd == -1; attempt++) {
+        int num = ioctl(ctl_fd, LOOP_CTL_GET_FREE);
+        if (num < 0) break;
+        snprintf(dev, size, "/dev/loop%d", num);
+        int fd = open(dev, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) break;
+
+        int error = 0;
+#ifdef LOOP_CONFIGURE
+        // Linux 5.8: attach and configure in one step
+        struct loop_config config;
+        memset(&config, 0, sizeof(config));
+        config.fd   = (uint32_t)image_fd;
+        config.info = info;
+        if (ioctl(fd, LOOP_CONFIGURE, &config) == 0) {
+            loop_fd = fd;
+            break;
+        }
+        error = errno;
+#endif
+        if (error == 0 || error == EINVAL || error == ENOTTY) {
+            if (ioctl(fd, LOOP_SET_FD, image_fd) == 0) {
+                if (ioctl(fd, LOOP_SET_STATUS64, &info) == 0) {
+                    loop_fd = fd;
+                    break;
+                }
+                ioctl(fd, LOOP_CLR_FD, 0);
+            }
+            error = errno;
+        }
+
+        close(fd);
+        if (error != EBUSY) break;
+    }
+
+    close(ctl_fd);
+    return loop_fd;
+}
+
+static bool mount_squashfs(const char *const dev, const char *const mount_path) {
+#if defined(SYS_fsopen) && defined(FSOPEN_CLOEXEC)
+    // The new mount API (Linux 5.2), the classic mount(2) below is the fallback for older kernels
+    int fs_fd = (int)syscall(SYS_fsopen, "squashfs", FSOPEN_CLOEXEC);
+    if (fs_fd != -1) {
+        int mnt_fd = -1;
+
+        // Without "ro", the superblock would open the read only loop device for writing
+        bool ok = syscall(SYS_fsconfig, fs_fd, FSCONFIG_SET_STRING, "source", dev, 0) == 0 &&
+                  syscall(SYS_fsconfig, fs_fd, FSCONFIG_SET_FLAG, "ro", NULL, 0) == 0 &&
+                  syscall(SYS_fsconfig, fs_fd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) == 0 &&
+                  (mnt_fd = (int)syscall(SYS_fsmount,
+                                         fs_fd,
+                                         FSMOUNT_CLOEXEC,
+                                         MOUNT_ATTR_RDONLY | MOUNT_ATTR_NOSUID | MOUNT_ATTR_NODEV)) != -1 &&
+                  syscall(SYS_move_mount, mnt_fd, "", AT_FDCWD, mount_path, MOVE_MOUNT_F_EMPTY_PATH) == 0;
+        if (mnt_fd != -1) close(mnt_fd);
+        close(fs_fd);
+        return ok;
+    }
+    if (errno != ENOSYS) return false;
+#endif
+    return mount(dev, mount_path, "squashfs", MS_RDONLY | MS_NOSUID | MS_NODEV, NULL) == 0;
+}
+
+/* Detach the mount once the application and all of its children exited */
+static bool start_watcher(const char *const mount_path) {
+    int keepalive[2];
+    if (pipe(keepalive) == -1) return false;
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(keepalive[0]);
+        close(keepalive[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        // The watcher must neither hold the terminal nor become a zombie of the app
+        close(keepalive[0]);
+        private_daemonize();
+        signal(SIGPIPE, SIG_IGN);
+
+        char buf[32];
+        memset(buf, 'x', sizeof(buf));
+        while (write(keepalive[1], buf, sizeof(buf)) != -1 || errno == EINTR) {}
+
+        umount2(mount_path, MNT_DETACH);
+        rmdir(mount_path);
+        _exit(EXIT_SUCCESS);
+    }
+
+    // The read end stays open across exec, the application keeps the mount alive
+    close(keepalive[1]);
+    waitpid(pid, NULL, 0);
+    return true;
+}
+
+bool private_kernel_mount(const char *const image, size_t offset, const char *const mount_path) {
+    char dev[32];
+    int  image_fd = open(image, O_RDONLY | O_CLOEXEC);
+    if (image_fd == -1) return false;
+
+    int loop_fd = attach_loop(image_fd, offset, dev, sizeof(dev));
+    close(image_fd);
+    if (loop_fd == -1) return false;
+
+    // The mount holds the loop device from now on, closing the last fd detaches it if mounting failed
+    bool ok = mount_squashfs(dev, mount_path);
+    close(loop_fd);
+    if (!ok) return false;
+
+    if (!start_watcher(mount_path)) {
+        umount2(mount_path, MNT_DETACH);
+        return false;
+    }
+    return true;
+}
@@ -9,6 +9,52 @@ extern "C" {
 #include <stdint.h>
 #include <sys/types.h>
 
+/*
+ * Reentrant handle to an AppImage file. The file is opened and mapped once and the ELF section table is parsed and
+ * cached on open, so that all accessors below work without touching the file system again.
+ *
+ * A handle may be shared between threads as long as it is not closed concurrently.
+ */
+typedef struct appimage_image appimage_image_t;
+
+/*
+ * Open an AppImage (or any ELF file). Returns NULL (and prints an error) if the file can not be opened or is not a
+ * valid ELF file. The handle must be released with appimage_image_close().
+ */
+appimage_image_t *appimage_image_open(const char *fname);
+void              appimage_image_close(appimage_image_t *image);
+
+const char *   appimage_image_get_path(const appimage_image_t *image);
+int            appimage_image_get_fd(const appimage_image_t *image);
+size_t         appimage_image_get_size(const appimage_image_t *image);
+const uint8_t *appimage_image_get_data(const appimage_image_t *image);
+
+/*
+ * Size of the ELF part of the file, which is the offset of the embedded filesystem image.
+ */
+ssize_t appimage_image_get_elf_size(const appimage_image_t *image);
+
+/*
+ * Return the offset, and the length of an ELF section with a given name. Returns false if there is no such section.
+ */
+bool appimage_image_get_section(const appimage_image_t *image,
+                                const char *            section_name,
+                                unsigned long *         offset,
+                                unsigned long *         length);
+
+/*
+ * Return a NUL terminated copy of the contents of an ELF section, the update information or the signature. The
+ * returned string needs to be free()d. Returns NULL if the section does not exist.
+ */
+char *appimage_image_read_section(const appimage_image_t *image, const char *section_name);
+char *appimage_image_get_update_info(const appimage_image_t *image);
+char *appimage_image_get_signature(const appimage_image_t *image);
+
+/*
+ * Same as appimage_type2_digest_md5(), but operates on an already opened handle.
+ */
+bool appimage_image_digest_md5(const appimage_image_t *image, char *digest);
+
 /*
  * Return the offset, and the length of an ELF section with a given name in a given ELF file
  */
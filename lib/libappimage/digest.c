@@ -6,131 +6,50 @@
 #include "appimage_shared.h"
 #include "md5.h"
 
-bool appimage_type2_digest_md5(const char *path, char *digest) {
+/*
+ * Sections are replaced with NUL bytes, and the last chunk is padded with NUL bytes to the chunk size. A section
+ * starting exactly on a chunk boundary is *not* skipped; the original chunked reader behaved like this and we have to
+ * stay compatible with the digests that are already embedded in existing AppImages.
+ */
+static void skip_section(char *buffer, size_t chunk_size, size_t chunk_pos, unsigned long offset, unsigned long length) {
+    if (offset == 0 || length == 0 || offset % chunk_size == 0) return;
+    if (offset >= chunk_pos + chunk_size || offset + length <= chunk_pos) return;
+
+    size_t begin = offset > chunk_pos ? offset - chunk_pos : 0;
+    size_t end   = offset + length - chunk_pos;
+    if (end > chunk_size) end = chunk_size;
+    memset(buffer + begin, 0, end - begin);
+}
+
+bool appimage_image_digest_md5(const appimage_image_t *image, char *digest) {
     // skip digest, signature and key sections in digest calculation
     unsigned long digest_md5_offset = 0, digest_md5_length = 0;
-    if (!appimage_get_elf_section_offset_and_length(path, ".digest_md5", &digest_md5_offset, &digest_md5_length))
-        return false;
-
     unsigned long signature_offset = 0, signature_length = 0;
-    if (!appimage_get_elf_section_offset_and_length(path, ".sha256_sig", &signature_offset, &signature_length))
-        return false;
-
     unsigned long sig_key_offset = 0, sig_key_length = 0;
-    if (!appimage_get_elf_section_offset_and_length(path, ".sig_key", &sig_key_offset, &sig_key_length)) return false;
+    appimage_image_get_section(image, ".digest_md5", &digest_md5_offset, &digest_md5_length);
+    appimage_image_get_section(image, ".sha256_sig", &signature_offset, &signature_length);
+    appimage_image_get_section(image, ".sig_key", &sig_key_offset, &sig_key_length);
 
     Md5Context md5_context;
     Md5Initialise(&md5_context);
 
-    // read file in chunks
-    static const int chunk_size = 4096;
-
-    FILE *fp = fopen(path, "r");
-
-    // determine file size
-    fseek(fp, 0L, SEEK_END);
-    const long file_size = ftell(fp);
-    rewind(fp);
-
-    long bytes_left = file_size;
-
-    // if a section spans over more than a single chunk, we need emulate null bytes in the following chunks
-    ssize_t bytes_skip_following_chunks = 0;
-
-    while (bytes_left > 0) {
-        char buffer[chunk_size];
-
-        long current_position = ftell(fp);
-
-        ssize_t bytes_left_this_chunk = chunk_size;
-
-        // first, check whether there's bytes left that need to be skipped
-        if (bytes_skip_following_chunks > 0) {
-            ssize_t bytes_skip_this_chunk = (bytes_skip_following_chunks % chunk_size == 0)
-                                                ? chunk_size
-                                                : (bytes_skip_following_chunks % chunk_size);
-            bytes_left_this_chunk -= bytes_skip_this_chunk;
-
-            // we could just set it to 0 here, but it makes more sense to use -= for debugging
-            bytes_skip_following_chunks -= bytes_skip_this_chunk;
-
-            // make sure to skip these bytes in the file
-            fseek(fp, bytes_skip_this_chunk, SEEK_CUR);
-        }
-
-        // check whether there's a section in this chunk that we need to skip
-        if (digest_md5_offset != 0 && digest_md5_length != 0 && digest_md5_offset - current_position > 0 &&
-            digest_md5_offset - current_position < chunk_size) {
-            ssize_t begin_of_section = (digest_md5_offset - current_position) % chunk_size;
-            // read chunk before section
-            fread(buffer, sizeof(char), (size_t)begin_of_section, fp);
+    static const size_t  chunk_size = 4096;
+    const uint8_t *const data       = appimage_image_get_data(image);
+    const size_t         file_size  = appimage_image_get_size(image);
 
-            bytes_left_this_chunk -= begin_of_section;
-            bytes_left_this_chunk -= digest_md5_length;
+    for (size_t pos = 0; pos < file_size; pos += chunk_size) {
+        char   buffer[chunk_size];
+        size_t bytes_this_chunk = file_size - pos < chunk_size ? file_size - pos : chunk_size;
 
-            // if bytes_left is now < 0, the section exceeds the current chunk
-            // this amount of bytes needs to be skipped in the future sections
-            if (bytes_left_this_chunk < 0) {
-                bytes_skip_following_chunks = (size_t)(-1 * bytes_left_this_chunk);
-                bytes_left_this_chunk       = 0;
-            }
+        memset(buffer, 0, chunk_size);
+        memcpy(buffer, data + pos, bytes_this_chunk);
 
-            // if there's bytes left to read, we need to seek the difference between chunk's end and bytes_left
-            fseek(fp, (chunk_size - bytes_left_this_chunk - begin_of_section), SEEK_CUR);
-        }
-
-        // check whether there's a section in this chunk that we need to skip
-        if (signature_offset != 0 && signature_length != 0 && signature_offset - current_position > 0 &&
-            signature_offset - current_position < chunk_size) {
-            ssize_t begin_of_section = (signature_offset - current_position) % chunk_size;
-            // read chunk before section
-            fread(buffer, sizeof(char), (size_t)begin_of_section, fp);
-
-            bytes_left_this_chunk -= begin_of_section;
-            bytes_left_this_chunk -= signature_length;
-
-            // if bytes_left is now < 0, the section exceeds the current chunk
-            // this amount of bytes needs to be skipped in the future sections
-            if (bytes_left_this_chunk < 0) {
-                bytes_skip_following_chunks = (size_t)(-1 * bytes_left_this_chunk);
-                bytes_left_this_chunk       = 0;
-            }
-
-            // if there's bytes left to read, we need to seek the difference between chunk's end and bytes_left
-            fseek(fp, (chunk_size - bytes_left_this_chunk - begin_of_section), SEEK_CUR);
-        }
-
-        // check whether there's a section in this chunk that we need to skip
-        if (sig_key_offset != 0 && sig_key_length != 0 && sig_key_offset - current_position > 0 &&
-            sig_key_offset - current_position < chunk_size) {
-            ssize_t begin_of_section = (sig_key_offset - current_position) % chunk_size;
-            // read chunk before section
-            fread(buffer, sizeof(char), (size_t)begin_of_section, fp);
-
-            bytes_left_this_chunk -= begin_of_section;
-            bytes_left_this_chunk -= sig_key_length;
-
-            // if bytes_left is now < 0, the section exceeds the current chunk
-            // this amount of bytes needs to be skipped in the future sections
-            if (bytes_left_this_chunk < 0) {
-                bytes_skip_following_chunks = (size_t)(-1 * bytes_left_this_chunk);
-                bytes_left_this_chunk       = 0;
-            }
-
-            // if there's bytes left to read, we need to seek the difference between chunk's end and bytes_left
-            fseek(fp, (chunk_size - bytes_left_this_chunk - begin_of_section), SEEK_CUR);
-        }
-
-        // check whether we're done already
-        if (bytes_left_this_chunk > 0) {
-            // read data from file into buffer with the correct offset in case bytes have to be skipped
-            fread(buffer + (chunk_size - bytes_left_this_chunk), sizeof(char), (size_t)bytes_left_this_chunk, fp);
-        }
+        skip_section(buffer, chunk_size, pos, digest_md5_offset, digest_md5_length);
+        skip_section(buffer, chunk_size, pos, signature_offset, signature_length);
+        skip_section(buffer, chunk_size, pos, sig_key_offset, sig_key_length);
 
         // feed buffer into checksum calculation
         Md5Update(&md5_context, buffer, chunk_size);
-
-        bytes_left -= chunk_size;
     }
 
     MD5_HASH checksum;
@@ -138,7 +57,14 @@ bool appimage_type2_digest_md5(const char *path, char *digest) {
 
     memcpy(digest, (const char *)checksum.bytes, 16);
 
-    fclose(fp);
-
     return true;
 }
+
+bool appimage_type2_digest_md5(const char *path, char *digest) {
+    appimage_image_t *image = appimage_image_open(path);
+    if (image == NULL) return false;
+
+    bool rv = appimage_image_digest_md5(image, digest);
+    appimage_image_close(image);
+    return rv;
+}
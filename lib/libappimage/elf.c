@@ -8,15 +8,14 @@
 #include <stdbool.h>
 #include <memory.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "appimage_shared.h"
 #include "light_elf.h"
 #include "light_byteswap.h"
 
 typedef Elf32_Nhdr Elf_Nhdr;
 
-static char *     fname;
-static Elf64_Ehdr ehdr;
-
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 #define ELFDATANATIVE ELFDATA2LSB
 #elif __BYTE_ORDER == __BIG_ENDIAN
@@ -25,114 +24,262 @@ static Elf64_Ehdr ehdr;
 #error "Unknown machine endian"
 #endif
 
-static uint16_t file16_to_cpu(uint16_t val) {
-    if (ehdr.e_ident[EI_DATA] != ELFDATANATIVE) val = bswap_16(val);
+typedef struct appimage_section {
+    const char *  name;
+    unsigned long offset;
+    unsigned long length;
+} appimage_section_t;
+
+struct appimage_image {
+    char *              fname;
+    int                 fd;
+    const uint8_t *     data;
+    size_t              size;
+    off_t               elf_size;
+    uint16_t            num_sections;
+    appimage_section_t *sections;
+};
+
+static uint16_t file16_to_cpu(const unsigned char *e_ident, uint16_t val) {
+    if (e_ident[EI_DATA] != ELFDATANATIVE) val = bswap_16(val);
     return val;
 }
 
-static uint32_t file32_to_cpu(uint32_t val) {
-    if (ehdr.e_ident[EI_DATA] != ELFDATANATIVE) val = bswap_32(val);
+static uint32_t file32_to_cpu(const unsigned char *e_ident, uint32_t val) {
+    if (e_ident[EI_DATA] != ELFDATANATIVE) val = bswap_32(val);
     return val;
 }
 
-static uint64_t file64_to_cpu(uint64_t val) {
-    if (ehdr.e_ident[EI_DATA] != ELFDATANATIVE) val = bswap_64(val);
+static uint64_t file64_to_cpu(const unsigned char *e_ident, uint64_t val) {
+    if (e_ident[EI_DATA] != ELFDATANATIVE) val = bswap_64(val);
     return val;
 }
 
-static off_t read_elf32(FILE *fd) {
-    Elf32_Ehdr ehdr32;
-    Elf32_Shdr shdr32;
-    off_t      last_shdr_offset;
-    ssize_t    ret;
-    off_t      sht_end, last_section_end;
+/* Copies the section table into the handle. All offsets are checked against the file size, so that the accessors
+ * below never have to touch the mapping outside of its bounds.
+ */
+static bool read_elf32(appimage_image_t *image) {
+    const unsigned char *e_ident = image->data;
+    Elf32_Ehdr           ehdr32;
+    Elf32_Shdr           shdr32;
+    uint64_t             shoff, shentsize, shstrndx, strtab_offset = 0, strtab_size = 0;
+    off_t                sht_end, last_section_end;
+
+    if (image->size < sizeof(ehdr32)) {
+        fprintf(stderr, "Read of ELF header from %s failed: file too small\n", image->fname);
+        return false;
+    }
+    memcpy(&ehdr32, image->data, sizeof(ehdr32));
+
+    shoff               = file32_to_cpu(e_ident, ehdr32.e_shoff);
+    shentsize           = file16_to_cpu(e_ident, ehdr32.e_shentsize);
+    shstrndx            = file16_to_cpu(e_ident, ehdr32.e_shstrndx);
+    image->num_sections = file16_to_cpu(e_ident, ehdr32.e_shnum);
 
-    fseeko(fd, 0, SEEK_SET);
-    ret = fread(&ehdr32, 1, sizeof(ehdr32), fd);
-    if (ret < 0 || (size_t)ret != sizeof(ehdr32)) {
-        fprintf(stderr, "Read of ELF header from %s failed: %s\n", fname, strerror(errno));
-        return -1;
+    if (image->num_sections == 0 || shentsize < sizeof(shdr32) || shoff > image->size ||
+        shentsize * image->num_sections > image->size - shoff) {
+        fprintf(stderr, "Read of ELF section header from %s failed: invalid section table\n", image->fname);
+        return false;
     }
 
-    ehdr.e_shoff     = file32_to_cpu(ehdr32.e_shoff);
-    ehdr.e_shentsize = file16_to_cpu(ehdr32.e_shentsize);
-    ehdr.e_shnum     = file16_to_cpu(ehdr32.e_shnum);
+    image->sections = calloc(image->num_sections, sizeof(appimage_section_t));
+    if (image->sections == NULL) return false;
+
+    if (shstrndx < image->num_sections) {
+        memcpy(&shdr32, image->data + shoff + shentsize * shstrndx, sizeof(shdr32));
+        strtab_offset = file32_to_cpu(e_ident, shdr32.sh_offset);
+        strtab_size   = file32_to_cpu(e_ident, shdr32.sh_size);
+        if (strtab_offset > image->size || strtab_size > image->size - strtab_offset) strtab_size = 0;
+    }
 
-    last_shdr_offset = ehdr.e_shoff + (ehdr.e_shentsize * (ehdr.e_shnum - 1));
-    fseeko(fd, last_shdr_offset, SEEK_SET);
-    ret = fread(&shdr32, 1, sizeof(shdr32), fd);
-    if (ret < 0 || (size_t)ret != sizeof(shdr32)) {
-        fprintf(stderr, "Read of ELF section header from %s failed: %s\n", fname, strerror(errno));
-        return -1;
+    for (uint16_t i = 0; i < image->num_sections; i++) {
+        memcpy(&shdr32, image->data + shoff + shentsize * i, sizeof(shdr32));
+        uint32_t name             = file32_to_cpu(e_ident, shdr32.sh_name);
+        image->sections[i].offset = file32_to_cpu(e_ident, shdr32.sh_offset);
+        image->sections[i].length = file32_to_cpu(e_ident, shdr32.sh_size);
+        image->sections[i].name   = "";
+        if (name < strtab_size && memchr(image->data + strtab_offset + name, '\0', strtab_size - name) != NULL) {
+            image->sections[i].name = (const char *)image->data + strtab_offset + name;
+        }
     }
 
     /* ELF ends either with the table of section headers (SHT) or with a section. */
-    sht_end          = ehdr.e_shoff + (ehdr.e_shentsize * ehdr.e_shnum);
-    last_section_end = file64_to_cpu(shdr32.sh_offset) + file64_to_cpu(shdr32.sh_size);
-    return sht_end > last_section_end ? sht_end : last_section_end;
+    sht_end          = shoff + shentsize * image->num_sections;
+    last_section_end = image->sections[image->num_sections - 1].offset + image->sections[image->num_sections - 1].length;
+    image->elf_size  = sht_end > last_section_end ? sht_end : last_section_end;
+    return true;
 }
 
-static off_t read_elf64(FILE *fd) {
-    Elf64_Ehdr ehdr64;
-    Elf64_Shdr shdr64;
-    off_t      last_shdr_offset;
-    off_t      ret;
-    off_t      sht_end, last_section_end;
+static bool read_elf64(appimage_image_t *image) {
+    const unsigned char *e_ident = image->data;
+    Elf64_Ehdr           ehdr64;
+    Elf64_Shdr           shdr64;
+    uint64_t             shoff, shentsize, shstrndx, strtab_offset = 0, strtab_size = 0;
+    off_t                sht_end, last_section_end;
 
-    fseeko(fd, 0, SEEK_SET);
-    ret = fread(&ehdr64, 1, sizeof(ehdr64), fd);
-    if (ret < 0 || (size_t)ret != sizeof(ehdr64)) {
-        fprintf(stderr, "Read of ELF header from %s failed: %s\n", fname, strerror(errno));
-        return -1;
+    if (image->size < sizeof(ehdr64)) {
+        fprintf(stderr, "Read of ELF header from %s failed: file too small\n", image->fname);
+        return false;
     }
+    memcpy(&ehdr64, image->data, sizeof(ehdr64));
+
+    shoff               = file64_to_cpu(e_ident, ehdr64.e_shoff);
+    shentsize           = file16_to_cpu(e_ident, ehdr64.e_shentsize);
+    shstrndx            = file16_to_cpu(e_ident, ehdr64.e_shstrndx);
+    image->num_sections = file16_to_cpu(e_ident, ehdr64.e_shnum);
+
+    if (image->num_sections == 0 || shentsize < sizeof(shdr64) || shoff > image->size ||
+        shentsize * image->num_sections > image->size - shoff) {
+        fprintf(stderr, "Read of ELF section header from %s failed: invalid section table\n", image->fname);
+        return false;
+    }
+
+    image->sections = calloc(image->num_sections, sizeof(appimage_section_t));
+    if (image->sections == NULL) return false;
 
-    ehdr.e_shoff     = file64_to_cpu(ehdr64.e_shoff);
-    ehdr.e_shentsize = file16_to_cpu(ehdr64.e_shentsize);
-    ehdr.e_shnum     = file16_to_cpu(ehdr64.e_shnum);
+    if (shstrndx < image->num_sections) {
+        memcpy(&shdr64, image->data + shoff + shentsize * shstrndx, sizeof(shdr64));
+        strtab_offset = file64_to_cpu(e_ident, shdr64.sh_offset);
+        strtab_size   = file64_to_cpu(e_ident, shdr64.sh_size);
+        if (strtab_offset > image->size || strtab_size > image->size - strtab_offset) strtab_size = 0;
+    }
 
-    last_shdr_offset = ehdr.e_shoff + (ehdr.e_shentsize * (ehdr.e_shnum - 1));
-    fseeko(fd, last_shdr_offset, SEEK_SET);
-    ret = fread(&shdr64, 1, sizeof(shdr64), fd);
-    if (ret < 0 || ret != sizeof(shdr64)) {
-        fprintf(stderr, "Read of ELF section header from %s failed: %s\n", fname, strerror(errno));
-        return -1;
+    for (uint16_t i = 0; i < image->num_sections; i++) {
+        memcpy(&shdr64, image->data + shoff + shentsize * i, sizeof(shdr64));
+        uint32_t name             = file32_to_cpu(e_ident, shdr64.sh_name);
+        image->sections[i].offset = file64_to_cpu(e_ident, shdr64.sh_offset);
+        image->sections[i].length = file64_to_cpu(e_ident, shdr64.sh_size);
+        image->sections[i].name   = "";
+        if (name < strtab_size && memchr(image->data + strtab_offset + name, '\0', strtab_size - name) != NULL) {
+            image->sections[i].name = (const char *)image->data + strtab_offset + name;
+        }
     }
 
     /* ELF ends either with the table of section headers (SHT) or with a section. */
-    sht_end          = ehdr.e_shoff + (ehdr.e_shentsize * ehdr.e_shnum);
-    last_section_end = file64_to_cpu(shdr64.sh_offset) + file64_to_cpu(shdr64.sh_size);
-    return sht_end > last_section_end ? sht_end : last_section_end;
+    sht_end          = shoff + shentsize * image->num_sections;
+    last_section_end = image->sections[image->num_sections - 1].offset + image->sections[image->num_sections - 1].length;
+    image->elf_size  = sht_end > last_section_end ? sht_end : last_section_end;
+    return true;
 }
 
-ssize_t appimage_get_elf_size(const char *fname) {
-    off_t ret;
-    FILE *fd   = NULL;
-    off_t size = -1;
+appimage_image_t *appimage_image_open(const char *fname) {
+    struct stat       st;
+    appimage_image_t *image = calloc(1, sizeof(appimage_image_t));
+    if (image == NULL) return NULL;
 
-    fd = fopen(fname, "rb");
-    if (fd == NULL) {
+    image->fname = strdup(fname);
+    image->fd    = open(fname, O_RDONLY | O_CLOEXEC);
+    if (image->fd == -1) {
         fprintf(stderr, "Cannot open %s: %s\n", fname, strerror(errno));
-        return -1;
+        goto error;
     }
-    ret = fread(ehdr.e_ident, 1, EI_NIDENT, fd);
-    if (ret != EI_NIDENT) {
+
+    if (fstat(image->fd, &st) == -1 || st.st_size < EI_NIDENT) {
         fprintf(stderr, "Read of e_ident from %s failed: %s\n", fname, strerror(errno));
-        return -1;
+        goto error;
+    }
+
+    image->size = (size_t)st.st_size;
+    image->data = mmap(NULL, image->size, PROT_READ, MAP_SHARED, image->fd, 0);
+    if (image->data == MAP_FAILED) {
+        image->data = NULL;
+        fprintf(stderr, "Cannot map %s: %s\n", fname, strerror(errno));
+        goto error;
     }
-    if ((ehdr.e_ident[EI_DATA] != ELFDATA2LSB) && (ehdr.e_ident[EI_DATA] != ELFDATA2MSB)) {
-        fprintf(stderr, "Unknown ELF data order %u\n", ehdr.e_ident[EI_DATA]);
-        return -1;
+
+    if ((image->data[EI_DATA] != ELFDATA2LSB) && (image->data[EI_DATA] != ELFDATA2MSB)) {
+        fprintf(stderr, "Unknown ELF data order %u\n", image->data[EI_DATA]);
+        goto error;
     }
-    if (ehdr.e_ident[EI_CLASS] == ELFCLASS32) {
-        size = read_elf32(fd);
-    } else if (ehdr.e_ident[EI_CLASS] == ELFCLASS64) {
-        size = read_elf64(fd);
+
+    if (image->data[EI_CLASS] == ELFCLASS32) {
+        if (!read_elf32(image)) goto error;
+    } else if (image->data[EI_CLASS] == ELFCLASS64) {
+        if (!read_elf64(image)) goto error;
     } else {
-        fprintf(stderr, "Unknown ELF class %u\n", ehdr.e_ident[EI_CLASS]);
-        return -1;
+        fprintf(stderr, "Unknown ELF class %u\n", image->data[EI_CLASS]);
+        goto error;
+    }
+
+    return image;
+
+error:
+    appimage_image_close(image);
+    return NULL;
+}
+
+void appimage_image_close(appimage_image_t *image) {
+    if (image == NULL) return;
+    if (image->data) munmap((void *)image->data, image->size);
+    if (image->fd != -1) close(image->fd);
+    free(image->sections);
+    free(image->fname);
+    free(image);
+}
+
+const char *appimage_image_get_path(const appimage_image_t *image) {
+    return image->fname;
+}
+
+int appimage_image_get_fd(const appimage_image_t *image) {
+    return image->fd;
+}
+
+size_t appimage_image_get_size(const appimage_image_t *image) {
+    return image->size;
+}
+
+const uint8_t *appimage_image_get_data(const appimage_image_t *image) {
+    return image->data;
+}
+
+ssize_t appimage_image_get_elf_size(const appimage_image_t *image) {
+    return (ssize_t)image->elf_size;
+}
+
+bool appimage_image_get_section(const appimage_image_t *image,
+                                const char *            section_name,
+                                unsigned long *         offset,
+                                unsigned long *         length) {
+    // Keep the semantics of the old implementation: the last section with a matching name wins
+    bool found = false;
+    for (uint16_t i = 0; i < image->num_sections; i++) {
+        if (strcmp(image->sections[i].name, section_name) == 0) {
+            *offset = image->sections[i].offset;
+            *length = image->sections[i].length;
+            found   = true;
+        }
     }
+    return found;
+}
+
+char *appimage_image_read_section(const appimage_image_t *image, const char *section_name) {
+    unsigned long offset = 0;
+    unsigned long length = 0;
+
+    if (!appimage_image_get_section(image, section_name, &offset, &length)) return NULL;
+    if (offset > image->size || length > image->size - offset) return NULL;
 
-    fclose(fd);
+    char *buffer = calloc(length + 1, sizeof(char));
+    if (buffer == NULL) return NULL;
+    memcpy(buffer, image->data + offset, length);
+    return buffer;
+}
+
+char *appimage_image_get_update_info(const appimage_image_t *image) {
+    return appimage_image_read_section(image, ".upd_info");
+}
+
+char *appimage_image_get_signature(const appimage_image_t *image) {
+    return appimage_image_read_section(image, ".sha256_sig");
+}
+
+ssize_t appimage_get_elf_size(const char *fname) {
+    appimage_image_t *image = appimage_image_open(fname);
+    if (image == NULL) return -1;
+
+    ssize_t size = appimage_image_get_elf_size(image);
+    appimage_image_close(image);
     return size;
 }
 
@@ -141,52 +288,11 @@ bool appimage_get_elf_section_offset_and_length(const char *   fname,
                                                 const char *   section_name,
                                                 unsigned long *offset,
                                                 unsigned long *length) {
-    uint8_t *data;
-    int      i;
-    int      fd       = open(fname, O_RDONLY);
-    size_t   map_size = (size_t)lseek(fd, 0, SEEK_END);
-
-    data = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
-    close(fd);
-
-    // this trick works as both 32 and 64 bit ELF files start with the e_ident[EI_NINDENT] section
-    unsigned char class = data[EI_CLASS];
-
-    if (class == ELFCLASS32) {
-        Elf32_Ehdr *elf;
-        Elf32_Shdr *shdr;
-
-        elf  = (Elf32_Ehdr *)data;
-        shdr = (Elf32_Shdr *)(data + ((Elf32_Ehdr *)elf)->e_shoff);
-
-        char *strTab = (char *)(data + shdr[elf->e_shstrndx].sh_offset);
-        for (i = 0; i < elf->e_shnum; i++) {
-            if (strcmp(&strTab[shdr[i].sh_name], section_name) == 0) {
-                *offset = shdr[i].sh_offset;
-                *length = shdr[i].sh_size;
-            }
-        }
-    } else if (class == ELFCLASS64) {
-        Elf64_Ehdr *elf;
-        Elf64_Shdr *shdr;
-
-        elf  = (Elf64_Ehdr *)data;
-        shdr = (Elf64_Shdr *)(data + elf->e_shoff);
-
-        char *strTab = (char *)(data + shdr[elf->e_shstrndx].sh_offset);
-        for (i = 0; i < elf->e_shnum; i++) {
-            if (strcmp(&strTab[shdr[i].sh_name], section_name) == 0) {
-                *offset = shdr[i].sh_offset;
-                *length = shdr[i].sh_size;
-            }
-        }
-    } else {
-        fprintf(stderr, "Platforms other than 32-bit/64-bit are currently not supported!");
-        munmap(data, map_size);
-        return false;
-    }
+    appimage_image_t *image = appimage_image_open(fname);
+    if (image == NULL) return false;
 
-    munmap(data, map_size);
+    appimage_image_get_section(image, section_name, offset, length);
+    appimage_image_close(image);
     return true;
 }
 
@@ -6,6 +6,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <time.h>
 
 #ifdef	__cplusplus
 extern "C" {
@@ -33,9 +34,24 @@ bool appimage_starts_with(const char *pre, const char *str);
 bool appimage_mkdir_p(const char *const path);
 bool appimage_rm_recursive(const char *const path);
 
+// Returns $XDG_CACHE_HOME/appimage/<subdir> (or ~/.cache/appimage/<subdir>) and creates it. NULL on error.
+char *appimage_get_cache_dir(const char *const subdir);
+
 // Generate a unique mount path. If prefix is NULL the default temporary directory is used
 char *appimage_generate_mount_path(appimage_context_t *const context, const char *const prefix);
 
+// Attach to a live mount of the same image that another launch started with appimage_self_mount. Returns the mount
+// path or NULL if there is none. The mount stays alive as long as this process or any of its children is running.
+char *appimage_attach_mount(appimage_context_t *const context);
+
+// The mounts of all images of the user are served by a single daemon if APPIMAGE_USER_DAEMON=1
+bool appimage_user_daemon_enabled(void);
+
+// Mount the image with the per-user daemon, which is started if it is not running yet. Returns the mount path, which
+// is the path of the existing mount if the daemon serves the image already (mount_path is removed then), or NULL on
+// failure. The mount stays alive as long as this process or any of its children is running.
+char *appimage_daemon_mount(appimage_context_t *const context, const char *const mount_path);
+
 typedef void (*appimage_cb_mounted)(appimage_context_t *const, void *);
 
 bool appimage_self_mount(appimage_context_t *const context,
@@ -49,6 +65,30 @@ bool appimage_self_extract(appimage_context_t *const context,
                            const bool                overwrite,
                            const bool                verbose);
 
+typedef struct appimage_scan_entry {
+    const char *path;
+    ssize_t     fs_offset;
+    char *      update_info;    // NULL if the AppImage has no .upd_info section
+    char *      signature;      // NULL if the AppImage has no .sha256_sig section
+    char        digest_md5[33]; // hex digest, empty if not requested
+} appimage_scan_entry_t;
+
+// Called once per found AppImage. The entry is only valid during the call. Calls happen from worker threads, but are
+// serialized, so the callback does not need its own locking.
+typedef void (*appimage_scan_cb)(const appimage_scan_entry_t *const, void *);
+
+// Recursively index all type 2 AppImages in a directory tree with a pool of num_threads workers (0 = one per CPU).
+// Symlinks are not followed. The digest calculation reads the entire file and is therefore optional.
+bool appimage_scan_directory(const char *const path,
+                             unsigned          num_threads,
+                             bool              calc_digest,
+                             appimage_scan_cb  found_cb,
+                             void *            cb_user_data);
+
+// Write an mksquashfs -sort file for the AppImage extracted to prefix. Files read since the given time (should be taken
+// from CLOCK_REALTIME_COARSE, like file timestamps) are ordered by their first access.
+bool appimage_write_sort_file(const char *const prefix, const char *const sort_path, const struct timespec *since);
+
 void appimage_execute_apprun(appimage_context_t *const context,
                              const char *              prefix,
                              int                       argc,
@@ -0,0 +1,399 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * The per-user mount daemon. Instead of one daemon per launched image, a single process serves the mounts of all
+ * images of the user (APPIMAGE_USER_DAEMON=1, see appimage_daemon_mount). All mounts use one block cache budget and
+ * the same read ahead and decompression pools, so an additional image only costs its squashfuse state and a session
+ * loop thread.
+ *
+ * A launcher sends "<image>\n<offset>\n<mountpoint>\n<options>\n" to $XDG_RUNTIME_DIR/appimage/daemon.sock and gets
+ * the mount path as answer, which is the path of an existing mount if the image is mounted already. Like with mount
+ * sharing (share.c), the connection is the reference to the mount: once all connections of a mount are closed, it is
+ * unmounted after linger_secs. The daemon exits linger_secs after its last mount is gone.
+ *
+ * Every mount runs the regular mount code (private_fusefs_hosted) in its own thread.
+ */
+
+#define _GNU_SOURCE
+
+#include "ll_private.h"
+#include "disk_cache.h"
+#include "private.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define REQUEST_TIMEOUT_SECS 2
+#define DEFAULT_CACHE_MB 128
+
+typedef struct hosted_mount hosted_mount_t;
+
+struct hosted_mount {
+    hosted_mount_t *next;
+    unsigned        id; // Namespace of the block cache keys, unique among the running mounts
+    dev_t           dev;
+    ino_t           ino;
+    time_t          mtime;
+    size_t          offset;
+    char *          image;
+    char *          mountpoint;
+    char *          options;
+    pthread_t       thread;
+    int             result;
+    unsigned        refs;
+    long long       idle_since; // Time when refs dropped to 0, -1 while referenced
+
+    pthread_mutex_t  lock;     // Guards mount
+    private_mount_t *mount;    // Set while the session loop runs
+    sem_t            started;  // Posted once the session loop starts or the mount failed
+    atomic_bool      finished; // The mount thread is done and can be joined
+};
+
+typedef struct client {
+    int             fd;
+    hosted_mount_t *mount;
+} client_t;
+
+typedef struct daemon_state {
+    private_host_t  host;
+    int             listen_fd;
+    int             signal_fd;
+    int             wake[2]; // Mount threads report their end here
+    unsigned        linger_secs;
+    hosted_mount_t *mounts;
+    client_t        clients[PRIVATE_MAX_CLIENTS];
+    size_t          num_clients;
+} daemon_state_t;
+
+static daemon_state_t daemon_state;
+
+static void mount_state(private_mount_t *mount, void *data) {
+    hosted_mount_t *m = data;
+    pthread_mutex_lock(&m->lock);
+    m->mount = mount;
+    pthread_mutex_unlock(&m->lock);
+    if (mount) sem_post(&m->started);
+}
+
+static void *mount_thread(void *arg) {
+    hosted_mount_t *m       = arg;
+    char *          argv[5] = {"appimage-daemon", "-o", m->options, m->image, m->mountpoint};
+
+    uint64_t key_base = (uint64_t)m->id << PRIVATE_HOST_KEY_SHIFT;
+    m->result         = private_fusefs_hosted(5, argv, &daemon_state.host, key_base, mount_state, m);
+
+    atomic_store(&m->finished, true);
+    sem_post(&m->started); // The mount failed if the session loop never started
+    private_wake_pipe(daemon_state.wake[1]);
+    return NULL;
+}
+
+static void free_mount(hosted_mount_t *m) {
+    pthread_mutex_destroy(&m->lock);
+    sem_destroy(&m->started);
+    free(m->image);
+    free(m->mountpoint);
+    free(m->options);
+    free(m);
+}
+
+/* Lowest id that no running mount uses, its key range was dropped from the block cache when the last user ended */
+static unsigned free_mount_id(void) {
+    for (unsigned id = 1; id <= PRIVATE_HOST_MAX_MOUNTS; id++) {
+        bool used = false;
+        for (hosted_mount_t *m = daemon_state.mounts; m && !used; m = m->next) used = m->id == id;
+        if (!used) return id;
+    }
+    return 0;
+}
+
+static hosted_mount_t *start_mount(const struct stat *st, size_t offset, char *lines[4]) {
+    unsigned id = free_mount_id();
+    if (id == 0) return NULL;
+
+    hosted_mount_t *m = calloc(1, sizeof(hosted_mount_t));
+    if (!m) return NULL;
+    m->id         = id;
+    m->dev        = st->st_dev;
+    m->ino        = st->st_ino;
+    m->mtime      = st->st_mtime;
+    m->offset     = offset;
+    m->idle_since = -1;
+    atomic_init(&m->finished, false);
+    pthread_mutex_init(&m->lock, NULL);
+    sem_init(&m->started, 0, 0);
+
+    // An idle image only keeps one session loop worker around
+    m->image      = strdup(lines[0]);
+    m->mountpoint = strdup(lines[2]);
+    if (asprintf(&m->options, "ro,offset=%zu,max_idle_threads=1%s%s", offset, lines[3][0] ? "," : "", lines[3]) ==
+        -1) {
+        m->options = NULL;
+    }
+
+    if (!m->image || !m->mountpoint || !m->options || pthread_create(&m->thread, NULL, mount_thread, m) != 0) {
+        free_mount(m);
+        return NULL;
+    }
+
+    // Mounting only takes a moment, requests of other launchers wait in the listen backlog meanwhile
+    while (sem_wait(&m->started) == -1 && errno == EINTR) {}
+    if (atomic_load(&m->finished)) {
+        pthread_join(m->thread, NULL);
+        free_mount(m);
+        return NULL;
+    }
+
+    m->next             = daemon_state.mounts;
+    daemon_state.mounts = m;
+    return m;
+}
+
+static void stop_mount(hosted_mount_t *m) {
+    pthread_mutex_lock(&m->lock);
+    if (m->mount) private_ll_session_exit(m->mount);
+    pthread_mutex_unlock(&m->lock);
+    pthread_join(m->thread, NULL);
+
+    for (hosted_mount_t **it = &daemon_state.mounts; *it; it = &(*it)->next) {
+        if (*it == m) {
+            *it = m->next;
+            break;
+        }
+    }
+
+    // Launches of an image that was unmounted from the outside lose their reference
+    for (size_t i = daemon_state.num_clients; i-- > 0;) {
+        if (daemon_state.clients[i].mount != m) continue;
+        close(daemon_state.clients[i].fd);
+        daemon_state.clients[i] = daemon_state.clients[--daemon_state.num_clients];
+    }
+    free_mount(m);
+}
+
+/* Read the four lines of a request into buf and split them */
+static bool read_request(int fd, char *buf, size_t size, char *lines[4]) {
+    size_t len = 0, newlines = 0;
+    while (newlines < 4 && len + 1 < size) {
+        ssize_t res = read(fd, buf + len, size - len - 1);
+        if (res <= 0) return false;
+        for (ssize_t i = 0; i < res; i++) newlines += buf[len + (size_t)i] == '\n';
+        len += (size_t)res;
+    }
+    buf[len] = '\0';
+    if (newlines != 4 || buf[len - 1] != '\n') return false;
+
+    char *line = buf;
+    for (size_t i = 0; i < 4; i++) {
+        lines[i] = line;
+        line     = strchr(line, '\n');
+        *line++  = '\0';
+    }
+    return true;
+}
+
+static void handle_request(int fd) {
+    char           buf[3 * PATH_MAX];
+    char *         lines[4];
+    struct stat    st;
+    struct timeval timeout = {REQUEST_TIMEOUT_SECS, 0};
+    char *         end;
+
+    // Launchers that do not send a complete request must not block the others for long
+    if (daemon_state.num_clients == PRIVATE_MAX_CLIENTS ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) ||
+        !read_request(fd, buf, sizeof(buf), lines)) {
+        close(fd);
+        return;
+    }
+
+    // strtoull accepts an empty string, white space and a sign
+    size_t offset = (size_t)strtoull(lines[1], &end, 10);
+    if (!isdigit((unsigned char)lines[1][0]) || *end != '\0' || lines[0][0] != '/' || lines[2][0] != '/' ||
+        stat(lines[0], &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return;
+    }
+
+    hosted_mount_t *m = daemon_state.mounts;
+    while (m && (m->dev != st.st_dev || m->ino != st.st_ino || m->mtime != st.st_mtime || m->offset != offset ||
+                 atomic_load(&m->finished))) {
+        m = m->next;
+    }
+    if (!m && !(m = start_mount(&st, offset, lines))) {
+        fprintf(stderr, "daemon: failed to mount %s\n", lines[0]);
+        close(fd);
+        return;
+    }
+
+    size_t len = strlen(m->mountpoint);
+    if (send(fd, m->mountpoint, len, MSG_NOSIGNAL) != (ssize_t)len || send(fd, "\n", 1, MSG_NOSIGNAL) != 1) {
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    daemon_state.clients[daemon_state.num_clients++] = (client_t){fd, m};
+    m->refs++;
+    m->idle_since = -1;
+}
+
+static void remove_client(size_t i) {
+    hosted_mount_t *m = daemon_state.clients[i].mount;
+    close(daemon_state.clients[i].fd);
+    daemon_state.clients[i] = daemon_state.clients[--daemon_state.num_clients];
+    if (--m->refs == 0) m->idle_since = private_now_ms();
+}
+
+/* Unmount everything that lingered long enough, returns the poll timeout until the next one is due */
+static int expire_mounts(long long *daemon_idle_since) {
+    const long long linger  = (long long)daemon_state.linger_secs * 1000;
+    const long long now     = private_now_ms();
+    int             timeout = -1;
+
+    hosted_mount_t *m = daemon_state.mounts;
+    while (m) {
+        hosted_mount_t *next = m->next;
+        if (atomic_load(&m->finished)) {
+            stop_mount(m);
+        } else if (m->refs == 0) {
+            // A mount that was never referenced (the launcher went away before the answer) lingers as well
+            if (m->idle_since < 0) m->idle_since = now;
+            long long left = m->idle_since + linger - now;
+            if (left <= 0) {
+                stop_mount(m);
+            } else if (timeout < 0 || left < timeout) {
+                timeout = (int)left;
+            }
+        }
+        m = next;
+    }
+
+    if (daemon_state.mounts) {
+        *daemon_idle_since = -1;
+    } else {
+        if (*daemon_idle_since < 0) *daemon_idle_since = now;
+        long long left = *daemon_idle_since + linger - now;
+        if (left <= 0) return 0;
+        if (timeout < 0 || left < timeout) timeout = (int)left;
+    }
+    return timeout;
+}
+
+static bool init_host(void) {
+    unsigned    cache_mb  = DEFAULT_CACHE_MB;
+    const char *cache_env = getenv("APPIMAGE_BLOCK_CACHE_MB");
+    if (cache_env) cache_mb = (unsigned)strtoul(cache_env, NULL, 10);
+    const char *linger_env   = getenv("APPIMAGE_MOUNT_LINGER");
+    daemon_state.linger_secs = linger_env ? (unsigned)strtoul(linger_env, NULL, 10) : 5;
+
+    // Same split as in a regular mount daemon, for all images together
+    unsigned ra_threads = private_cpu_count() / 2;
+    unsigned dc_threads = private_cpu_count();
+    private_host_t *host = &daemon_state.host;
+    if (cache_mb) {
+        if (!(host->block_cache = private_block_cache_new((size_t)cache_mb * 1024 * 1024))) return false;
+        if (!(host->readahead_pool = private_thread_pool_new(ra_threads ? ra_threads : 1))) return false;
+    }
+    return dc_threads < 2 || (host->decompress_pool = private_thread_pool_new(dc_threads - 1));
+}
+
+/* SIGUSR1: the request statistics of all running mounts */
+static void dump_stats(void) {
+    FILE *f = private_stats_dump_open();
+    if (!f) return;
+    for (hosted_mount_t *m = daemon_state.mounts; m; m = m->next) {
+        pthread_mutex_lock(&m->lock);
+        if (m->mount) {
+            fprintf(f, "%s (%s)\n", m->image, m->mountpoint);
+            private_stats_print(m->mount, f);
+            fputc('\n', f);
+        }
+        pthread_mutex_unlock(&m->lock);
+    }
+    fclose(f);
+}
+
+/* False if the daemon was asked to terminate */
+static bool handle_signals(void) {
+    struct signalfd_siginfo info;
+    bool                    terminate = false;
+    while (read(daemon_state.signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGUSR1) {
+            dump_stats();
+        } else {
+            terminate = true;
+        }
+    }
+    return !terminate;
+}
+
+static void destroy_host(void) {
+    private_host_t *host = &daemon_state.host;
+    if (host->decompress_pool) private_thread_pool_free(host->decompress_pool);
+    if (host->readahead_pool) private_thread_pool_free(host->readahead_pool);
+    private_block_cache_free(host->block_cache);
+}
+
+int private_daemon_main(int listen_fd, const char *const socket_path) {
+    struct pollfd fds[PRIVATE_MAX_CLIENTS + 3];
+    sigset_t      signals;
+    long long     idle_since = -1;
+    bool          ok;
+
+    // Block the termination signals and SIGUSR1 in all threads (they inherit the mask) and handle them in the poll loop
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGQUIT);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    daemon_state.listen_fd = listen_fd;
+    daemon_state.signal_fd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+    ok = daemon_state.signal_fd != -1 && pipe2(daemon_state.wake, O_CLOEXEC | O_NONBLOCK) == 0 && init_host();
+
+    while (ok) {
+        int timeout = expire_mounts(&idle_since);
+        if (timeout == 0) break;
+
+        fds[0] = (struct pollfd){daemon_state.signal_fd, POLLIN, 0};
+        fds[1] = (struct pollfd){daemon_state.wake[0], POLLIN, 0};
+        fds[2] = (struct pollfd){daemon_state.listen_fd, POLLIN, 0};
+        for (size_t i = 0; i < daemon_state.num_clients; i++) {
+            fds[i + 3] = (struct pollfd){daemon_state.clients[i].fd, POLLIN, 0};
+        }
+
+        if (poll(fds, daemon_state.num_clients + 3, timeout) == -1 && errno != EINTR) break;
+        if (fds[0].revents && !handle_signals()) break;
+
+        if (fds[1].revents) private_drain_pipe(daemon_state.wake[0]);
+        private_remove_closed_clients(fds + 3, daemon_state.num_clients, remove_client);
+        if (fds[2].revents & POLLIN) {
+            int fd = accept4(daemon_state.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd != -1) handle_request(fd);
+        }
+    }
+
+    // Stop accepting first, launchers that connect now fall back to a mount of their own
+    unlink(socket_path);
+    close(daemon_state.listen_fd);
+    while (daemon_state.mounts) stop_mount(daemon_state.mounts);
+    destroy_host();
+    private_disk_cache_close();
+    if (daemon_state.signal_fd != -1) close(daemon_state.signal_fd);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
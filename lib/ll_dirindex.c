@@ -0,0 +1,233 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Hashed name lookup for large directories. sqfs_dir_lookup uses the squashfs directory index to skip to the right
+ * metadata block, but then scans the entries linearly, and the index only has one entry per 8 KiB block of the
+ * listing. Directories with tens of thousands of entries (site-packages, icon themes, node_modules) still cost a scan
+ * of a whole block for every cold lookup.
+ *
+ * The first lookup in a directory whose listing is larger than MIN_DIR_SIZE reads the complete listing once and builds
+ * an open addressing hash table of name -> dir entry. Later lookups in that directory hash the name and compare a
+ * single entry. The tables are kept in LRU order within the dir_index_mb budget. Everything here is guarded by the
+ * mount lock, like the squashfuse caches the listing is read from.
+ */
+
+#include "ll_private.h"
+#include "squashfs_fs.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Smaller listings fit into a single metadata block, which sqfs_dir_lookup finds through the directory index anyway
+#define MIN_DIR_SIZE SQUASHFS_METADATA_SIZE
+#define NUM_BUCKETS 64
+
+typedef struct index_entry {
+    uint64_t inode; // sqfs_inode_id
+    uint32_t inode_number;
+    uint32_t hash;
+    uint32_t name_off; // Into dir_table_t::names
+    uint16_t name_size;
+    uint8_t  type;
+} index_entry_t;
+
+typedef struct dir_table dir_table_t;
+
+struct dir_table {
+    dir_table_t *  bucket_next;
+    dir_table_t *  lru_prev;
+    dir_table_t *  lru_next;
+    uint32_t       dir; // Inode number of the directory
+    uint32_t       mask; // Number of slots - 1
+    uint32_t *     slots; // Index into entries + 1, 0 = empty
+    index_entry_t *entries;
+    char *         names;
+    size_t         bytes;
+};
+
+struct private_dir_index {
+    size_t       budget;
+    size_t       bytes;
+    dir_table_t *buckets[NUM_BUCKETS];
+    dir_table_t  lru; // List head, most recently used first
+};
+
+/* FNV-1a */
+static uint32_t hash_name(const char *name, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    return hash;
+}
+
+private_dir_index_t *private_dir_index_new(size_t budget) {
+    private_dir_index_t *index = calloc(1, sizeof(private_dir_index_t));
+    if (!index) return NULL;
+    index->budget       = budget;
+    index->lru.lru_prev = &index->lru;
+    index->lru.lru_next = &index->lru;
+    return index;
+}
+
+static void free_table(dir_table_t *table) {
+    free(table->slots);
+    free(table->entries);
+    free(table->names);
+    free(table);
+}
+
+static void lru_unlink(dir_table_t *table) {
+    table->lru_prev->lru_next = table->lru_next;
+    table->lru_next->lru_prev = table->lru_prev;
+}
+
+static void lru_push_front(private_dir_index_t *index, dir_table_t *table) {
+    table->lru_prev               = &index->lru;
+    table->lru_next               = index->lru.lru_next;
+    index->lru.lru_next->lru_prev = table;
+    index->lru.lru_next           = table;
+}
+
+static void remove_table(private_dir_index_t *index, dir_table_t *table) {
+    dir_table_t **link = &index->buckets[table->dir % NUM_BUCKETS];
+    while (*link != table) link = &(*link)->bucket_next;
+    *link = table->bucket_next;
+    lru_unlink(table);
+    index->bytes -= table->bytes;
+    free_table(table);
+}
+
+void private_dir_index_clear(private_dir_index_t *index) {
+    if (!index) return;
+    while (index->lru.lru_next != &index->lru) remove_table(index, index->lru.lru_next);
+}
+
+void private_dir_index_free(private_dir_index_t *index) {
+    private_dir_index_clear(index);
+    free(index);
+}
+
+/* Read the complete listing of dir, NULL on errors (the lookup then falls back to sqfs_dir_lookup) */
+static dir_table_t *build_table(sqfs *fs, sqfs_inode *dir) {
+    sqfs_dir       handle;
+    sqfs_name      namebuf;
+    sqfs_dir_entry entry;
+    sqfs_err       err        = SQFS_OK;
+    size_t         count      = 0;
+    size_t         max_count  = 0;
+    size_t         names_size = 0;
+    size_t         max_names  = 0;
+
+    dir_table_t *table = calloc(1, sizeof(dir_table_t));
+    bool         ok    = table && sqfs_dir_open(fs, dir, &handle, 0) == SQFS_OK;
+
+    sqfs_dentry_init(&entry, namebuf);
+    while (ok && sqfs_dir_next(fs, &handle, &entry, &err)) {
+        const size_t name_size = sqfs_dentry_name_size(&entry);
+        if (count == max_count) {
+            max_count          = max_count ? max_count * 2 : 1024;
+            index_entry_t *tmp = realloc(table->entries, sizeof(index_entry_t) * max_count);
+            if (!(ok = tmp != NULL)) break;
+            table->entries = tmp;
+        }
+        if (names_size + name_size > max_names) {
+            max_names = max_names ? max_names * 2 : 16 * 1024;
+            if (max_names < names_size + name_size) max_names = names_size + name_size;
+            char *tmp = realloc(table->names, max_names);
+            if (!(ok = tmp != NULL)) break;
+            table->names = tmp;
+        }
+
+        memcpy(table->names + names_size, sqfs_dentry_name(&entry), name_size);
+        table->entries[count++] = (index_entry_t){
+            sqfs_dentry_inode(&entry),
+            sqfs_dentry_inode_num(&entry),
+            hash_name(sqfs_dentry_name(&entry), name_size),
+            (uint32_t)names_size,
+            (uint16_t)name_size,
+            (uint8_t)sqfs_dentry_type(&entry),
+        };
+        names_size += name_size;
+        ok = count < UINT32_MAX && names_size < UINT32_MAX;
+    }
+    ok = ok && err == SQFS_OK;
+
+    // At most half full, so the probe sequences stay short
+    size_t num_slots = 16;
+    while (ok && num_slots < count * 2) num_slots *= 2;
+    ok = ok && (table->slots = calloc(num_slots, sizeof(uint32_t)));
+    if (!ok) {
+        if (table) free_table(table);
+        return NULL;
+    }
+
+    table->dir   = dir->base.inode_number;
+    table->mask  = (uint32_t)(num_slots - 1);
+    table->bytes = sizeof(dir_table_t) + sizeof(index_entry_t) * max_count + max_names + sizeof(uint32_t) * num_slots;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t slot = table->entries[i].hash & table->mask;
+        while (table->slots[slot]) slot = (slot + 1) & table->mask;
+        table->slots[slot] = i + 1;
+    }
+    return table;
+}
+
+static dir_table_t *get_table(private_dir_index_t *index, sqfs *fs, sqfs_inode *dir) {
+    const uint32_t dir_num = dir->base.inode_number;
+    for (dir_table_t *table = index->buckets[dir_num % NUM_BUCKETS]; table; table = table->bucket_next) {
+        if (table->dir == dir_num) {
+            lru_unlink(table);
+            lru_push_front(index, table);
+            return table;
+        }
+    }
+
+    dir_table_t *table = build_table(fs, dir);
+    if (!table) return NULL;
+    if (table->bytes > index->budget) {
+        free_table(table);
+        return NULL;
+    }
+    while (index->bytes + table->bytes > index->budget) remove_table(index, index->lru.lru_prev);
+
+    table->bucket_next                    = index->buckets[dir_num % NUM_BUCKETS];
+    index->buckets[dir_num % NUM_BUCKETS] = table;
+    index->bytes += table->bytes;
+    lru_push_front(index, table);
+    return table;
+}
+
+sqfs_err private_dir_lookup(private_mount_t *mount,
+                            sqfs_inode *     dir,
+                            const char *     name,
+                            size_t           name_size,
+                            sqfs_dir_entry * entry,
+                            bool *           found) {
+    sqfs *               fs    = &mount->ll->fs;
+    private_dir_index_t *index = mount->dir_index;
+
+    dir_table_t *table = index && dir->xtra.dir.dir_size > MIN_DIR_SIZE ? get_table(index, fs, dir) : NULL;
+    if (!table) return sqfs_dir_lookup(fs, dir, name, name_size, entry, found);
+
+    const uint32_t hash = hash_name(name, name_size);
+    *found              = false;
+    for (uint32_t slot = hash & table->mask; table->slots[slot]; slot = (slot + 1) & table->mask) {
+        const index_entry_t *e = &table->entries[table->slots[slot] - 1];
+        if (e->hash != hash || e->name_size != name_size || memcmp(table->names + e->name_off, name, name_size)) {
+            continue;
+        }
+
+        // Only what sqfs_dir_lookup returns is filled in, the offsets are not needed for a lookup
+        entry->inode        = e->inode;
+        entry->inode_number = e->inode_number;
+        entry->type         = e->type;
+        entry->name_size    = e->name_size;
+        entry->offset       = 0;
+        entry->next_offset  = 0;
+        memcpy(entry->name, table->names + e->name_off, e->name_size);
+        entry->name[e->name_size] = '\0';
+        *found                    = true;
+        break;
+    }
+    return SQFS_OK;
+}
@@ -0,0 +1,299 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Multi-threaded FUSE session loop, modelled after fuse_loop_mt.c from libfuse. Compared to fuse_session_loop_mt it
+ * has a configurable upper limit of workers (libfuse hardcodes 10 in FUSE 2 and has no limit in FUSE 3), reaps idle
+ * workers above max_idle_threads and implements the squashfuse idle timeout without SIGALRM.
+ *
+ * A new worker is spawned whenever the last idle worker picks up a request, so a request that blocks on a slow
+ * decompression never delays the ones behind it (as long as max_threads is not reached).
+ */
+
+#define _GNU_SOURCE
+
+#include "ll_private.h"
+#include "thread_pool.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct loop_worker loop_worker_t;
+typedef struct loop        loop_t;
+
+struct loop_worker {
+    loop_worker_t *prev;
+    loop_worker_t *next;
+    pthread_t      thread;
+    loop_t *       loop;
+    struct fuse_buf fbuf;
+};
+
+struct loop {
+    struct fuse_session *se;
+#if FUSE_USE_VERSION < 30
+    struct fuse_chan *ch;
+#endif
+    private_mount_t *mount;
+
+    pthread_mutex_t lock;
+    loop_worker_t   main; // list head, not a real worker
+    unsigned        num_workers;
+    unsigned        num_available;
+    bool            exit;
+    int             error;
+    sem_t           finish;
+};
+
+static int start_worker(loop_t *loop);
+
+static void list_add_worker(loop_worker_t *w, loop_worker_t *next) {
+    loop_worker_t *prev = next->prev;
+    w->next             = next;
+    w->prev             = prev;
+    prev->next          = w;
+    next->prev          = w;
+}
+
+static void list_del_worker(loop_worker_t *w) {
+    loop_worker_t *prev = w->prev;
+    loop_worker_t *next = w->next;
+    prev->next          = next;
+    next->prev          = prev;
+}
+
+static void free_worker(loop_worker_t *w) {
+    free(w->fbuf.mem);
+    free(w);
+}
+
+static void *worker_thread(void *data) {
+    loop_worker_t *w    = data;
+    loop_t *       loop = w->loop;
+
+    while (!fuse_session_exited(loop->se)) {
+        int res;
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+#if FUSE_USE_VERSION >= 30
+        res = fuse_session_receive_buf(loop->se, &w->fbuf);
+#else
+        struct fuse_chan *ch = loop->ch;
+        res                  = fuse_session_receive_buf(loop->se, &w->fbuf, &ch);
+#endif
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (res == -EINTR) continue;
+        if (res <= 0) {
+            if (res < 0) {
+                fuse_session_exit(loop->se);
+                loop->error = res;
+            }
+            break;
+        }
+
+        atomic_store(&loop->mount->last_request, (long long)time(NULL));
+
+        pthread_mutex_lock(&loop->lock);
+        if (loop->exit) {
+            pthread_mutex_unlock(&loop->lock);
+            return NULL;
+        }
+
+        // Make sure there is always someone waiting for the next request
+        loop->num_available--;
+        if (loop->num_available == 0 && loop->num_workers < loop->mount->opts.max_threads) start_worker(loop);
+        pthread_mutex_unlock(&loop->lock);
+
+#if FUSE_USE_VERSION >= 30
+        fuse_session_process_buf(loop->se, &w->fbuf);
+#else
+        fuse_session_process_buf(loop->se, &w->fbuf, ch);
+#endif
+
+        pthread_mutex_lock(&loop->lock);
+        loop->num_available++;
+        if (loop->num_available > loop->mount->opts.max_idle_threads) {
+            if (loop->exit) {
+                pthread_mutex_unlock(&loop->lock);
+                return NULL;
+            }
+
+            // Too many idle workers, reap this one
+            list_del_worker(w);
+            loop->num_available--;
+            loop->num_workers--;
+            pthread_mutex_unlock(&loop->lock);
+
+            pthread_detach(w->thread);
+            free_worker(w);
+            return NULL;
+        }
+        pthread_mutex_unlock(&loop->lock);
+    }
+
+    sem_post(&loop->finish);
+    return NULL;
+}
+
+/* Must be called with loop->lock held */
+static int start_worker(loop_t *loop) {
+    sigset_t       oldset, newset;
+    loop_worker_t *w = calloc(1, sizeof(loop_worker_t));
+    if (!w) {
+        fprintf(stderr, "fuse: failed to allocate worker structure\n");
+        return -1;
+    }
+    w->loop = loop;
+
+#if FUSE_USE_VERSION < 30
+    // FUSE 2 does not allocate the receive buffer on its own
+    w->fbuf.size = fuse_chan_bufsize(loop->ch);
+    w->fbuf.mem  = malloc(w->fbuf.size);
+    if (!w->fbuf.mem) {
+        fprintf(stderr, "fuse: failed to allocate read buffer\n");
+        free(w);
+        return -1;
+    }
+#endif
+
+    // Disallow signal reception in worker threads, the signal handlers only need to run once
+    sigemptyset(&newset);
+    sigaddset(&newset, SIGTERM);
+    sigaddset(&newset, SIGINT);
+    sigaddset(&newset, SIGHUP);
+    sigaddset(&newset, SIGQUIT);
+    sigaddset(&newset, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    int res = pthread_create(&w->thread, NULL, worker_thread, w);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (res != 0) {
+        fprintf(stderr, "fuse: error creating thread: %s\n", strerror(res));
+        free_worker(w);
+        return -1;
+    }
+
+    list_add_worker(w, &loop->main);
+    loop->num_available++;
+    loop->num_workers++;
+    return 0;
+}
+
+/*
+ * Wait until the session exits. With an idle timeout or trimming, sleep until the next of their deadlines. Requests do
+ * not wake this thread, they only move the deadlines further out, which is noticed when the old one passed.
+ */
+static void wait_for_exit(loop_t *loop) {
+    const long long timeout  = loop->mount->opts.idle_timeout_secs;
+    const bool      trim     = loop->mount->opts.trim_idle_secs || loop->mount->opts.trim_pressure;
+    long long       deadline = timeout || trim ? 0 : LLONG_MAX;
+
+    while (!fuse_session_exited(loop->se)) {
+        if (atomic_load(&loop->mount->exit_requested)) {
+            fuse_session_exit(loop->se);
+            break;
+        }
+
+        if (deadline == LLONG_MAX) {
+            sem_wait(&loop->finish);
+        } else {
+            // sem_timedwait measures CLOCK_REALTIME, just like time()
+            const struct timespec ts = {.tv_sec = (time_t)deadline, .tv_nsec = 0};
+            sem_timedwait(&loop->finish, &ts);
+        }
+        private_stats_poll_signal(loop->mount);
+
+        const long long now = (long long)time(NULL);
+        deadline            = trim ? private_trim_tick(loop->mount) : LLONG_MAX;
+        if (timeout) {
+            long long idle_end = atomic_load(&loop->mount->last_request) + timeout + 1;
+            if (now >= idle_end && atomic_load(&loop->mount->open_files) == 0) {
+                fuse_session_exit(loop->se);
+                break;
+            }
+            // Closing the last file is a request as well, the timeout starts over from there
+            if (now >= idle_end) idle_end = now + timeout;
+            if (idle_end < deadline) deadline = idle_end;
+        }
+    }
+}
+
+#if FUSE_USE_VERSION >= 30
+int private_ll_session_loop(struct fuse_session *se, private_mount_t *mount) {
+#else
+int private_ll_session_loop(struct fuse_session *se, struct fuse_chan *ch, private_mount_t *mount) {
+#endif
+    loop_t loop;
+    int    err;
+
+    if (mount->opts.max_threads == 0) {
+        mount->opts.max_threads = private_cpu_count();
+        if (mount->opts.max_threads < 4) mount->opts.max_threads = 4;
+    }
+
+    memset(&loop, 0, sizeof(loop));
+    loop.se = se;
+#if FUSE_USE_VERSION < 30
+    loop.ch = ch;
+#endif
+    loop.mount     = mount;
+    loop.main.prev = &loop.main;
+    loop.main.next = &loop.main;
+    sem_init(&loop.finish, 0, 0);
+    pthread_mutex_init(&loop.lock, NULL);
+
+    pthread_mutex_lock(&loop.lock);
+    err = start_worker(&loop);
+    pthread_mutex_unlock(&loop.lock);
+
+    pthread_mutex_lock(&mount->lock);
+    mount->loop_wake = &loop.finish;
+    pthread_mutex_unlock(&mount->lock);
+
+    if (!err) {
+        // The per-user daemon handles SIGUSR1 for all of its mounts
+        if (!mount->host) private_stats_signal_start(&loop.finish);
+        private_trim_start(mount, &loop.finish);
+        wait_for_exit(&loop);
+        private_trim_stop(mount);
+        if (!mount->host) private_stats_signal_stop();
+
+        pthread_mutex_lock(&loop.lock);
+        for (loop_worker_t *w = loop.main.next; w != &loop.main; w = w->next) pthread_cancel(w->thread);
+        loop.exit = true;
+        pthread_mutex_unlock(&loop.lock);
+
+        while (loop.main.next != &loop.main) {
+            loop_worker_t *w = loop.main.next;
+            pthread_join(w->thread, NULL);
+            list_del_worker(w);
+            free_worker(w);
+        }
+
+        err = loop.error;
+    }
+
+    pthread_mutex_lock(&mount->lock);
+    mount->loop_wake = NULL;
+    pthread_mutex_unlock(&mount->lock);
+
+    pthread_mutex_destroy(&loop.lock);
+    sem_destroy(&loop.finish);
+
+    fuse_session_reset(se);
+    return err;
+}
+
+void private_ll_session_exit(private_mount_t *mount) {
+    atomic_store(&mount->exit_requested, true);
+    pthread_mutex_lock(&mount->lock);
+    if (mount->loop_wake) sem_post(mount->loop_wake);
+    pthread_mutex_unlock(&mount->lock);
+}
@@ -29,6 +29,10 @@
  */
 
 #include "ll.h"
+#include "ll_private.h"
+#include "disk_cache.h"
+#include "decompress_ctx.h"
+#include "private.h"
 #include "fuseprivate.h"
 #include "stat.h"
 
@@ -42,8 +46,19 @@
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <sys/mount.h>
 
-int fusefs_main(int argc, char *argv[], void (*mounted)(void)) {
+/*
+ * Without host, this is the regular mount daemon of one launch. With host, the mount is one of the images served by
+ * the per-user daemon (see ll_daemon.c).
+ */
+static int run(int                     argc,
+               char *                  argv[],
+               void                    (*mounted)(void),
+               private_host_t *        host,
+               uint64_t                cache_key_base,
+               private_hosted_state_fn state,
+               void *                  state_data) {
     struct fuse_args args;
     sqfs_opts        opts;
 
@@ -57,27 +72,39 @@ int fusefs_main(int argc, char *argv[], void (*mounted)(void)) {
 #endif
 
     int             err;
-    sqfs_ll *       ll;
+    sqfs_ll *       ll         = NULL;
+    bool            mount_init = false; // private_mount_init succeeded
+    bool            fuse_mount = false; // sqfs_ll_mount succeeded
+    private_mount_t mount;
     struct fuse_opt fuse_opts[] = {{"offset=%zu", offsetof(sqfs_opts, offset), 0},
                                    {"timeout=%u", offsetof(sqfs_opts, idle_timeout_secs), 0},
                                    FUSE_OPT_END};
+    struct fuse_opt private_opts[] = {
+        {"max_threads=%u", offsetof(private_ll_opts_t, max_threads), 0},
+        {"max_idle_threads=%u", offsetof(private_ll_opts_t, max_idle_threads), 0},
+        {"splice", offsetof(private_ll_opts_t, splice), 1},
+        {"no_splice", offsetof(private_ll_opts_t, splice), 0},
+        {"mmap", offsetof(private_ll_opts_t, mmap), 1},
+        {"no_mmap", offsetof(private_ll_opts_t, mmap), 0},
+        {"block_cache_mb=%u", offsetof(private_ll_opts_t, block_cache_mb), 0},
+        {"readahead_kb=%u", offsetof(private_ll_opts_t, readahead_kb), 0},
+        {"decompress_threads=%u", offsetof(private_ll_opts_t, decompress_threads), 0},
+        {"preload_metadata_mb=%u", offsetof(private_ll_opts_t, preload_metadata_mb), 0},
+        {"disk_cache_mb=%u", offsetof(private_ll_opts_t, disk_cache_mb), 0},
+        {"profile", offsetof(private_ll_opts_t, profile), 1},
+        {"profile_secs=%u", offsetof(private_ll_opts_t, profile_secs), 0},
+        {"trace_sort=%s", offsetof(private_ll_opts_t, trace_sort), 0},
+        {"share", offsetof(private_ll_opts_t, share), 1},
+        {"linger=%u", offsetof(private_ll_opts_t, linger_secs), 0},
+        {"fuse_fd=%d", offsetof(private_ll_opts_t, fuse_fd), 0},
+        {"trim_idle=%u", offsetof(private_ll_opts_t, trim_idle_secs), 0},
+        {"trim_pressure=%u", offsetof(private_ll_opts_t, trim_pressure), 0},
+        {"dir_index_mb=%u", offsetof(private_ll_opts_t, dir_index_mb), 0},
+        FUSE_OPT_END,
+    };
 
     struct fuse_lowlevel_ops sqfs_ll_ops;
-    memset(&sqfs_ll_ops, 0, sizeof(sqfs_ll_ops));
-    sqfs_ll_ops.getattr    = sqfs_ll_op_getattr;
-    sqfs_ll_ops.opendir    = sqfs_ll_op_opendir;
-    sqfs_ll_ops.releasedir = sqfs_ll_op_releasedir;
-    sqfs_ll_ops.readdir    = sqfs_ll_op_readdir;
-    sqfs_ll_ops.lookup     = sqfs_ll_op_lookup;
-    sqfs_ll_ops.open       = sqfs_ll_op_open;
-    sqfs_ll_ops.create     = sqfs_ll_op_create;
-    sqfs_ll_ops.release    = sqfs_ll_op_release;
-    sqfs_ll_ops.read       = sqfs_ll_op_read;
-    sqfs_ll_ops.readlink   = sqfs_ll_op_readlink;
-    sqfs_ll_ops.listxattr  = sqfs_ll_op_listxattr;
-    sqfs_ll_ops.getxattr   = sqfs_ll_op_getxattr;
-    sqfs_ll_ops.forget     = sqfs_ll_op_forget;
-    sqfs_ll_ops.statfs     = stfs_ll_op_statfs;
+    private_ll_ops_init(&sqfs_ll_ops);
 
     /* PARSE ARGS */
     args.argc      = argc;
@@ -89,16 +116,75 @@ int fusefs_main(int argc, char *argv[], void (*mounted)(void)) {
     opts.mountpoint        = 0;
     opts.offset            = 0;
     opts.idle_timeout_secs = 0;
-    if (fuse_opt_parse(&args, &opts, fuse_opts, sqfs_opt_proc) == -1) sqfs_usage(argv[0], true);
 
+    memset(&mount.opts, 0, sizeof(mount.opts));
+    mount.opts.max_idle_threads    = 10;
+    mount.opts.splice              = 1;
+    mount.opts.block_cache_mb      = 32;
+    mount.opts.readahead_kb        = 2048;
+    mount.opts.preload_metadata_mb = 4;
+    mount.opts.profile_secs        = 10;
+    mount.opts.linger_secs         = 5;
+    mount.opts.fuse_fd             = -1;
+    mount.opts.trim_idle_secs      = 120;
+    mount.opts.trim_pressure       = 10;
+    mount.opts.dir_index_mb        = 4;
+
+    // The option has precedence over the environment
+    const char *cache_env = getenv("APPIMAGE_BLOCK_CACHE_MB");
+    if (cache_env) mount.opts.block_cache_mb = (unsigned)strtoul(cache_env, NULL, 10);
+    const char *disk_cache_env = getenv("APPIMAGE_DISK_CACHE_MB");
+    if (disk_cache_env) mount.opts.disk_cache_mb = (unsigned)strtoul(disk_cache_env, NULL, 10);
+    const char *linger_env = getenv("APPIMAGE_MOUNT_LINGER");
+    if (linger_env) mount.opts.linger_secs = (unsigned)strtoul(linger_env, NULL, 10);
+    const char *trace_env = getenv("APPIMAGE_TRACE_SORT");
+    if (trace_env && trace_env[0]) mount.opts.trace_sort = strdup(trace_env);
+
+    // Unknown options are kept for the squashfuse / libfuse parsers below
+    bool usage_error = fuse_opt_parse(&args, &mount.opts, private_opts, NULL) == -1;
+
+    // The daemon changes its working directory to / once it is mounted
+    if (mount.opts.trace_sort && mount.opts.trace_sort[0] != '/') {
+        char *cwd      = getcwd(NULL, 0);
+        char *absolute = cwd ? malloc(strlen(cwd) + 1 + strlen(mount.opts.trace_sort) + 1) : NULL;
+        if (absolute) {
+            strcpy(absolute, cwd);
+            strcat(absolute, "/");
+            strcat(absolute, mount.opts.trace_sort);
+            free(mount.opts.trace_sort);
+            mount.opts.trace_sort = absolute;
+        }
+        free(cwd);
+    }
+
+    usage_error = usage_error || fuse_opt_parse(&args, &opts, fuse_opts, sqfs_opt_proc) == -1;
+
+    fuse_cmdline_opts.mountpoint = NULL;
+#if FUSE_USE_VERSION >= 30
+    usage_error = usage_error || fuse_parse_cmdline(&args, &fuse_cmdline_opts) != 0;
+#else
+    usage_error = usage_error || fuse_parse_cmdline(&args,
+                                                    &fuse_cmdline_opts.mountpoint,
+                                                    &fuse_cmdline_opts.mt,
+                                                    &fuse_cmdline_opts.foreground) == -1;
+#endif
+    usage_error = usage_error || fuse_cmdline_opts.mountpoint == NULL;
+    if (usage_error) {
+        // The daemon serves other images, a bad request must not take them down
+        if (!host) sqfs_usage(argv[0], true);
+        fprintf(stderr, "%s: invalid mount request for %s\n", argv[0], opts.image ? opts.image : "(none)");
+        free(mount.opts.trace_sort);
+        free(fuse_cmdline_opts.mountpoint);
+        fuse_opt_free_args(&args);
+        return -EINVAL;
+    }
+
+    mount.opts.idle_timeout_secs = opts.idle_timeout_secs;
 #if FUSE_USE_VERSION >= 30
-    if (fuse_parse_cmdline(&args, &fuse_cmdline_opts) != 0)
+    if (fuse_cmdline_opts.singlethread) mount.opts.max_threads = 1;
 #else
-    if (fuse_parse_cmdline(
-            &args, &fuse_cmdline_opts.mountpoint, &fuse_cmdline_opts.mt, &fuse_cmdline_opts.foreground) == -1)
+    if (!fuse_cmdline_opts.mt) mount.opts.max_threads = 1;
 #endif
-        sqfs_usage(argv[0], true);
-    if (fuse_cmdline_opts.mountpoint == NULL) sqfs_usage(argv[0], true);
 
     /* fuse_daemonize() will unconditionally clobber fds 0-2.
      *
@@ -125,32 +211,123 @@ int fusefs_main(int argc, char *argv[], void (*mounted)(void)) {
 
     /* OPEN FS */
     err = !(ll = sqfs_ll_open(opts.image, opts.offset));
+    if (!err) err = !(mount_init = private_mount_init(&mount, ll));
+    if (!err && host) {
+        mount.host           = host;
+        mount.cache_key_base = cache_key_base;
+        mount.opts.share     = 0; // The daemon shares all of its mounts
+    }
+    // Truncating or rewriting a mapped image SIGBUSes the daemon, which must not take the other mounts of a host down
+    if (!err && mount.opts.mmap && !host) private_image_map_open(&mount.image_map, &ll->fs); // Falls back to pread
+    if (!err && mount.opts.dir_index_mb) {
+        mount.dir_index = private_dir_index_new((size_t)mount.opts.dir_index_mb * 1024 * 1024); // NULL: linear scans
+    }
+    if (!err) private_decompress_hook(&ll->fs); // Innermost, the other hooks wrap it
+    if (!err) private_stats_hook(&ll->fs); // Disk cache hits never reach the decompressor, only real work is measured
+    if (!err && mount.opts.disk_cache_mb && private_disk_cache_open((size_t)mount.opts.disk_cache_mb * 1024 * 1024)) {
+        // Before anything else decompresses, the preload below already benefits from the cache
+        private_image_map_cache(&mount.image_map, &ll->fs);
+    }
+    if (!err && host) {
+        mount.block_cache = host->block_cache;
+    } else if (!err && mount.opts.block_cache_mb) {
+        mount.block_cache = private_block_cache_new((size_t)mount.opts.block_cache_mb * 1024 * 1024);
+    }
+    if (!err) private_preload_metadata(&mount);
+    if (!err) err = !private_readahead_init(&mount);
+    if (!err && host) {
+        mount.decompress_pool = host->decompress_pool;
+    } else if (!err) {
+        // The request worker decompresses one block itself, the pool only needs the remaining threads
+        unsigned threads = mount.opts.decompress_threads ? mount.opts.decompress_threads : private_cpu_count();
+        if (threads > 1) err = !(mount.decompress_pool = private_thread_pool_new(threads - 1));
+    }
+    if (!err && mount.opts.profile) mount.profile = private_profile_new(&mount);
+    if (!err && mount.opts.trace_sort) mount.trace = private_trace_new(&mount, mount.opts.trace_sort);
 
     /* STARTUP FUSE */
+    const char *mount_target = fuse_cmdline_opts.mountpoint;
+#if FUSE_USE_VERSION >= 30
+    char fd_path[32];
+#endif
+    if (!err && mount.opts.fuse_fd >= 0) {
+#if FUSE_USE_VERSION >= 30
+        // Mounted by the launcher already (see userns.c), libfuse takes over the /dev/fuse fd without fusermount
+        snprintf(fd_path, sizeof(fd_path), "/dev/fd/%d", mount.opts.fuse_fd);
+        mount_target = fd_path;
+#else
+        fprintf(stderr, "%s: serving a /dev/fuse fd requires FUSE 3\n", argv[0]);
+        err = 1;
+#endif
+    }
+
+    sqfs_ll_chan ch;
     if (!err) {
-        sqfs_ll_chan ch;
         err = -1;
-        if (sqfs_ll_mount(&ch, fuse_cmdline_opts.mountpoint, &args, &sqfs_ll_ops, sizeof(sqfs_ll_ops), ll) == SQFS_OK) {
-            if (sqfs_ll_daemonize(fuse_cmdline_opts.foreground) != -1) {
+        if (sqfs_ll_mount(&ch, mount_target, &args, &sqfs_ll_ops, sizeof(sqfs_ll_ops), &mount) == SQFS_OK) {
+            fuse_mount = true;
+#if FUSE_USE_VERSION >= 30
+            mount.session = ch.session;
+#else
+            mount.chan = ch.ch;
+#endif
+            if (host) {
+                // Runs in a thread of the daemon, which handles the signals itself
+                state(&mount, state_data);
+#if FUSE_USE_VERSION >= 30
+                err = private_ll_session_loop(ch.session, &mount);
+#else
+                err = private_ll_session_loop(ch.session, ch.ch, &mount);
+#endif
+                state(NULL, state_data);
+            } else if (sqfs_ll_daemonize(fuse_cmdline_opts.foreground) != -1) {
                 if (fuse_set_signal_handlers(ch.session) != -1) {
-                    if (opts.idle_timeout_secs) {
-                        setup_idle_timeout(ch.session, opts.idle_timeout_secs);
+                    // Before mounted(): the launch that started the daemon drops its reference through the share
+                    if (mount.opts.share) {
+                        char *socket_path = private_share_socket_path(opts.image, opts.offset);
+                        if (!socket_path ||
+                            !private_share_start(socket_path, fuse_cmdline_opts.mountpoint, mount.opts.linger_secs)) {
+                            fprintf(stderr, "%s: failed to share the mount, it is only used by this launch\n", argv[0]);
+                        }
+                        free(socket_path);
                     }
                     if (mounted) {
                         mounted();
                     }
-                    /* FIXME: multithreading */
-                    err = fuse_session_loop(ch.session);
-                    teardown_idle_timeout();
+#if FUSE_USE_VERSION >= 30
+                    err = private_ll_session_loop(ch.session, &mount);
+#else
+                    err = private_ll_session_loop(ch.session, ch.ch, &mount);
+#endif
+                    private_share_stop();
                     fuse_remove_signal_handlers(ch.session);
+                    if (fuse_cmdline_opts.foreground) private_stats_print(&mount, stderr);
                 }
             }
-            sqfs_ll_destroy(ll);
-            sqfs_ll_unmount(&ch, fuse_cmdline_opts.mountpoint);
         }
     }
+
+    /* SHUTDOWN */
+    // Undoes every stage that was reached, also when a setup step or the mount failed: the daemon calls run() for
+    // every image it serves, anything left behind here would leak for its whole lifetime.
+    if (mount_init) {
+        // Pending replays and read ahead still read from the image
+        private_profile_free(mount.profile);
+        private_readahead_destroy(&mount);
+        if (mount.decompress_pool && !host) private_thread_pool_free(mount.decompress_pool);
+        private_trace_free(mount.trace);
+    }
+    if (ll) sqfs_ll_destroy(ll);
+    if (fuse_mount) {
+        sqfs_ll_unmount(&ch, mount_target);
+        // libfuse does not unmount what it did not mount, the daemon owns the user namespace
+        if (mount_target != fuse_cmdline_opts.mountpoint) umount2(fuse_cmdline_opts.mountpoint, MNT_DETACH);
+    }
+    if (mount_init) private_mount_destroy(&mount);
+    if (!host) private_disk_cache_close(); // The other images of the daemon still use it
+    free(mount.opts.trace_sort);
     fuse_opt_free_args(&args);
-    if (mounted) {
+    if (mounted || host) {
         rmdir(fuse_cmdline_opts.mountpoint);
     }
     free(ll);
@@ -158,3 +335,12 @@ int fusefs_main(int argc, char *argv[], void (*mounted)(void)) {
 
     return -err;
 }
+
+int fusefs_main(int argc, char *argv[], void (*mounted)(void)) {
+    return run(argc, argv, mounted, NULL, 0, NULL, NULL);
+}
+
+int private_fusefs_hosted(
+    int argc, char *argv[], private_host_t *host, uint64_t cache_key_base, private_hosted_state_fn state, void *data) {
+    return run(argc, argv, NULL, host, cache_key_base, state, data);
+}
@@ -0,0 +1,573 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Thread safe versions of the squashfuse low-level operations. They follow the implementations in squashfuse/ll.c,
+ * but take private_mount_t::lock around every access to the sqfs_ll state and never call fuse_reply_* while holding
+ * it, so that a slow client can not block other workers.
+ */
+
+#include "ll_private.h"
+#include "stat.h"
+#include "xattr.h"
+#include "nonstd.h"
+
+#include <errno.h>
+#include <float.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/statvfs.h>
+
+// The image is read only, so everything we return stays valid forever
+static const double SQFS_TIMEOUT = DBL_MAX;
+
+bool private_mount_init(private_mount_t *mount, sqfs_ll *ll) {
+    mount->ll              = ll;
+    mount->block_cache     = NULL;
+    mount->profile         = NULL;
+    mount->trace           = NULL;
+    mount->readahead_pool  = NULL;
+    mount->decompress_pool = NULL;
+    mount->host            = NULL;
+    mount->cache_key_base  = 0;
+    mount->loop_wake       = NULL;
+    mount->dir_index       = NULL;
+    memset(&mount->image_map, 0, sizeof(mount->image_map));
+    mount->readahead_tasks = 0;
+    atomic_init(&mount->exit_requested, false);
+    atomic_init(&mount->open_files, 0);
+    atomic_init(&mount->last_request, (long long)time(NULL));
+    memset(&mount->trim, 0, sizeof(mount->trim));
+    mount->trim.trigger_fd = -1;
+    atomic_init(&mount->trim.triggered, false);
+    private_stats_init(&mount->stats);
+    return pthread_mutex_init(&mount->lock, NULL) == 0 && pthread_mutex_init(&mount->readahead_lock, NULL) == 0 &&
+           pthread_cond_init(&mount->readahead_idle, NULL) == 0;
+}
+
+void private_mount_destroy(private_mount_t *mount) {
+    if (!mount->host) {
+        private_block_cache_free(mount->block_cache);
+    } else if (mount->block_cache) {
+        // The cache is shared with the other images of the daemon, the key range of this mount is reused later
+        const uint64_t base = mount->cache_key_base;
+        private_block_cache_drop(mount->block_cache, base, PRIVATE_HOST_KEY_LAST(base));
+    }
+    private_image_map_close(&mount->image_map);
+    private_dir_index_free(mount->dir_index);
+    pthread_cond_destroy(&mount->readahead_idle);
+    pthread_mutex_destroy(&mount->readahead_lock);
+    pthread_mutex_destroy(&mount->lock);
+}
+
+// Read ahead in large chunks, the kernel caps this at the read_ahead_kb of the mount anyway
+static const unsigned MAX_READAHEAD = 1024 * 1024;
+
+// Number of asynchronous (read ahead) requests the kernel keeps in flight, the libfuse default is 12
+static const unsigned MAX_BACKGROUND = 64;
+
+static void op_init(void *userdata, struct fuse_conn_info *conn) {
+    private_mount_t *mount = userdata;
+
+    if (mount->opts.splice) {
+        // SPLICE_WRITE lets private_ll_op_read hand uncompressed blocks from the image fd to /dev/fuse without
+        // copying them through userspace. SPLICE_READ only matters for write requests, which we never get.
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE | FUSE_CAP_SPLICE_READ);
+    }
+
+    // Nothing in the image ever changes, so there is no need to compare mtime / size to invalidate cached pages
+#ifdef FUSE_CAP_AUTO_INVAL_DATA
+    conn->want &= ~FUSE_CAP_AUTO_INVAL_DATA;
+#endif
+#ifdef FUSE_CAP_CACHE_SYMLINKS
+    conn->want |= conn->capable & FUSE_CAP_CACHE_SYMLINKS;
+#endif
+#if FUSE_USE_VERSION >= 30
+    // Let the kernel decide when to use readdirplus (READDIRPLUS_AUTO, enabled by libfuse) based on whether the
+    // entries of the last listing were looked up afterwards
+    conn->want |= conn->capable & FUSE_CAP_READDIRPLUS;
+#endif
+#ifdef FUSE_CAP_PARALLEL_DIROPS
+    conn->want |= conn->capable & FUSE_CAP_PARALLEL_DIROPS;
+#endif
+
+    // With FUSE 3, libfuse negotiates max_pages from max_write (1 MiB by default), which also raises the limit for
+    // read requests. Leave max_write and max_read alone so this is not undone.
+    conn->max_readahead        = MAX_READAHEAD;
+    conn->max_background       = MAX_BACKGROUND;
+    conn->congestion_threshold = MAX_BACKGROUND * 3 / 4;
+}
+
+static inline private_mount_t *req_mount(fuse_req_t req) {
+    return (private_mount_t *)fuse_req_userdata(req);
+}
+
+/* Must be called with the mount lock held. Returns 0 or an errno value. */
+static int mount_inode(private_mount_t *mount, sqfs_inode *inode, fuse_ino_t ino) {
+    return sqfs_ll_inode(mount->ll, inode, ino) == SQFS_OK ? 0 : ENOENT;
+}
+
+static void op_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    private_mount_t *mount = req_mount(req);
+    sqfs_inode       inode;
+    struct stat      st;
+    int              err;
+    (void)fi;
+
+    if (ino == PRIVATE_STATS_INO) {
+        private_stats_getattr(req);
+        return;
+    }
+
+    pthread_mutex_lock(&mount->lock);
+    err = mount_inode(mount, &inode, ino);
+    if (!err && sqfs_stat(&mount->ll->fs, &inode, &st)) err = ENOENT;
+    pthread_mutex_unlock(&mount->lock);
+
+    if (err) {
+        fuse_reply_err(req, err);
+        return;
+    }
+
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, SQFS_TIMEOUT);
+}
+
+static void op_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    private_mount_t *       mount = req_mount(req);
+    sqfs_inode              inode;
+    sqfs_name               namebuf;
+    sqfs_dir_entry          entry;
+    struct fuse_entry_param fentry;
+    bool                    searched = false; // The parent resolved to a directory and was searched for name
+    bool                    found    = false;
+    int                     err;
+
+    if (private_stats_lookup(req, parent, name)) return;
+
+    memset(&fentry, 0, sizeof(fentry));
+    sqfs_dentry_init(&entry, namebuf);
+
+    pthread_mutex_lock(&mount->lock);
+    err = mount_inode(mount, &inode, parent);
+    if (!err && !S_ISDIR(inode.base.mode)) err = ENOTDIR;
+    if (!err && private_dir_lookup(mount, &inode, name, strlen(name), &entry, &found)) err = EIO;
+    if (!err) searched = true;
+    if (!err && !found) err = ENOENT;
+    if (!err && sqfs_inode_get(&mount->ll->fs, &inode, sqfs_dentry_inode(&entry))) err = ENOENT;
+    if (!err && sqfs_stat(&mount->ll->fs, &inode, &fentry.attr)) err = EIO;
+    if (!err) fentry.ino = mount->ll->ino_register(mount->ll, &entry);
+    pthread_mutex_unlock(&mount->lock);
+
+    if (searched && !found) {
+        // Negative entry: the kernel remembers that the name does not exist (ld.so and Python probe a lot of those)
+        fentry.ino           = 0;
+        fentry.entry_timeout = SQFS_TIMEOUT;
+        fuse_reply_entry(req, &fentry);
+        return;
+    }
+    if (err) {
+        fuse_reply_err(req, err);
+        return;
+    }
+
+    fentry.attr_timeout  = SQFS_TIMEOUT;
+    fentry.entry_timeout = SQFS_TIMEOUT;
+    fentry.attr.st_ino   = fentry.ino;
+    if (fuse_reply_entry(req, &fentry) == 0) private_profile_replay(mount->profile, fentry.ino, &inode);
+}
+
+static void op_forget(fuse_req_t req, fuse_ino_t ino, private_nlookup_t nlookup) {
+    private_mount_t *mount = req_mount(req);
+
+    pthread_mutex_lock(&mount->lock);
+    if (ino != PRIVATE_STATS_INO) mount->ll->ino_forget(mount->ll, ino, nlookup);
+    pthread_mutex_unlock(&mount->lock);
+
+    fuse_reply_none(req);
+}
+
+static void op_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    private_mount_t *mount = req_mount(req);
+
+    // One lock round trip for the whole batch, the kernel sends these when evicting large parts of the dcache
+    pthread_mutex_lock(&mount->lock);
+    for (size_t i = 0; i < count; i++) {
+        if (forgets[i].ino != PRIVATE_STATS_INO) mount->ll->ino_forget(mount->ll, forgets[i].ino, forgets[i].nlookup);
+    }
+    pthread_mutex_unlock(&mount->lock);
+
+    fuse_reply_none(req);
+}
+
+static void op_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    private_mount_t *mount = req_mount(req);
+    sqfs_inode *     inode = malloc(sizeof(sqfs_inode));
+    int              err   = inode ? 0 : ENOMEM;
+
+    if (!err) {
+        pthread_mutex_lock(&mount->lock);
+        err = mount_inode(mount, inode, ino);
+        pthread_mutex_unlock(&mount->lock);
+    }
+    if (!err && !S_ISDIR(inode->base.mode)) err = ENOTDIR;
+
+    if (err) {
+        free(inode);
+        fuse_reply_err(req, err);
+        return;
+    }
+
+    fi->fh         = (intptr_t)inode;
+    fi->keep_cache = 1;
+#if FUSE_USE_VERSION >= 30
+    fi->cache_readdir = 1;
+#endif
+    atomic_fetch_add(&mount->open_files, 1);
+    fuse_reply_open(req, fi);
+}
+
+static void op_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void)ino;
+    free((sqfs_inode *)(intptr_t)fi->fh);
+    atomic_fetch_sub(&req_mount(req)->open_files, 1);
+    fuse_reply_err(req, 0); // yes, this is how to return success
+}
+
+static void op_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    private_mount_t *mount = req_mount(req);
+    sqfs_inode *     inode = (sqfs_inode *)(intptr_t)fi->fh;
+    sqfs_err         sqerr = SQFS_OK;
+    sqfs_dir         dir;
+    sqfs_name        namebuf;
+    sqfs_dir_entry   entry;
+    struct stat      st;
+    char *           buf = NULL, *bufpos = NULL;
+    int              err = 0;
+    (void)ino;
+
+    if (!(bufpos = buf = malloc(size))) err = ENOMEM;
+
+    pthread_mutex_lock(&mount->lock);
+    if (!err && sqfs_dir_open(&mount->ll->fs, inode, &dir, off)) err = EINVAL;
+    if (!err) {
+        memset(&st, 0, sizeof(st));
+        sqfs_dentry_init(&entry, namebuf);
+        while (sqfs_dir_next(&mount->ll->fs, &dir, &entry, &sqerr)) {
+            st.st_ino    = mount->ll->ino_fuse_num(mount->ll, &entry);
+            st.st_mode   = sqfs_dentry_mode(&entry);
+            size_t esize = fuse_add_direntry(
+                req, bufpos, size, sqfs_dentry_name(&entry), &st, sqfs_dentry_next_offset(&entry));
+            if (esize > size) break;
+            bufpos += esize;
+            size -= esize;
+        }
+        if (sqerr) err = EIO;
+    }
+    pthread_mutex_unlock(&mount->lock);
+
+    if (err) {
+        fuse_reply_err(req, err);
+    } else {
+        fuse_reply_buf(req, buf, bufpos - buf);
+    }
+    free(buf);
+}
+
+#if FUSE_USE_VERSION >= 30
+/*
+ * Like op_readdir, but every entry also carries its attributes and counts as a lookup, so listing a directory and
+ * stat'ing all entries takes a single round trip per buffer instead of one per entry.
+ */
+static void op_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    private_mount_t *       mount = req_mount(req);
+    sqfs_inode *            inode = (sqfs_inode *)(intptr_t)fi->fh;
+    sqfs *                  fs    = &mount->ll->fs;
+    sqfs_err                sqerr = SQFS_OK;
+    sqfs_dir                dir;
+    sqfs_name               namebuf;
+    sqfs_dir_entry          entry;
+    sqfs_inode              child;
+    struct fuse_entry_param fentry;
+    char *                  buf = NULL, *bufpos = NULL;
+    int                     err = 0;
+    (void)ino;
+
+    if (!(bufpos = buf = malloc(size))) err = ENOMEM;
+
+    pthread_mutex_lock(&mount->lock);
+    if (!err && sqfs_dir_open(fs, inode, &dir, off)) err = EINVAL;
+    if (!err) {
+        sqfs_dentry_init(&entry, namebuf);
+        while (sqfs_dir_next(fs, &dir, &entry, &sqerr)) {
+            const char *name = sqfs_dentry_name(&entry);
+
+            // Check that the entry fits before registering it, the kernel only forgets what it received
+            if (fuse_add_direntry_plus(req, NULL, 0, name, NULL, 0) > size) break;
+
+            memset(&fentry, 0, sizeof(fentry));
+            if (sqfs_inode_get(fs, &child, sqfs_dentry_inode(&entry)) || sqfs_stat(fs, &child, &fentry.attr)) {
+                sqerr = SQFS_ERR;
+                break;
+            }
+            fentry.ino           = mount->ll->ino_register(mount->ll, &entry);
+            fentry.attr.st_ino   = fentry.ino;
+            fentry.attr_timeout  = SQFS_TIMEOUT;
+            fentry.entry_timeout = SQFS_TIMEOUT;
+
+            size_t esize = fuse_add_direntry_plus(req, bufpos, size, name, &fentry, sqfs_dentry_next_offset(&entry));
+            bufpos += esize;
+            size -= esize;
+        }
+        // Entries that were already added are registered, they must be sent even if a later one failed
+        if (sqerr && bufpos == buf) err = EIO;
+    }
+    pthread_mutex_unlock(&mount->lock);
+
+    if (err) {
+        fuse_reply_err(req, err);
+    } else {
+        fuse_reply_buf(req, buf, bufpos - buf);
+    }
+    free(buf);
+}
+#endif
+
+static void op_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    private_mount_t *mount = req_mount(req);
+    private_file_t * file;
+    int              err = 0;
+
+    if (ino == PRIVATE_STATS_INO) {
+        private_stats_open(req, mount, fi);
+        return;
+    }
+    if (fi->flags & (O_WRONLY | O_RDWR)) {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+
+    file = calloc(1, sizeof(private_file_t));
+    if (!file) err = ENOMEM;
+
+    if (!err) {
+        pthread_mutex_lock(&mount->lock);
+        err = mount_inode(mount, &file->inode, ino);
+        pthread_mutex_unlock(&mount->lock);
+    }
+    if (!err && !S_ISREG(file->inode.base.mode)) err = EISDIR;
+
+    if (err) {
+        free(file);
+        fuse_reply_err(req, err);
+        return;
+    }
+
+
+    private_readahead_file_init(file);
+    fi->fh         = (intptr_t)file;
+    fi->keep_cache = 1;
+    atomic_fetch_add(&mount->open_files, 1);
+    if (fuse_reply_open(req, fi) == 0) private_profile_replay(mount->profile, ino, &file->inode);
+}
+
+static void op_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    (void)parent;
+    (void)name;
+    (void)mode;
+    (void)fi;
+    fuse_reply_err(req, EROFS);
+}
+
+static void op_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    private_file_t *file = (private_file_t *)(intptr_t)fi->fh;
+
+    if (ino == PRIVATE_STATS_INO) {
+        private_stats_release(req, fi);
+        return;
+    }
+    private_readahead_file_destroy(file);
+    free(file);
+    fi->fh = 0;
+    atomic_fetch_sub(&req_mount(req)->open_files, 1);
+    fuse_reply_err(req, 0);
+}
+
+static void op_readlink(fuse_req_t req, fuse_ino_t ino) {
+    private_mount_t *mount = req_mount(req);
+    sqfs_inode       inode;
+    char *           dst = NULL;
+    size_t           size;
+    int              err;
+
+    pthread_mutex_lock(&mount->lock);
+    err = mount_inode(mount, &inode, ino);
+    if (!err && !S_ISLNK(inode.base.mode)) err = EINVAL;
+    if (!err && sqfs_readlink(&mount->ll->fs, &inode, NULL, &size)) err = EIO;
+    if (!err && !(dst = malloc(size + 1))) err = ENOMEM;
+    if (!err && sqfs_readlink(&mount->ll->fs, &inode, dst, &size)) err = EIO;
+    pthread_mutex_unlock(&mount->lock);
+
+    if (err) {
+        fuse_reply_err(req, err);
+    } else {
+        fuse_reply_readlink(req, dst);
+    }
+    free(dst);
+}
+
+static void op_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+    private_mount_t *mount = req_mount(req);
+    sqfs_inode       inode;
+    char *           buf = NULL;
+    int              err;
+
+    if (ino == PRIVATE_STATS_INO) {
+        if (size) {
+            fuse_reply_buf(req, NULL, 0);
+        } else {
+            fuse_reply_xattr(req, 0);
+        }
+        return;
+    }
+    if (size && !(buf = malloc(size))) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    pthread_mutex_lock(&mount->lock);
+    err = mount_inode(mount, &inode, ino);
+    if (!err) err = sqfs_listxattr(&mount->ll->fs, &inode, buf, &size);
+    pthread_mutex_unlock(&mount->lock);
+
+    if (err) {
+        fuse_reply_err(req, err);
+    } else if (buf) {
+        fuse_reply_buf(req, buf, size);
+    } else {
+        fuse_reply_xattr(req, size);
+    }
+    free(buf);
+}
+
+static void op_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    private_mount_t *mount = req_mount(req);
+    sqfs_inode       inode;
+    char *           buf  = NULL;
+    size_t           real = size;
+    int              err;
+
+    if (ino == PRIVATE_STATS_INO) {
+        fuse_reply_err(req, sqfs_enoattr());
+        return;
+    }
+    if (!(buf = malloc(size))) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    pthread_mutex_lock(&mount->lock);
+    err = mount_inode(mount, &inode, ino);
+    if (!err && sqfs_xattr_lookup(&mount->ll->fs, &inode, name, buf, &real)) err = EIO;
+    pthread_mutex_unlock(&mount->lock);
+
+    if (err) {
+        fuse_reply_err(req, err);
+    } else if (real == 0) {
+        fuse_reply_err(req, sqfs_enoattr());
+    } else if (size == 0) {
+        fuse_reply_xattr(req, real);
+    } else if (size < real) {
+        fuse_reply_err(req, ERANGE);
+    } else {
+        fuse_reply_buf(req, buf, real);
+    }
+    free(buf);
+}
+
+static void op_statfs(fuse_req_t req, fuse_ino_t ino) {
+    // The super block is never modified after sqfs_ll_open, no need to lock
+    const struct squashfs_super_block *sb = &req_mount(req)->ll->fs.sb;
+    struct statvfs                     st;
+    (void)ino;
+
+    memset(&st, 0, sizeof(st));
+    st.f_bsize   = sb->block_size;
+    st.f_frsize  = sb->block_size;
+    st.f_blocks  = (sb->bytes_used + sb->block_size - 1) / sb->block_size;
+    st.f_files   = sb->inodes;
+    st.f_namemax = SQUASHFS_NAME_LEN;
+    st.f_flag    = ST_RDONLY;
+    fuse_reply_statfs(req, &st);
+}
+
+/*
+ * Latency statistics. The request is gone after the reply, so the mount is taken before calling the operation. The
+ * measured time includes sending the reply to the kernel.
+ */
+#define TIMED(op, name, ...)                                                                                           \
+    do {                                                                                                               \
+        private_mount_t *mount_ = req_mount(req);                                                                      \
+        const uint64_t   start_ = private_stats_now();                                                                 \
+        name(req, __VA_ARGS__);                                                                                        \
+        private_stats_op_done(&mount_->stats, op, start_);                                                             \
+    } while (0)
+
+static void timed_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    TIMED(PRIVATE_OP_LOOKUP, op_lookup, parent, name);
+}
+
+static void timed_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    TIMED(PRIVATE_OP_GETATTR, op_getattr, ino, fi);
+}
+
+static void timed_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    TIMED(PRIVATE_OP_OPEN, op_open, ino, fi);
+}
+
+static void timed_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    TIMED(PRIVATE_OP_READ, private_ll_op_read, ino, size, off, fi);
+}
+
+static void timed_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    TIMED(PRIVATE_OP_READDIR, op_readdir, ino, size, off, fi);
+}
+
+#if FUSE_USE_VERSION >= 30
+static void timed_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    TIMED(PRIVATE_OP_READDIR, op_readdirplus, ino, size, off, fi);
+}
+#endif
+
+static void timed_readlink(fuse_req_t req, fuse_ino_t ino) {
+    TIMED(PRIVATE_OP_READLINK, op_readlink, ino);
+}
+
+static void timed_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    TIMED(PRIVATE_OP_GETXATTR, op_getxattr, ino, name, size);
+}
+
+void private_ll_ops_init(struct fuse_lowlevel_ops *ops) {
+    memset(ops, 0, sizeof(*ops));
+    ops->init         = op_init;
+    ops->getattr      = timed_getattr;
+    ops->opendir      = op_opendir;
+    ops->releasedir   = op_releasedir;
+    ops->readdir      = timed_readdir;
+    ops->lookup       = timed_lookup;
+    ops->open         = timed_open;
+    ops->create       = op_create;
+    ops->release      = op_release;
+    ops->read         = timed_read;
+    ops->readlink     = timed_readlink;
+    ops->listxattr    = op_listxattr;
+    ops->getxattr     = timed_getxattr;
+    ops->forget       = op_forget;
+    ops->forget_multi = op_forget_multi;
+    ops->statfs       = op_statfs;
+#if FUSE_USE_VERSION >= 30
+    ops->readdirplus = timed_readdirplus;
+#endif
+}
@@ -0,0 +1,181 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Metadata preload. Right after opening the image, the inode and directory tables (plus the blocks of the fragment,
+ * export and id lookup tables) are read with one large sequential read and all of their metadata blocks are
+ * decompressed in parallel into the squashfuse metadata cache. The first lookups after mounting then never wait on
+ * small scattered reads.
+ *
+ * The squashfuse metadata cache only has a handful of slots by default, so it is recreated with room for all
+ * preloaded blocks. squashfuse scans it linearly under the mount lock on every metadata access, so the number of slots
+ * is capped: larger metadata is only pulled into the page cache. All reads of the preloaded tables hit, only metadata
+ * outside of them (xattrs) cycles through the extra slots.
+ */
+
+#include "ll_private.h"
+#include "cache.h"
+#include "swap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define MD_BLOCK_SIZE SQUASHFS_METADATA_SIZE
+#define MD_EXTRA_SLOTS 64 // For the metadata that is not preloaded (e.g. xattrs)
+#define MD_MAX_SLOTS 512  // Bounds the linear scan of sqfs_cache_get
+
+typedef struct md_block {
+    uint64_t    pos;
+    size_t      data_size; // On disk, including the header
+    sqfs_block *block;
+    sqfs_err    err;
+} md_block_t;
+
+typedef struct md_task {
+    sqfs *                     fs;
+    const private_image_map_t *map;
+    md_block_t *               blocks;
+    size_t                     count;
+} md_task_t;
+
+static void md_entry_dispose(void *data) {
+    sqfs_block_cache_entry *entry = data;
+    sqfs_block_dispose(entry->block);
+}
+
+static void decompress_task(void *arg) {
+    md_task_t *task = arg;
+    // Only uses fs->fd, fs->sb, fs->decompressor and the mapping and is safe to call concurrently
+    for (size_t i = 0; i < task->count; i++) {
+        md_block_t *b = &task->blocks[i];
+        b->err        = private_image_md_block_read(task->map, task->fs, b->pos, &b->data_size, &b->block);
+    }
+}
+
+static size_t table_blocks(size_t entries, size_t each) {
+    return (entries * each + MD_BLOCK_SIZE - 1) / MD_BLOCK_SIZE;
+}
+
+/* End of the directory table: the lookup tables are stored right after it */
+static uint64_t directory_table_end(sqfs *fs) {
+    uint64_t end = fs->id_table.blocks[0];
+    if (fs->sb.fragments && fs->frag_table.blocks[0] < end) end = fs->frag_table.blocks[0];
+    if (sqfs_export_ok(fs) && fs->export_table.blocks[0] < end) end = fs->export_table.blocks[0];
+    return end;
+}
+
+/* Collect the positions of all metadata blocks of the inode and directory tables from the raw data */
+static size_t parse_md_blocks(const uint8_t *raw, uint64_t start, uint64_t end, md_block_t *blocks, size_t max) {
+    size_t   count = 0;
+    uint64_t pos   = start;
+
+    while (pos + 2 <= end && count < max) {
+        uint16_t hdr;
+        memcpy(&hdr, raw + (pos - start), sizeof(hdr));
+        sqfs_swapin16(&hdr);
+
+        memset(&blocks[count], 0, sizeof(md_block_t));
+        blocks[count++].pos = pos;
+        pos += 2 + SQUASHFS_COMPRESSED_SIZE(hdr);
+    }
+    return count;
+}
+
+static size_t add_table_blocks(const sqfs_table *table, size_t num, md_block_t *blocks, size_t count) {
+    for (size_t i = 0; i < num; i++) {
+        memset(&blocks[count], 0, sizeof(md_block_t));
+        blocks[count++].pos = table->blocks[i];
+    }
+    return count;
+}
+
+bool private_preload_metadata(private_mount_t *mount) {
+    sqfs *         fs    = &mount->ll->fs;
+    const uint64_t limit = (uint64_t)mount->opts.preload_metadata_mb * 1024 * 1024;
+    const uint64_t start = fs->sb.inode_table_start;
+    const uint64_t end   = directory_table_end(fs);
+
+    const size_t num_frag   = table_blocks(fs->sb.fragments, sizeof(struct squashfs_fragment_entry));
+    const size_t num_export = sqfs_export_ok(fs) ? table_blocks(fs->sb.inodes, sizeof(uint64_t)) : 0;
+    const size_t num_id     = table_blocks(fs->sb.no_ids, sizeof(uint32_t));
+
+    if (limit == 0 || end <= start || end - start > limit) return false;
+
+    // Every metadata block takes at least 2 bytes on disk
+    const size_t   max_blocks = (end - start) / 2 + num_frag + num_export + num_id;
+    const uint8_t *mapped     = private_image_map_get(&mount->image_map, start, end - start);
+    uint8_t *      raw        = mapped ? NULL : malloc(end - start);
+    md_block_t *   blocks     = malloc(sizeof(md_block_t) * max_blocks);
+    bool           ok         = (mapped || raw) && blocks;
+
+    if (mapped) {
+        // The tables are parsed in place, fault them in with one large read instead of page by page
+        private_image_map_advise(&mount->image_map, start, end - start, MADV_WILLNEED);
+    }
+
+    // Without the mapping, one large sequential read, this also pulls everything into the page cache for the
+    // sqfs_md_block_read calls below
+    for (size_t done = 0; ok && raw && done < end - start;) {
+        ssize_t res = pread(fs->fd, raw + done, end - start - done, (off_t)(fs->offset + start + done));
+        ok          = res > 0;
+        if (ok) done += (size_t)res;
+    }
+
+    size_t count = 0;
+    if (ok) {
+        count = parse_md_blocks(mapped ? mapped : raw, start, end, blocks, max_blocks);
+        count = add_table_blocks(&fs->frag_table, num_frag, blocks, count);
+        count = add_table_blocks(&fs->export_table, num_export, blocks, count);
+        count = add_table_blocks(&fs->id_table, num_id, blocks, count);
+        ok    = count + MD_EXTRA_SLOTS <= MD_MAX_SLOTS;
+    }
+    free(raw);
+
+    // Decompress in parallel, one contiguous slice of blocks per CPU
+    unsigned               threads = private_cpu_count();
+    private_thread_pool_t *pool    = ok ? private_thread_pool_new(threads) : NULL;
+    md_task_t *            tasks   = ok ? calloc(threads, sizeof(md_task_t)) : NULL;
+    ok                             = pool && tasks;
+    for (unsigned i = 0; ok && i < threads; i++) {
+        size_t from     = count * i / threads;
+        tasks[i].fs     = fs;
+        tasks[i].map    = &mount->image_map;
+        tasks[i].blocks = blocks + from;
+        tasks[i].count  = count * (i + 1) / threads - from;
+        if (!private_thread_pool_submit(pool, decompress_task, &tasks[i])) decompress_task(&tasks[i]);
+    }
+    if (pool) private_thread_pool_free(pool);
+    free(tasks);
+
+    // Only touch the cache when everything was decompressed, squashfuse reports the errors itself later on
+    for (size_t i = 0; ok && i < count; i++) ok = blocks[i].err == SQFS_OK;
+
+    if (ok) {
+        // The old cache is only replaced once the new one exists, squashfuse can not work without one
+        sqfs_cache resized;
+        ok = sqfs_cache_init(&resized, sizeof(sqfs_block_cache_entry), count + MD_EXTRA_SLOTS, md_entry_dispose) ==
+             SQFS_OK;
+        if (ok) {
+            sqfs_cache_destroy(&fs->md_cache);
+            fs->md_cache = resized;
+        } else {
+            fprintf(stderr, "preload: failed to resize the metadata cache\n");
+        }
+
+        for (size_t i = 0; ok && i < count; i++) {
+            sqfs_block_cache_entry *entry = sqfs_cache_add(&fs->md_cache, blocks[i].pos);
+            entry->block                  = blocks[i].block;
+            entry->data_size              = blocks[i].data_size;
+            blocks[i].block               = NULL;
+        }
+    }
+
+    for (size_t i = 0; blocks && i < count; i++) {
+        if (blocks[i].block) sqfs_block_dispose(blocks[i].block);
+    }
+    free(blocks);
+    return ok;
+}
@@ -0,0 +1,269 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Internal interface of the FUSE mount daemon (fusefs_main). The squashfuse low-level state (sqfs_ll) is not thread
+ * safe: the inode map, the metadata, fragment and block index caches are all mutated on access. All of it is guarded
+ * by private_mount_t::lock. Data block decompression, which is by far the most expensive part of a request, is done
+ * outside of the lock (see ll_read.c).
+ */
+
+#pragma once
+
+#include "ll.h"
+#include "block_cache.h"
+#include "image_map.h"
+#include "thread_pool.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+
+#if FUSE_USE_VERSION >= 30
+typedef uint64_t private_nlookup_t;
+#else
+typedef unsigned long private_nlookup_t;
+#endif
+
+// Options of the mount daemon that are not handled by squashfuse / libfuse (passed as -o key=value)
+typedef struct private_ll_opts {
+    unsigned max_threads;       // Maximum number of session loop workers (0 = number of CPUs, at least 4)
+    unsigned max_idle_threads;  // Idle workers above this limit are reaped
+    unsigned idle_timeout_secs; // Exit when no request was received for this long and no file is open (0 = never)
+    int      splice;            // Use splice() to move read replies to the kernel (uncompressed blocks skip userspace)
+    int      mmap;              // Read the image through a memory mapping instead of pread (never for hosted mounts)
+
+    unsigned block_cache_mb;      // Budget of the decompressed block cache (0 = disabled)
+    unsigned readahead_kb;        // Maximum read ahead window for sequential reads (0 = disabled)
+    unsigned decompress_threads;  // Workers decompressing the blocks of one read in parallel (0 = #CPUs)
+    unsigned preload_metadata_mb; // Preload the metadata at mount time if it is smaller (0 = never)
+    unsigned disk_cache_mb;       // Size of the persistent block cache shared by all mounts (0 = off)
+    int      profile;             // Record the reads after mounting, replay them into the page cache
+    unsigned profile_secs;        // Length of the recorded period after mounting
+    char *   trace_sort;          // Write an mksquashfs sort file of the first reads here (NULL = off)
+    int      share;               // Let later launches of the image attach to this mount
+    unsigned linger_secs;         // Keep a shared mount this long after the last launch exited
+    int      fuse_fd;             // /dev/fuse fd of a mount made by the launcher (-1 = fusermount)
+    unsigned trim_idle_secs;      // Drop the caches after this long without requests (0 = never)
+    unsigned trim_pressure;       // Shrink the caches above this memory pressure in % (0 = never)
+    unsigned dir_index_mb;        // Budget of the hashed lookup tables of large directories (0 = off)
+} private_ll_opts_t;
+
+// Resources that the per-user daemon (ll_daemon.c) shares between the images it serves
+typedef struct private_host {
+    private_block_cache_t *block_cache;     // One budget for all images, NULL if disabled
+    private_thread_pool_t *readahead_pool;  // NULL if disabled
+    private_thread_pool_t *decompress_pool; // NULL if disabled
+} private_host_t;
+
+// The block cache keys of a hosted image are its block positions with the id of the mount in the upper bits
+#define PRIVATE_HOST_KEY_SHIFT 48
+#define PRIVATE_HOST_MAX_MOUNTS ((1u << (64 - PRIVATE_HOST_KEY_SHIFT)) - 1)
+#define PRIVATE_HOST_KEY_LAST(base) ((base) | ((UINT64_C(1) << PRIVATE_HOST_KEY_SHIFT) - 1))
+
+// Cache trimming, only used by the thread that waits for the end of the session loop (see ll_trim.c)
+typedef struct private_trim_state {
+    bool        idle_trimmed;   // Nothing was requested since the caches were trimmed
+    bool        under_pressure; // The block cache budget is reduced
+    size_t      budget;         // Block cache budget to restore once the pressure is gone
+    long long   next_check;     // time() of the next memory pressure check (LLONG_MAX = wait for the trigger)
+    int         trigger_fd;     // PSI trigger of the memory pressure file, -1 if the kernel does not allow one
+    pthread_t   watcher;        // Waits for the trigger to fire
+    sem_t *     wake;           // Posted by the watcher
+    atomic_bool triggered;      // Set by the watcher, the pressure crossed trim_pressure
+} private_trim_state_t;
+
+// Requests with latency statistics (see ll_stats.c)
+typedef enum private_stats_op {
+    PRIVATE_OP_LOOKUP,
+    PRIVATE_OP_GETATTR,
+    PRIVATE_OP_OPEN,
+    PRIVATE_OP_READ,
+    PRIVATE_OP_READDIR,
+    PRIVATE_OP_READLINK,
+    PRIVATE_OP_GETXATTR,
+    PRIVATE_OP_COUNT,
+} private_stats_op_t;
+
+// Bucket i counts the requests that took [2^(i-1), 2^i) ns, the last one everything above
+#define PRIVATE_STATS_BUCKETS 40
+
+typedef struct private_op_stats {
+    atomic_ullong total_ns;
+    atomic_ullong max_ns;
+    atomic_ullong buckets[PRIVATE_STATS_BUCKETS];
+} private_op_stats_t;
+
+typedef struct private_stats {
+    private_op_stats_t ops[PRIVATE_OP_COUNT];
+    atomic_ullong      bytes_served; // File data returned by read requests
+} private_stats_t;
+
+// Hidden file at the mount root that shows the statistics. The inode number is never used by squashfuse.
+#define PRIVATE_STATS_NAME ".appimage-stats"
+#define PRIVATE_STATS_INO ((fuse_ino_t)-2)
+
+typedef struct private_profile     private_profile_t;
+typedef struct private_trace       private_trace_t;
+typedef struct private_dir_index   private_dir_index_t;
+
+typedef struct private_mount {
+    sqfs_ll *         ll;
+    pthread_mutex_t   lock; // Guards everything in ll
+    private_ll_opts_t opts;
+
+    private_block_cache_t *block_cache;     // NULL if disabled
+    private_profile_t *    profile;         // NULL if disabled
+    private_trace_t *      trace;           // NULL if disabled
+    private_thread_pool_t *readahead_pool;  // Decompresses read ahead blocks into block_cache, NULL if disabled
+    private_thread_pool_t *decompress_pool; // Parallel decompression of multi block reads, NULL if disabled
+    private_image_map_t    image_map;       // Not mapped if disabled
+    private_dir_index_t *  dir_index;       // Guarded by lock, NULL if disabled
+
+    private_host_t *host;            // NULL unless the mount is served by the per-user daemon
+    uint64_t        cache_key_base;  // Added to the block positions to get the block cache keys
+    unsigned        readahead_tasks; // Queued read ahead of this mount, a shared pool outlives it
+    pthread_mutex_t readahead_lock;  // Guards readahead_tasks
+    pthread_cond_t  readahead_idle;  // Signaled when readahead_tasks drops to 0
+    atomic_bool     exit_requested;  // See private_ll_session_exit
+    sem_t *         loop_wake;       // Wakes up the running session loop, guarded by lock
+
+#if FUSE_USE_VERSION >= 30
+    struct fuse_session *session; // For notifications, set before the session loop is started
+#else
+    struct fuse_chan *chan;
+#endif
+
+    atomic_uint          open_files;   // Number of open file and directory handles
+    atomic_llong         last_request; // time() of the last received request
+    private_trim_state_t trim;
+    private_stats_t      stats;
+} private_mount_t;
+
+// Sequential access detection of an open file (see ll_readahead.c)
+typedef struct private_readahead {
+    pthread_mutex_t lock;
+    uint64_t        next_off; // Offset of the next read if the file is read sequentially
+    uint64_t        ra_end;   // Read ahead was issued up to this offset
+    unsigned        window;   // Current read ahead window in blocks (0 = random access)
+} private_readahead_t;
+
+// Per open() state, stored in fuse_file_info::fh
+typedef struct private_file {
+    sqfs_inode          inode;
+    private_readahead_t ra;
+} private_file_t;
+
+// Setup / teardown of the state that is not owned by squashfuse
+bool private_mount_init(private_mount_t *mount, sqfs_ll *ll);
+void private_mount_destroy(private_mount_t *mount);
+
+// Fill the operation table. The session userdata must be a private_mount_t.
+void private_ll_ops_init(struct fuse_lowlevel_ops *ops);
+
+// ll_read.c
+void private_ll_op_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+
+// Read [start, end) of a regular file into buf. Takes the mount lock only for the metadata lookups.
+sqfs_err private_ll_read_range(private_mount_t *mount, sqfs_inode *inode, uint64_t start, uint64_t end, char *buf);
+
+// Decompress all compressed blocks of [start, end) into the block cache
+sqfs_err private_ll_prefetch(private_mount_t *mount, sqfs_inode *inode, uint64_t start, uint64_t end);
+
+// ll_readahead.c: Read ahead for sequentially read files
+bool private_readahead_init(private_mount_t *mount);
+void private_readahead_destroy(private_mount_t *mount);
+void private_readahead_file_init(private_file_t *file);
+void private_readahead_file_destroy(private_file_t *file);
+
+// Called for every read of file, schedules read ahead if the file is read sequentially
+void private_readahead_update(private_mount_t *mount, private_file_t *file, uint64_t start, uint64_t end);
+
+// ll_preload.c: Read and decompress all metadata into the metadata cache if it is below preload_metadata_mb.
+// Must be called before the session loop is started.
+bool private_preload_metadata(private_mount_t *mount);
+
+// ll_profile.c: Record the reads after mounting, replay them on later mounts with FUSE notify-store
+private_profile_t *private_profile_new(private_mount_t *mount);
+void               private_profile_free(private_profile_t *profile);
+
+// Called for every read while recording
+void private_profile_record(private_profile_t *profile, uint32_t inode_number, uint64_t start, uint64_t end);
+
+// Called once the kernel knows ino, queues the replay of its recorded ranges
+void private_profile_replay(private_profile_t *profile, fuse_ino_t ino, const sqfs_inode *inode);
+
+// ll_trace.c: Trace the order of the first reads of files and write it as mksquashfs sort file on unmount
+private_trace_t *private_trace_new(private_mount_t *mount, const char *const path);
+void             private_trace_free(private_trace_t *trace);
+
+// Called for every read
+void private_trace_touch(private_trace_t *trace, uint32_t inode_number);
+
+// ll_trim.c: Drops the caches once the mount is idle for trim_idle_secs and shrinks them while the memory pressure is
+// above trim_pressure. start registers a PSI trigger that posts wake when the pressure rises, tick must be called
+// after every wake up and returns the time() by which it wants to be called again (LLONG_MAX = only on wake up).
+void      private_trim_start(private_mount_t *mount, sem_t *wake);
+void      private_trim_stop(private_mount_t *mount);
+long long private_trim_tick(private_mount_t *mount);
+
+// ll_dirindex.c: Hashed lookup tables for large directories, kept within budget bytes
+private_dir_index_t *private_dir_index_new(size_t budget);
+void                 private_dir_index_free(private_dir_index_t *index);
+void                 private_dir_index_clear(private_dir_index_t *index);
+
+// Drop-in for sqfs_dir_lookup, the mount lock must be held
+sqfs_err private_dir_lookup(private_mount_t *mount,
+                            sqfs_inode *     dir,
+                            const char *     name,
+                            size_t           name_size,
+                            sqfs_dir_entry * entry,
+                            bool *           found);
+
+// ll_stats.c: Request statistics
+void     private_stats_init(private_stats_t *stats);
+uint64_t private_stats_now(void);
+
+// Count a request of type op that started at start (private_stats_now)
+void private_stats_op_done(private_stats_t *stats, private_stats_op_t op, uint64_t start);
+
+// Measure the decompression time of fs. Must be called before fs is used by multiple threads.
+void private_stats_hook(sqfs *fs);
+void private_stats_print(private_mount_t *mount, FILE *f);
+
+// Requests for the stats file. private_stats_lookup returns false (without replying) if name is something else.
+bool private_stats_lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+void private_stats_getattr(fuse_req_t req);
+void private_stats_open(fuse_req_t req, private_mount_t *mount, struct fuse_file_info *fi);
+void private_stats_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info *fi);
+void private_stats_release(fuse_req_t req, struct fuse_file_info *fi);
+
+// Create the file that SIGUSR1 dumps the statistics to
+FILE *private_stats_dump_open(void);
+
+// Dump on SIGUSR1 while the session loop of a standalone mount runs. The handler posts wake, the loop then calls
+// private_stats_poll_signal.
+void private_stats_signal_start(sem_t *wake);
+void private_stats_signal_stop(void);
+void private_stats_poll_signal(private_mount_t *mount);
+
+// ll_loop.c: Multi-threaded session loop. Returns 0 on a clean exit, -errno otherwise.
+#if FUSE_USE_VERSION >= 30
+int private_ll_session_loop(struct fuse_session *se, private_mount_t *mount);
+#else
+int private_ll_session_loop(struct fuse_session *se, struct fuse_chan *ch, private_mount_t *mount);
+#endif
+
+// Make the session loop of mount return, also if it was not started yet. Safe to call from any thread.
+void private_ll_session_exit(private_mount_t *mount);
+
+// ll_main.c: fusefs_main for a mount of the per-user daemon. Runs in the foreground without touching the signal
+// handlers, uses the caches and pools of host and returns errors instead of exiting. state is called with the mount
+// right before the session loop starts and with NULL once it ended.
+typedef void (*private_hosted_state_fn)(private_mount_t *mount, void *data);
+int private_fusefs_hosted(
+    int argc, char *argv[], private_host_t *host, uint64_t cache_key_base, private_hosted_state_fn state, void *data);
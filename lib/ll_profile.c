@@ -0,0 +1,282 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Launch profiles. The first mount of an image records the ordered (inode, offset, length) reads of the first
+ * profile_secs seconds and stores them in $XDG_CACHE_HOME/appimage/profiles/<image id>.profile, named by
+ * private_image_id so that a modified image file never replays the profile of the old one. Later mounts replay the
+ * profile: as soon as the kernel knows a profiled file (lookup or open), its recorded ranges are decompressed in the
+ * background and pushed into the page cache with FUSE notify-store. The page faults of the starting application then
+ * hit memory instead of waiting for the daemon.
+ *
+ * The kernel rejects stores for inodes it does not know yet, which is why the replay is driven by lookups instead of
+ * running through the whole profile right after mounting. A profile is never re-recorded, delete it to get a new one.
+ */
+
+#define _GNU_SOURCE
+
+#include "ll_private.h"
+#include "libruntime.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define PROFILE_MAGIC "AIPROF01"
+#define MAX_ENTRIES 16384
+#define STORE_CHUNK (128 * 1024)
+
+typedef struct profile_header {
+    char     magic[8];
+    uint32_t count;
+    uint32_t reserved;
+} profile_header_t;
+
+typedef struct profile_entry {
+    uint32_t inode_number;
+    uint32_t length;
+    uint64_t offset;
+} profile_entry_t;
+
+// All recorded ranges of one file
+typedef struct profile_file {
+    uint32_t    inode_number;
+    size_t      first;
+    size_t      count;
+    atomic_bool queued;
+} profile_file_t;
+
+struct private_profile {
+    private_mount_t *mount;
+    char *           path;
+    pthread_mutex_t  lock; // Guards the recording state
+    atomic_bool      recording;
+    atomic_bool      stop;
+
+    // Recording
+    profile_entry_t *entries;
+    size_t           count;
+    struct timespec  deadline;
+
+    // Replay, files are sorted by inode number
+    profile_file_t *       files;
+    size_t                 num_files;
+    private_thread_pool_t *pool;
+};
+
+typedef struct replay_task {
+    private_profile_t *profile;
+    profile_file_t *   file;
+    fuse_ino_t         ino;
+    sqfs_inode         inode;
+} replay_task_t;
+
+static int compare_entries(const void *a, const void *b) {
+    const profile_entry_t *x = a, *y = b;
+    if (x->inode_number != y->inode_number) return x->inode_number < y->inode_number ? -1 : 1;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    return 0;
+}
+
+static int compare_file(const void *key, const void *elem) {
+    uint32_t              inode_number = *(const uint32_t *)key;
+    const profile_file_t *file         = elem;
+    if (inode_number == file->inode_number) return 0;
+    return inode_number < file->inode_number ? -1 : 1;
+}
+
+static bool load_profile(private_profile_t *profile) {
+    profile_header_t header;
+    struct stat      st;
+    int              fd = open(profile->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    bool ok = fstat(fd, &st) == 0 && read(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+              memcmp(header.magic, PROFILE_MAGIC, 8) == 0 && header.count > 0 && header.count <= MAX_ENTRIES &&
+              (size_t)st.st_size == sizeof(header) + header.count * sizeof(profile_entry_t);
+
+    size_t size = ok ? header.count * sizeof(profile_entry_t) : 0;
+    ok          = ok && (profile->entries = malloc(size)) && read(fd, profile->entries, size) == (ssize_t)size;
+    close(fd);
+    if (!ok) return false;
+    profile->count = header.count;
+
+    // Group by file, the ranges of a file are replayed in ascending order
+    qsort(profile->entries, profile->count, sizeof(profile_entry_t), compare_entries);
+
+    profile->files = calloc(profile->count, sizeof(profile_file_t));
+    if (!profile->files) return false;
+    for (size_t i = 0; i < profile->count; i++) {
+        if (profile->num_files == 0 || profile->files[profile->num_files - 1].inode_number !=
+                                           profile->entries[i].inode_number) {
+            profile_file_t *f = &profile->files[profile->num_files++];
+            f->inode_number   = profile->entries[i].inode_number;
+            f->first          = i;
+            atomic_init(&f->queued, false);
+        }
+        profile->files[profile->num_files - 1].count++;
+    }
+    return true;
+}
+
+static void save_profile(private_profile_t *profile) {
+    profile_header_t header;
+    char *           tmp;
+    memcpy(header.magic, PROFILE_MAGIC, 8);
+    header.count    = (uint32_t)profile->count;
+    header.reserved = 0;
+    if (profile->count == 0 || asprintf(&tmp, "%s.XXXXXX", profile->path) == -1) return;
+
+    // Write to a temporary file first, an interrupted write must not leave a broken profile behind
+    int  fd = mkostemp(tmp, O_CLOEXEC);
+    bool ok = fd != -1 && write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+              write(fd, profile->entries, profile->count * sizeof(profile_entry_t)) ==
+                  (ssize_t)(profile->count * sizeof(profile_entry_t));
+    if (fd != -1) close(fd);
+    if (ok) ok = rename(tmp, profile->path) == 0;
+    if (!ok && fd != -1) unlink(tmp);
+    free(tmp);
+}
+
+private_profile_t *private_profile_new(private_mount_t *mount) {
+    private_profile_t *profile = calloc(1, sizeof(private_profile_t));
+    char *             dir     = appimage_get_cache_dir("profiles");
+    char *             id      = private_image_id(&mount->ll->fs);
+    if (!profile || !dir || !id || asprintf(&profile->path, "%s/%s.profile", dir, id) == -1) {
+        free(id);
+        free(dir);
+        free(profile);
+        return NULL;
+    }
+    free(id);
+    free(dir);
+
+    profile->mount = mount;
+    atomic_init(&profile->stop, false);
+    pthread_mutex_init(&profile->lock, NULL);
+
+    if (load_profile(profile)) {
+        atomic_init(&profile->recording, false);
+        profile->pool = private_thread_pool_new(2);
+        if (!profile->pool) {
+            private_profile_free(profile);
+            return NULL;
+        }
+        return profile;
+    }
+
+    // No (valid) profile yet, record one
+    free(profile->files);
+    free(profile->entries);
+    profile->files     = NULL;
+    profile->num_files = 0;
+    profile->count     = 0;
+    profile->entries   = malloc(sizeof(profile_entry_t) * MAX_ENTRIES);
+    if (!profile->entries) {
+        private_profile_free(profile);
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &profile->deadline);
+    profile->deadline.tv_sec += mount->opts.profile_secs;
+    atomic_init(&profile->recording, true);
+    return profile;
+}
+
+void private_profile_free(private_profile_t *profile) {
+    if (!profile) return;
+
+    atomic_store(&profile->stop, true);
+    if (profile->pool) private_thread_pool_free(profile->pool);
+
+    // Short lived applications exit before the recording period is over
+    if (atomic_exchange(&profile->recording, false)) save_profile(profile);
+
+    pthread_mutex_destroy(&profile->lock);
+    free(profile->files);
+    free(profile->entries);
+    free(profile->path);
+    free(profile);
+}
+
+/* Must be called with the profile lock held */
+static void add_range(private_profile_t *profile, uint32_t inode_number, uint64_t start, uint64_t end) {
+    profile_entry_t *last = profile->count ? &profile->entries[profile->count - 1] : NULL;
+
+    if (last && last->inode_number == inode_number && start >= last->offset && start <= last->offset + last->length &&
+        end - last->offset <= UINT32_MAX) {
+        // Sequential reads of one file become a single range
+        if (end > last->offset + last->length) last->length = (uint32_t)(end - last->offset);
+    } else if (profile->count < MAX_ENTRIES && end - start <= UINT32_MAX) {
+        profile->entries[profile->count++] = (profile_entry_t){inode_number, (uint32_t)(end - start), start};
+    }
+}
+
+void private_profile_record(private_profile_t *profile, uint32_t inode_number, uint64_t start, uint64_t end) {
+    struct timespec now;
+    bool            done;
+    if (!profile || !atomic_load_explicit(&profile->recording, memory_order_relaxed)) return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&profile->lock);
+    done = now.tv_sec > profile->deadline.tv_sec ||
+           (now.tv_sec == profile->deadline.tv_sec && now.tv_nsec >= profile->deadline.tv_nsec);
+    if (!done && atomic_load(&profile->recording)) add_range(profile, inode_number, start, end);
+    done = done || profile->count == MAX_ENTRIES;
+    pthread_mutex_unlock(&profile->lock);
+
+    // Only the first caller after the deadline saves, later readers never see recording set again
+    if (done && atomic_exchange(&profile->recording, false)) save_profile(profile);
+}
+
+static int notify_store(private_mount_t *mount, fuse_ino_t ino, uint64_t off, char *data, size_t size) {
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+    bufv.buf[0].mem         = data;
+#if FUSE_USE_VERSION >= 30
+    return fuse_lowlevel_notify_store(mount->session, ino, (off_t)off, &bufv, 0);
+#else
+    return fuse_lowlevel_notify_store(mount->chan, ino, (off_t)off, &bufv, 0);
+#endif
+}
+
+static void replay_task(void *arg) {
+    replay_task_t *    task      = arg;
+    private_profile_t *profile   = task->profile;
+    const uint64_t     file_size = task->inode.xtra.reg.file_size;
+    char *             buf       = malloc(STORE_CHUNK);
+    bool               ok        = buf != NULL;
+
+    for (size_t i = 0; ok && i < task->file->count && !atomic_load(&profile->stop); i++) {
+        const profile_entry_t *e   = &profile->entries[task->file->first + i];
+        uint64_t               end = e->offset + e->length < file_size ? e->offset + e->length : file_size;
+
+        for (uint64_t off = e->offset; ok && off < end && !atomic_load(&profile->stop); off += STORE_CHUNK) {
+            size_t size = end - off < STORE_CHUNK ? end - off : STORE_CHUNK;
+            ok          = private_ll_read_range(profile->mount, &task->inode, off, off + size, buf) == SQFS_OK;
+            // Fails if the kernel already forgot the inode or does not support stores, stop in both cases
+            ok = ok && notify_store(profile->mount, task->ino, off, buf, size) == 0;
+        }
+    }
+
+    free(buf);
+    free(task);
+}
+
+void private_profile_replay(private_profile_t *profile, fuse_ino_t ino, const sqfs_inode *inode) {
+    if (!profile || !profile->pool || !S_ISREG(inode->base.mode)) return;
+
+    uint32_t        inode_number = inode->base.inode_number;
+    profile_file_t *file         = bsearch(
+        &inode_number, profile->files, profile->num_files, sizeof(profile_file_t), compare_file);
+    if (!file || atomic_exchange(&file->queued, true)) return;
+
+    replay_task_t *task = malloc(sizeof(replay_task_t));
+    if (!task) return;
+    task->profile = profile;
+    task->file    = file;
+    task->ino     = ino;
+    task->inode   = *inode;
+    if (!private_thread_pool_submit(profile->pool, replay_task, task)) free(task);
+}
@@ -0,0 +1,523 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Read path of the mount daemon. Unlike sqfs_read_range, a read is split into two phases:
+ *
+ *  1. Under the mount lock, the block list of the file is walked to find the on-disk location of every data block
+ *     (and the fragment) covered by the request. This only touches the (cached) metadata.
+ *  2. Without any lock, the blocks are read and decompressed and the reply is assembled. Uncompressed blocks are not
+ *     read at all, they are passed to the kernel as ranges of the image file (see add_fd_segment) or as slices of
+ *     the mapped image (see add_map_segment).
+ *
+ * This way concurrent reads only serialize on cheap metadata lookups and decompression scales with the number of
+ * session loop workers.
+ */
+
+#include "ll_private.h"
+#include "blockidx.h"
+#include "swap.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+typedef struct read_block {
+    uint64_t file_pos;  // Offset of the first byte of data_off in the file
+    uint64_t disk_pos;  // Position of the block in the squashfs image
+    uint32_t header;    // Squashfs data block header (size and compression flag)
+    bool     hole;      // Sparse block, no data on disk
+    bool     fragment;  // Fragment block, shared by the tails of several files
+    size_t   data_off;  // Offset of the file data in the decompressed block (non zero for fragments)
+    size_t   data_size; // Size of the file data in the decompressed block
+    bool     spliced;   // Passed to the kernel as a range of the image file or mapping, no need to load it
+    bool     queued;    // Loaded by the decompression pool
+} read_block_t;
+
+// Completion tracking of the blocks of one request that are loaded in parallel
+typedef struct load_batch {
+    pthread_mutex_t lock;
+    pthread_cond_t  done_cond;
+    size_t          pending;
+    sqfs_err        err;
+} load_batch_t;
+
+typedef struct load_job {
+    load_batch_t *      batch;
+    private_mount_t *   mount;
+    const read_block_t *block;
+    uint64_t            start;
+    uint64_t            end;
+    char *              reply;
+} load_job_t;
+
+/* Resolve the location of the fragment of a file. Mirrors the static sqfs_frag_entry in squashfuse. */
+static sqfs_err frag_entry(sqfs *fs, uint32_t idx, struct squashfs_fragment_entry *frag) {
+    sqfs_err err;
+    if (idx == SQUASHFS_INVALID_FRAG) return SQFS_ERR;
+    err = sqfs_table_get(&fs->frag_table, fs, idx, frag);
+    sqfs_swapin_fragment_entry(frag);
+    return err;
+}
+
+/*
+ * Phase 1, must be called with the mount lock held. Collects all blocks covering [start, end) in blocks, which must
+ * have room for (end - start) / block_size + 2 entries.
+ */
+static sqfs_err
+plan_read(sqfs *fs, sqfs_inode *inode, uint64_t start, uint64_t end, read_block_t *blocks, size_t *count) {
+    const uint64_t file_size  = inode->xtra.reg.file_size;
+    const uint64_t block_size = fs->sb.block_size;
+    sqfs_blocklist bl;
+    sqfs_err       err;
+
+    *count = 0;
+    if ((err = sqfs_blockidx_blocklist(fs, inode, &bl, start))) return err;
+
+    while (true) {
+        read_block_t *b = &blocks[*count];
+
+        if (bl.remain == 0) {
+            // All full blocks are consumed, the rest of the file (if any) is in a fragment
+            struct squashfs_fragment_entry frag;
+            if (inode->xtra.reg.frag_idx == SQUASHFS_INVALID_FRAG) break;
+            if ((err = frag_entry(fs, inode->xtra.reg.frag_idx, &frag))) return err;
+
+            b->file_pos  = (file_size / block_size) * block_size;
+            b->disk_pos  = frag.start_block;
+            b->header    = frag.size;
+            b->hole      = false;
+            b->fragment  = true;
+            b->data_off  = inode->xtra.reg.frag_off;
+            b->data_size = file_size % block_size;
+            b->spliced   = false;
+            b->queued    = false;
+            if (b->file_pos < end) (*count)++;
+            break;
+        }
+
+        if ((err = sqfs_blocklist_next(&bl))) return err;
+        if (bl.pos + block_size <= start) continue;
+        if (bl.pos >= end) break;
+
+        b->file_pos  = bl.pos;
+        b->disk_pos  = bl.block;
+        b->header    = bl.header;
+        b->hole      = bl.input_size == 0;
+        b->fragment  = false;
+        b->data_off  = 0;
+        b->data_size = file_size - bl.pos < block_size ? file_size - bl.pos : block_size;
+        b->spliced   = false;
+        b->queued    = false;
+        (*count)++;
+
+        if (bl.pos + block_size >= end) break;
+    }
+
+    return SQFS_OK;
+}
+
+/* Part of the block that overlaps [start, end), false if there is none */
+static bool block_range(const read_block_t *b, uint64_t start, uint64_t end, uint64_t *from, uint64_t *to) {
+    *from = b->file_pos > start ? b->file_pos : start;
+    *to   = b->file_pos + b->data_size < end ? b->file_pos + b->data_size : end;
+    return *from < *to;
+}
+
+/*
+ * Without the block cache, the data and fragment caches of squashfuse are used like sqfs_read_range does, so reads of
+ * small files sharing a fragment do not decompress it again and again. The cached blocks are only valid under the
+ * mount lock, the data is copied out before unlocking. A miss is still decompressed without holding the lock.
+ */
+static sqfs_err
+load_sqfs_cached(private_mount_t *mount, const read_block_t *b, size_t in_block, size_t size, char *dst) {
+    sqfs *                  fs    = &mount->ll->fs;
+    sqfs_cache *            cache = b->fragment ? &fs->frag_cache : &fs->data_cache;
+    sqfs_block_cache_entry *entry;
+    sqfs_block *            block;
+    sqfs_err                err = SQFS_OK;
+
+    pthread_mutex_lock(&mount->lock);
+    if ((entry = sqfs_cache_get(cache, b->disk_pos))) {
+        if (in_block + size > entry->block->size) {
+            err = SQFS_ERR;
+        } else {
+            memcpy(dst, (const char *)entry->block->data + in_block, size);
+        }
+    }
+    pthread_mutex_unlock(&mount->lock);
+    if (entry) return err;
+
+    if ((err = private_image_data_block_read(&mount->image_map, fs, b->disk_pos, b->header, &block))) return err;
+    if (in_block + size > block->size) {
+        err = SQFS_ERR;
+    } else {
+        memcpy(dst, (const char *)block->data + in_block, size);
+    }
+
+    // Another reader may have added the block in the meantime
+    pthread_mutex_lock(&mount->lock);
+    if (!sqfs_cache_get(cache, b->disk_pos)) {
+        entry        = sqfs_cache_add(cache, b->disk_pos);
+        entry->block = block;
+        block        = NULL;
+    }
+    pthread_mutex_unlock(&mount->lock);
+
+    if (block) sqfs_block_dispose(block);
+    return err;
+}
+
+/* Phase 2: copy the part of the block that overlaps [start, end) to the reply buffer */
+static sqfs_err load_block(private_mount_t *mount, const read_block_t *b, uint64_t start, uint64_t end, char *reply) {
+    uint64_t from, to;
+    if (!block_range(b, start, end, &from, &to)) return SQFS_OK;
+
+    char *dst = reply + (from - start);
+    if (b->hole) {
+        memset(dst, 0, to - from);
+        return SQFS_OK;
+    }
+
+    // Uncompressed data is copied straight from the mapped image
+    size_t in_block = b->data_off + (from - b->file_pos);
+    if (!SQUASHFS_COMPRESSED_BLOCK(b->header) && mount->image_map.data) {
+        const uint8_t *src = private_image_map_get(&mount->image_map, b->disk_pos + in_block, to - from);
+        if (!src || in_block + (to - from) > SQUASHFS_COMPRESSED_SIZE_BLOCK(b->header)) return SQFS_ERR;
+        memcpy(dst, src, to - from);
+        return SQFS_OK;
+    }
+
+    if (!mount->block_cache && SQUASHFS_COMPRESSED_BLOCK(b->header)) {
+        return load_sqfs_cached(mount, b, in_block, to - from, dst);
+    }
+
+    // Uncompressed blocks are already cached by the kernel (as part of the image file), do not cache them twice
+    private_block_cache_t * cache  = SQUASHFS_COMPRESSED_BLOCK(b->header) ? mount->block_cache : NULL;
+    const uint64_t          key    = mount->cache_key_base | b->disk_pos;
+    private_cached_block_t *cached = cache ? private_block_cache_get(cache, key) : NULL;
+    sqfs_block *            block  = NULL;
+    sqfs_err                err    = SQFS_OK;
+
+    if (!cached) {
+        // Only reads fs->fd, fs->sb, fs->decompressor and the mapping, none of which change after opening
+        err = private_image_data_block_read(&mount->image_map, &mount->ll->fs, b->disk_pos, b->header, &block);
+        if (err) return err;
+        if (cache && (cached = private_block_cache_put(cache, key, block->data, block->size))) {
+            sqfs_block_dispose(block);
+            block = NULL;
+        }
+    }
+
+    const char * data = cached ? cached->data : (const char *)block->data;
+    const size_t size = cached ? cached->size : block->size;
+    if (in_block + (to - from) > size) {
+        err = SQFS_ERR;
+    } else {
+        memcpy(dst, data + in_block, to - from);
+    }
+
+    if (cached) private_block_cache_release(cached);
+    if (block) sqfs_block_dispose(block);
+    return err;
+}
+
+static void load_job_run(void *arg) {
+    load_job_t *  job   = arg;
+    load_batch_t *batch = job->batch;
+    sqfs_err      err   = load_block(job->mount, job->block, job->start, job->end, job->reply);
+
+    pthread_mutex_lock(&batch->lock);
+    if (err) batch->err = err;
+    if (--batch->pending == 0) pthread_cond_signal(&batch->done_cond);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static bool needs_decompression(const read_block_t *b) {
+    return !b->spliced && !b->hole && SQUASHFS_COMPRESSED_BLOCK(b->header);
+}
+
+/*
+ * Load all blocks that were not spliced. If more than one of them has to be decompressed, all but the first one are
+ * handed to the decompression pool and the calling worker takes care of the first one, so a single large read is not
+ * limited by the decompression speed of one core.
+ */
+static sqfs_err
+load_blocks(private_mount_t *mount, read_block_t *blocks, size_t count, uint64_t start, uint64_t end, char *reply) {
+    load_job_t * jobs     = NULL;
+    size_t       num_jobs = 0;
+    load_batch_t batch;
+    sqfs_err     err = SQFS_OK;
+
+    size_t num_compressed = 0;
+    for (size_t i = 0; i < count; i++) num_compressed += needs_decompression(&blocks[i]);
+    if (mount->decompress_pool && num_compressed > 1) jobs = malloc(sizeof(load_job_t) * num_compressed);
+
+    if (jobs) {
+        pthread_mutex_init(&batch.lock, NULL);
+        pthread_cond_init(&batch.done_cond, NULL);
+        batch.pending = 0;
+        batch.err     = SQFS_OK;
+
+        bool first = true;
+        for (size_t i = 0; i < count; i++) {
+            read_block_t *b = &blocks[i];
+            if (!needs_decompression(b)) continue;
+            if (first) {
+                first = false;
+                continue;
+            }
+
+            load_job_t *job = &jobs[num_jobs];
+            job->batch      = &batch;
+            job->mount      = mount;
+            job->block      = b;
+            job->start      = start;
+            job->end        = end;
+            job->reply      = reply;
+
+            pthread_mutex_lock(&batch.lock);
+            batch.pending++;
+            pthread_mutex_unlock(&batch.lock);
+
+            if (private_thread_pool_submit(mount->decompress_pool, load_job_run, job)) {
+                b->queued = true;
+                num_jobs++;
+            } else {
+                pthread_mutex_lock(&batch.lock);
+                batch.pending--;
+                pthread_mutex_unlock(&batch.lock);
+            }
+        }
+    }
+
+    // Everything that was not queued (holes, uncompressed blocks without splice, the first compressed block)
+    for (size_t i = 0; i < count; i++) {
+        if (blocks[i].spliced || blocks[i].queued) continue;
+        sqfs_err res = load_block(mount, &blocks[i], start, end, reply);
+        if (res) err = res;
+    }
+
+    if (jobs) {
+        pthread_mutex_lock(&batch.lock);
+        while (batch.pending > 0) pthread_cond_wait(&batch.done_cond, &batch.lock);
+        if (batch.err) err = batch.err;
+        pthread_mutex_unlock(&batch.lock);
+
+        pthread_cond_destroy(&batch.done_cond);
+        pthread_mutex_destroy(&batch.lock);
+        free(jobs);
+    }
+    return err;
+}
+
+/*
+ * Uncompressed blocks are stored verbatim in the image, so instead of reading them they can be passed to
+ * fuse_reply_data as a range of the image fd. With splice enabled, the kernel then moves the data straight from the
+ * page cache of the image to /dev/fuse. Returns false if the block has to go through load_block.
+ */
+static bool add_fd_segment(sqfs *fs, const read_block_t *b, uint64_t start, uint64_t end, struct fuse_bufvec *bufv) {
+    uint64_t from, to;
+    if (b->hole || SQUASHFS_COMPRESSED_BLOCK(b->header)) return false;
+    if (!block_range(b, start, end, &from, &to)) return true;
+
+    size_t in_block = b->data_off + (from - b->file_pos);
+    if (in_block + (to - from) > SQUASHFS_COMPRESSED_SIZE_BLOCK(b->header)) return false; // Let load_block fail
+
+    off_t            pos  = (off_t)(fs->offset + b->disk_pos + in_block);
+    struct fuse_buf *prev = bufv->count ? &bufv->buf[bufv->count - 1] : NULL;
+
+    // Consecutive uncompressed blocks are contiguous on disk, merge them to save splice calls
+    if (prev && (prev->flags & FUSE_BUF_IS_FD) && prev->pos + (off_t)prev->size == pos) {
+        prev->size += to - from;
+        return true;
+    }
+
+    struct fuse_buf *buf = &bufv->buf[bufv->count++];
+    buf->size            = to - from;
+    buf->flags           = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    buf->mem             = NULL;
+    buf->fd              = fs->fd;
+    buf->pos             = pos;
+    return true;
+}
+
+static void append_mem(struct fuse_bufvec *bufv, const char *mem, size_t size) {
+    struct fuse_buf *prev = bufv->count ? &bufv->buf[bufv->count - 1] : NULL;
+    if (prev && !(prev->flags & FUSE_BUF_IS_FD) && (const char *)prev->mem + prev->size == mem) {
+        prev->size += size;
+        return;
+    }
+
+    struct fuse_buf *buf = &bufv->buf[bufv->count++];
+    buf->size            = size;
+    buf->flags           = 0;
+    buf->mem             = (void *)mem; // Only read by libfuse
+    buf->fd              = -1;
+    buf->pos             = 0;
+}
+
+/*
+ * Without splice, uncompressed blocks of a mapped image are passed to fuse_reply_data as slices of the mapping instead
+ * of being copied to the reply buffer first. Returns false if the block has to go through load_block.
+ */
+static bool add_map_segment(const private_image_map_t *map,
+                            const read_block_t *       b,
+                            uint64_t                   start,
+                            uint64_t                   end,
+                            struct fuse_bufvec *       bufv) {
+    uint64_t from, to;
+    if (!map->data || b->hole || SQUASHFS_COMPRESSED_BLOCK(b->header)) return false;
+    if (!block_range(b, start, end, &from, &to)) return true;
+
+    size_t in_block = b->data_off + (from - b->file_pos);
+    if (in_block + (to - from) > SQUASHFS_COMPRESSED_SIZE_BLOCK(b->header)) return false; // Let load_block fail
+
+    const uint8_t *src = private_image_map_get(map, b->disk_pos + in_block, to - from);
+    if (!src) return false;
+    append_mem(bufv, (const char *)src, to - from);
+    return true;
+}
+
+/* Append the part of the reply buffer that belongs to the block to the reply */
+static void
+add_mem_segment(const read_block_t *b, uint64_t start, uint64_t end, char *reply, struct fuse_bufvec *bufv) {
+    uint64_t from, to;
+    if (!block_range(b, start, end, &from, &to)) return;
+    append_mem(bufv, reply + (from - start), to - from);
+}
+
+sqfs_err private_ll_read_range(private_mount_t *mount, sqfs_inode *inode, uint64_t start, uint64_t end, char *buf) {
+    sqfs *        fs    = &mount->ll->fs;
+    size_t        count = 0;
+    sqfs_err      err;
+    read_block_t *blocks = malloc(sizeof(read_block_t) * ((end - start) / fs->sb.block_size + 2));
+    if (!blocks) return SQFS_ERR;
+
+    pthread_mutex_lock(&mount->lock);
+    err = plan_read(fs, inode, start, end, blocks, &count);
+    pthread_mutex_unlock(&mount->lock);
+
+    if (!err) err = load_blocks(mount, blocks, count, start, end, buf);
+
+    // Do not return garbage for a truncated image
+    if (!err && (count == 0 || blocks[count - 1].file_pos + blocks[count - 1].data_size < end)) err = SQFS_ERR;
+
+    free(blocks);
+    return err;
+}
+
+sqfs_err private_ll_prefetch(private_mount_t *mount, sqfs_inode *inode, uint64_t start, uint64_t end) {
+    sqfs *        fs    = &mount->ll->fs;
+    size_t        count = 0;
+    sqfs_err      err;
+    read_block_t *blocks = malloc(sizeof(read_block_t) * ((end - start) / fs->sb.block_size + 2));
+    if (!blocks) return SQFS_ERR;
+
+    pthread_mutex_lock(&mount->lock);
+    err = plan_read(fs, inode, start, end, blocks, &count);
+    pthread_mutex_unlock(&mount->lock);
+
+    // Read ahead is only started for sequential reads, let the kernel fetch the compressed data in one go. The data
+    // blocks of a file are contiguous on disk, only the fragment is somewhere else.
+    for (size_t i = 0, first = 0; !err && i < count; i++) {
+        const uint64_t run_end = blocks[i].disk_pos + SQUASHFS_COMPRESSED_SIZE_BLOCK(blocks[i].header);
+        if (i + 1 < count && blocks[i + 1].disk_pos == run_end) continue;
+        private_image_map_advise(&mount->image_map,
+                                 blocks[first].disk_pos,
+                                 (size_t)(run_end - blocks[first].disk_pos),
+                                 MADV_WILLNEED);
+        first = i + 1;
+    }
+
+    for (size_t i = 0; !err && i < count; i++) {
+        const read_block_t *b = &blocks[i];
+        if (b->hole || !SQUASHFS_COMPRESSED_BLOCK(b->header)) continue;
+
+        const uint64_t          key    = mount->cache_key_base | b->disk_pos;
+        private_cached_block_t *cached = private_block_cache_get(mount->block_cache, key);
+        if (!cached) {
+            sqfs_block *block;
+            if ((err = private_image_data_block_read(&mount->image_map, fs, b->disk_pos, b->header, &block))) break;
+            cached = private_block_cache_put(mount->block_cache, key, block->data, block->size);
+            sqfs_block_dispose(block);
+        }
+        if (cached) private_block_cache_release(cached);
+    }
+
+    free(blocks);
+    return err;
+}
+
+void private_ll_op_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    private_mount_t *   mount = fuse_req_userdata(req);
+    private_file_t *    file  = (private_file_t *)(intptr_t)fi->fh;
+    sqfs *              fs    = &mount->ll->fs;
+    read_block_t *      blocks;
+    struct fuse_bufvec *bufv;
+    size_t              count = 0;
+    size_t              max_blocks;
+    char *              reply;
+    sqfs_err            err = SQFS_OK;
+    if (ino == PRIVATE_STATS_INO) {
+        private_stats_read(req, size, off, fi);
+        return;
+    }
+
+    const uint64_t file_size = file->inode.xtra.reg.file_size;
+    const uint64_t start     = (uint64_t)off;
+    const uint64_t end       = start + size < file_size ? start + size : file_size;
+    if (off < 0 || start >= end) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+
+    private_readahead_update(mount, file, start, end);
+    private_profile_record(mount->profile, file->inode.base.inode_number, start, end);
+    private_trace_touch(mount->trace, file->inode.base.inode_number);
+
+    max_blocks = (end - start) / fs->sb.block_size + 2;
+    blocks     = malloc(sizeof(read_block_t) * max_blocks);
+    bufv       = malloc(sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf) * max_blocks);
+    reply      = malloc(end - start);
+    if (!blocks || !bufv || !reply) {
+        free(blocks);
+        free(bufv);
+        free(reply);
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    pthread_mutex_lock(&mount->lock);
+    err = plan_read(fs, &file->inode, start, end, blocks, &count);
+    pthread_mutex_unlock(&mount->lock);
+
+    // The segments only point into reply, so it can be filled after all of them are known
+    memset(bufv, 0, sizeof(struct fuse_bufvec));
+    for (size_t i = 0; !err && i < count; i++) {
+        if (mount->opts.splice) {
+            blocks[i].spliced = add_fd_segment(fs, &blocks[i], start, end, bufv);
+        } else {
+            blocks[i].spliced = add_map_segment(&mount->image_map, &blocks[i], start, end, bufv);
+        }
+        if (!blocks[i].spliced) add_mem_segment(&blocks[i], start, end, reply, bufv);
+    }
+    if (!err) err = load_blocks(mount, blocks, count, start, end, reply);
+
+    if (err) {
+        fuse_reply_err(req, EIO);
+    } else if (bufv->count == 0) {
+        fuse_reply_buf(req, NULL, 0);
+    } else {
+        // Only the ranges backed by blocks are part of the reply, in case the image is truncated. libfuse falls back to
+        // copying if the kernel does not support splice.
+        if (fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE) == 0) {
+            atomic_fetch_add_explicit(&mount->stats.bytes_served, end - start, memory_order_relaxed);
+        }
+    }
+
+    free(blocks);
+    free(bufv);
+    free(reply);
+}
@@ -0,0 +1,125 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Read ahead for files that are read sequentially. Every open file tracks where the next read is expected. As long as
+ * reads continue there, the read ahead window grows (doubling up to readahead_kb) and the blocks in front of the
+ * reader are decompressed into the block cache by a small pool of background workers. The first read that does not
+ * continue the sequence resets the window, so random access never causes read ahead.
+ *
+ * The kernel does its own read ahead, but those requests are served synchronously in order and each of them waits
+ * for its decompression. Here, decompression of the next requests overlaps with the copy of the current one.
+ */
+
+#include "ll_private.h"
+
+#include <stdlib.h>
+
+#define INITIAL_WINDOW 4 // blocks
+
+typedef struct readahead_task {
+    private_mount_t *mount;
+    sqfs_inode       inode;
+    uint64_t         start;
+    uint64_t         end;
+} readahead_task_t;
+
+bool private_readahead_init(private_mount_t *mount) {
+    mount->readahead_pool = NULL;
+    if (!mount->block_cache || mount->opts.readahead_kb == 0) return true;
+
+    if (mount->host) {
+        mount->readahead_pool = mount->host->readahead_pool;
+        return true;
+    }
+
+    unsigned threads      = private_cpu_count() / 2;
+    mount->readahead_pool = private_thread_pool_new(threads ? threads : 1);
+    return mount->readahead_pool != NULL;
+}
+
+void private_readahead_destroy(private_mount_t *mount) {
+    if (mount->host) {
+        // The pool of the daemon keeps running, only wait for the tasks of this mount
+        pthread_mutex_lock(&mount->readahead_lock);
+        while (mount->readahead_tasks > 0) pthread_cond_wait(&mount->readahead_idle, &mount->readahead_lock);
+        pthread_mutex_unlock(&mount->readahead_lock);
+    } else if (mount->readahead_pool) {
+        private_thread_pool_free(mount->readahead_pool);
+    }
+    mount->readahead_pool = NULL;
+}
+
+void private_readahead_file_init(private_file_t *file) {
+    pthread_mutex_init(&file->ra.lock, NULL);
+    file->ra.next_off = 0;
+    file->ra.ra_end   = 0;
+    file->ra.window   = 0;
+}
+
+void private_readahead_file_destroy(private_file_t *file) {
+    pthread_mutex_destroy(&file->ra.lock);
+}
+
+/* The count is only changed under the lock, private_readahead_destroy may free the mount as soon as it is 0 */
+static void task_done(private_mount_t *mount) {
+    pthread_mutex_lock(&mount->readahead_lock);
+    if (--mount->readahead_tasks == 0) pthread_cond_broadcast(&mount->readahead_idle);
+    pthread_mutex_unlock(&mount->readahead_lock);
+}
+
+static void readahead_task(void *arg) {
+    readahead_task_t *task = arg;
+    // Errors are reported by the regular read path once the data is actually requested
+    private_ll_prefetch(task->mount, &task->inode, task->start, task->end);
+    task_done(task->mount);
+    free(task);
+}
+
+void private_readahead_update(private_mount_t *mount, private_file_t *file, uint64_t start, uint64_t end) {
+    if (!mount->readahead_pool) return;
+
+    private_readahead_t *ra         = &file->ra;
+    const uint64_t       block_size = mount->ll->fs.sb.block_size;
+    const uint64_t       file_size  = file->inode.xtra.reg.file_size;
+    unsigned             max_window = (unsigned)((uint64_t)mount->opts.readahead_kb * 1024 / block_size);
+    if (max_window == 0) max_window = 1;
+
+    pthread_mutex_lock(&ra->lock);
+
+    // The kernel may deliver concurrent requests slightly out of order, allow a block of slack
+    bool sequential = start + block_size >= ra->next_off && start <= ra->next_off + block_size;
+    if (sequential) {
+        ra->window = ra->window ? ra->window * 2 : INITIAL_WINDOW;
+        if (ra->window > max_window) ra->window = max_window;
+    } else {
+        ra->window = 0;
+        ra->ra_end = 0;
+    }
+    if (end > ra->next_off || !sequential) ra->next_off = end;
+
+    // Issue the next part of the window once the reader consumed half of what was read ahead
+    uint64_t window_bytes = (uint64_t)ra->window * block_size;
+    uint64_t from         = ra->ra_end > end ? ra->ra_end : end;
+    uint64_t to           = end + window_bytes < file_size ? end + window_bytes : file_size;
+    if (ra->window && ra->ra_end < end + window_bytes / 2 && from < to) {
+        readahead_task_t *task = malloc(sizeof(readahead_task_t));
+        if (task) {
+            task->mount = mount;
+            task->inode = file->inode;
+            task->start = from;
+            task->end   = to;
+            pthread_mutex_lock(&mount->readahead_lock);
+            mount->readahead_tasks++;
+            pthread_mutex_unlock(&mount->readahead_lock);
+            if (private_thread_pool_submit(mount->readahead_pool, readahead_task, task)) {
+                ra->ra_end = to;
+            } else {
+                task_done(mount);
+                free(task);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&ra->lock);
+}
@@ -0,0 +1,329 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Request statistics of the mount daemon, to tell the FUSE round trips apart from decompression. Every handled
+ * lookup, getattr, open, read, readdir, readlink and getxattr request is counted in a log2 latency histogram, the
+ * decompressor of the image is wrapped (see private_decompress_wrap) to measure the time spent per compression type.
+ * All counters are relaxed atomics, requests never wait for each other.
+ *
+ * The statistics are shown in the hidden file PRIVATE_STATS_NAME at the mount root, which is not listed by readdir.
+ * SIGUSR1 writes them to stats-<pid> in the socket directory of the user (see private_socket_dir).
+ */
+
+#define _GNU_SOURCE
+
+#include "ll_private.h"
+#include "disk_cache.h"
+#include "decompress_ctx.h"
+#include "private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DECOMP_MAX_COMPRESSION 7
+
+typedef struct decomp_stats {
+    atomic_ullong blocks;
+    atomic_ullong in_bytes;
+    atomic_ullong out_bytes;
+    atomic_ullong ns;
+} decomp_stats_t;
+
+// Per compression type and process wide, the per-user daemon serves images of all types at once
+static decomp_stats_t decomp[DECOMP_MAX_COMPRESSION];
+
+static volatile sig_atomic_t dump_requested;
+static sem_t *volatile       dump_wake;
+
+static const char *const op_names[PRIVATE_OP_COUNT] = {
+    "lookup",
+    "getattr",
+    "open",
+    "read",
+    "readdir",
+    "readlink",
+    "getxattr",
+};
+
+static const char *const compression_names[DECOMP_MAX_COMPRESSION] = {
+    NULL,
+    "gzip",
+    "lzma",
+    "lzo",
+    "xz",
+    "lz4",
+    "zstd",
+};
+
+// The snapshot of the statistics an open stats file reads from
+typedef struct stats_file {
+    size_t size;
+    char   data[];
+} stats_file_t;
+
+void private_stats_init(private_stats_t *stats) {
+    for (size_t i = 0; i < PRIVATE_OP_COUNT; i++) {
+        private_op_stats_t *op = &stats->ops[i];
+        atomic_init(&op->total_ns, 0);
+        atomic_init(&op->max_ns, 0);
+        for (size_t b = 0; b < PRIVATE_STATS_BUCKETS; b++) atomic_init(&op->buckets[b], 0);
+    }
+    atomic_init(&stats->bytes_served, 0);
+}
+
+uint64_t private_stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void private_stats_op_done(private_stats_t *stats, private_stats_op_t op, uint64_t start) {
+    private_op_stats_t *s  = &stats->ops[op];
+    const uint64_t      ns = private_stats_now() - start;
+
+    unsigned bucket = ns ? 64 - (unsigned)__builtin_clzll(ns) : 0;
+    if (bucket >= PRIVATE_STATS_BUCKETS) bucket = PRIVATE_STATS_BUCKETS - 1;
+
+    atomic_fetch_add_explicit(&s->total_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->buckets[bucket], 1, memory_order_relaxed);
+
+    unsigned long long max = atomic_load_explicit(&s->max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(
+                           &s->max_ns, &max, ns, memory_order_relaxed, memory_order_relaxed)) {}
+}
+
+static sqfs_err
+timed_decompress(sqfs_decompressor inner, unsigned compression, void *in, size_t insz, void *out, size_t *outsz) {
+    decomp_stats_t *s     = &decomp[compression];
+    const uint64_t  start = private_stats_now();
+    sqfs_err        err   = private_decompress(inner, in, insz, out, outsz);
+
+    atomic_fetch_add_explicit(&s->ns, private_stats_now() - start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->blocks, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->in_bytes, insz, memory_order_relaxed);
+    if (err == SQFS_OK) atomic_fetch_add_explicit(&s->out_bytes, *outsz, memory_order_relaxed);
+    return err;
+}
+
+void private_stats_hook(sqfs *fs) {
+    // Without a free slot the image is just not measured
+    if (fs->sb.compression < DECOMP_MAX_COMPRESSION) private_decompress_wrap(fs, timed_decompress);
+}
+
+/* Upper bound of the bucket that contains the given fraction of the requests (at most max), in microseconds */
+static double
+percentile_us(const unsigned long long *buckets, unsigned long long count, double fraction, unsigned long long max) {
+    unsigned long long seen  = 0;
+    unsigned long long bound = max;
+    for (unsigned b = 0; b < PRIVATE_STATS_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > 0 && (double)seen >= fraction * (double)count) {
+            bound = b ? UINT64_C(1) << b : 0;
+            break;
+        }
+    }
+    return (double)(bound < max ? bound : max) / 1000;
+}
+
+static double rate(unsigned long long hits, unsigned long long misses) {
+    return hits + misses ? 100.0 * (double)hits / (double)(hits + misses) : 0;
+}
+
+void private_stats_print(private_mount_t *mount, FILE *f) {
+    const private_stats_t *stats = &mount->stats;
+    unsigned long long     buckets[PRIVATE_OP_COUNT][PRIVATE_STATS_BUCKETS];
+
+    fprintf(f, "%-9s %10s %10s %10s %10s %10s %10s\n", "op", "count", "avg_us", "p50_us", "p90_us", "p99_us", "max_us");
+    for (unsigned i = 0; i < PRIVATE_OP_COUNT; i++) {
+        const private_op_stats_t *op = &stats->ops[i];
+        for (unsigned b = 0; b < PRIVATE_STATS_BUCKETS; b++) buckets[i][b] = atomic_load(&op->buckets[b]);
+
+        // Concurrent requests may already be in total_ns, but not in the histogram yet
+        unsigned long long count = 0;
+        for (unsigned b = 0; b < PRIVATE_STATS_BUCKETS; b++) count += buckets[i][b];
+        unsigned long long total = atomic_load(&op->total_ns);
+        unsigned long long max   = atomic_load(&op->max_ns);
+        fprintf(f,
+                "%-9s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                op_names[i],
+                count,
+                count ? (double)total / (double)count / 1000 : 0,
+                count ? percentile_us(buckets[i], count, 0.5, max) : 0,
+                count ? percentile_us(buckets[i], count, 0.9, max) : 0,
+                count ? percentile_us(buckets[i], count, 0.99, max) : 0,
+                (double)max / 1000);
+    }
+
+    // Non-empty buckets as <upper bound in us>:<count>
+    for (unsigned i = 0; i < PRIVATE_OP_COUNT; i++) {
+        fprintf(f, "histogram %s", op_names[i]);
+        for (unsigned b = 0; b < PRIVATE_STATS_BUCKETS; b++) {
+            if (buckets[i][b]) fprintf(f, " %g:%llu", (double)(UINT64_C(1) << b) / 1000, buckets[i][b]);
+        }
+        fputc('\n', f);
+    }
+
+    fprintf(f, "bytes served: %llu\n", (unsigned long long)atomic_load(&stats->bytes_served));
+    for (unsigned c = 1; c < DECOMP_MAX_COMPRESSION; c++) {
+        const decomp_stats_t *s      = &decomp[c];
+        unsigned long long    blocks = atomic_load(&s->blocks);
+        if (blocks == 0) continue;
+        fprintf(f,
+                "decompress %s: %llu blocks, %llu -> %llu bytes, %.1f ms, %.1f us per block\n",
+                compression_names[c],
+                blocks,
+                (unsigned long long)atomic_load(&s->in_bytes),
+                (unsigned long long)atomic_load(&s->out_bytes),
+                (double)atomic_load(&s->ns) / 1e6,
+                (double)atomic_load(&s->ns) / (double)blocks / 1000);
+    }
+
+    if (mount->opts.disk_cache_mb) {
+        private_disk_cache_stats_t disk;
+        private_disk_cache_get_stats(&disk);
+        fprintf(f,
+                "disk cache: %llu hits, %llu misses (%.1f%%), %llu inserts, %llu corrupt\n",
+                (unsigned long long)disk.hits,
+                (unsigned long long)disk.misses,
+                rate(disk.hits, disk.misses),
+                (unsigned long long)disk.inserts,
+                (unsigned long long)disk.corrupt);
+    }
+    if (mount->block_cache) {
+        private_block_cache_stats_t st;
+        private_block_cache_get_stats(mount->block_cache, &st);
+        fprintf(f,
+                "block cache: %llu hits, %llu misses (%.1f%%), %llu inserts, %llu evictions, %zu / %zu bytes\n",
+                (unsigned long long)st.hits,
+                (unsigned long long)st.misses,
+                rate(st.hits, st.misses),
+                (unsigned long long)st.inserts,
+                (unsigned long long)st.evictions,
+                st.bytes,
+                st.budget);
+    }
+}
+
+static void stats_attr(struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_ino   = PRIVATE_STATS_INO;
+    st->st_mode  = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_uid   = getuid();
+    st->st_gid   = getgid();
+    st->st_mtime = st->st_ctime = st->st_atime = time(NULL);
+}
+
+bool private_stats_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param fentry;
+    if (parent != FUSE_ROOT_ID || strcmp(name, PRIVATE_STATS_NAME) != 0) return false;
+
+    // Never cached, the content changes all the time. forget is ignored for this inode.
+    memset(&fentry, 0, sizeof(fentry));
+    fentry.ino = PRIVATE_STATS_INO;
+    stats_attr(&fentry.attr);
+    fuse_reply_entry(req, &fentry);
+    return true;
+}
+
+void private_stats_getattr(fuse_req_t req) {
+    struct stat st;
+    stats_attr(&st);
+    fuse_reply_attr(req, &st, 0);
+}
+
+void private_stats_open(fuse_req_t req, private_mount_t *mount, struct fuse_file_info *fi) {
+    char *        text = NULL;
+    size_t        size = 0;
+    stats_file_t *file = NULL;
+
+    if (fi->flags & (O_WRONLY | O_RDWR)) {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+
+    // A snapshot per open, so reading in chunks gives a consistent text
+    FILE *f = open_memstream(&text, &size);
+    if (f) {
+        private_stats_print(mount, f);
+        if (fclose(f) == 0 && (file = malloc(sizeof(stats_file_t) + size))) {
+            file->size = size;
+            memcpy(file->data, text, size);
+        }
+    }
+    free(text);
+    if (!file) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    // The size is unknown at lookup time, direct I/O makes the kernel read until EOF instead of up to st_size
+    fi->fh        = (intptr_t)file;
+    fi->direct_io = 1;
+    if (fuse_reply_open(req, fi) != 0) free(file);
+}
+
+void private_stats_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info *fi) {
+    const stats_file_t *file = (const stats_file_t *)(intptr_t)fi->fh;
+    if (off < 0 || (size_t)off >= file->size) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    if (size > file->size - (size_t)off) size = file->size - (size_t)off;
+    fuse_reply_buf(req, file->data + off, size);
+}
+
+void private_stats_release(fuse_req_t req, struct fuse_file_info *fi) {
+    free((stats_file_t *)(intptr_t)fi->fh);
+    fi->fh = 0;
+    fuse_reply_err(req, 0);
+}
+
+FILE *private_stats_dump_open(void) {
+    char *dir = private_socket_dir();
+    char *path;
+    FILE *f = NULL;
+    if (dir && asprintf(&path, "%s/stats-%ld", dir, (long)getpid()) != -1) {
+        f = fopen(path, "we");
+        free(path);
+    }
+    free(dir);
+    return f;
+}
+
+static void dump_signal_handler(int sig) {
+    (void)sig;
+    dump_requested = 1;
+    // sem_post is async-signal-safe, the handler may run in any thread that does not block the signal
+    sem_t *wake = dump_wake;
+    if (wake) sem_post(wake);
+}
+
+void private_stats_signal_start(sem_t *wake) {
+    struct sigaction sa;
+    dump_wake = wake;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dump_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+void private_stats_signal_stop(void) {
+    signal(SIGUSR1, SIG_IGN);
+    dump_wake = NULL;
+}
+
+void private_stats_poll_signal(private_mount_t *mount) {
+    if (!dump_requested) return;
+    dump_requested = 0;
+
+    FILE *f = private_stats_dump_open();
+    if (!f) return;
+    private_stats_print(mount, f);
+    fclose(f);
+}
@@ -0,0 +1,135 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Access tracing for launch optimized image layouts. With trace_sort=<file>, the daemon remembers the order in which
+ * regular files are read for the first time. On unmount, the inode numbers are resolved to paths and written as an
+ * mksquashfs -sort file (see sort_file.c).
+ *
+ * mksquashfs only orders whole files, so the first read of a file is all that is recorded.
+ */
+
+#include "ll_private.h"
+#include "private.h"
+#include "traverse.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct private_trace {
+    private_mount_t *mount;
+    char *           path;
+    atomic_uchar *   seen;  // Indexed by inode number
+    uint32_t *       order; // Inode numbers in the order of their first read
+    atomic_size_t    count;
+};
+
+private_trace_t *private_trace_new(private_mount_t *mount, const char *const path) {
+    const uint32_t   inodes = mount->ll->fs.sb.inodes;
+    private_trace_t *trace  = calloc(1, sizeof(private_trace_t));
+    if (!trace) return NULL;
+
+    trace->mount = mount;
+    trace->path  = strdup(path);
+    trace->seen  = calloc((size_t)inodes + 1, sizeof(atomic_uchar));
+    trace->order = malloc(sizeof(uint32_t) * ((size_t)inodes + 1));
+    atomic_init(&trace->count, 0);
+    if (!trace->path || !trace->seen || !trace->order) {
+        private_trace_free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+void private_trace_touch(private_trace_t *trace, uint32_t inode_number) {
+    if (!trace || inode_number > trace->mount->ll->fs.sb.inodes) return;
+    if (atomic_load_explicit(&trace->seen[inode_number], memory_order_relaxed)) return;
+    if (atomic_exchange(&trace->seen[inode_number], 1)) return;
+
+    // Concurrent first reads of different files end up in an arbitrary, but valid order
+    trace->order[atomic_fetch_add(&trace->count, 1)] = inode_number;
+}
+
+typedef struct traced_path {
+    size_t rank; // Position of the first read
+    size_t seq;  // Position in the traversal, keeps hard links of one inode in a stable order
+    char * path;
+} traced_path_t;
+
+static int compare_traced(const void *a, const void *b) {
+    const traced_path_t *x = a, *y = b;
+    if (x->rank != y->rank) return x->rank < y->rank ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Resolve the traced inode numbers to paths. Hard links get all of their paths listed. */
+static bool write_trace(private_trace_t *trace) {
+    sqfs *         fs     = &trace->mount->ll->fs;
+    const size_t   count  = atomic_load(&trace->count);
+    const uint32_t inodes = fs->sb.inodes;
+    sqfs_traverse  trv;
+    sqfs_err       err       = SQFS_OK;
+    traced_path_t *traced    = NULL;
+    size_t         num_paths = 0;
+    size_t         max_paths = 0;
+
+    // Rank of every traced inode, 0 = not traced
+    size_t *rank   = calloc((size_t)inodes + 1, sizeof(size_t));
+    bool    opened = rank && sqfs_traverse_open(&trv, fs, sqfs_inode_root(fs)) == SQFS_OK;
+    bool    ok     = opened;
+    for (size_t i = 0; rank && i < count; i++) rank[trace->order[i]] = i + 1;
+
+    while (ok && sqfs_traverse_next(&trv, &err)) {
+        if (trv.dir_end || sqfs_dentry_is_dir(&trv.entry)) continue;
+        sqfs_inode_num num = sqfs_dentry_inode_num(&trv.entry);
+        if (num > inodes || rank[num] == 0) continue;
+
+        if (num_paths == max_paths) {
+            max_paths          = max_paths ? max_paths * 2 : 256;
+            traced_path_t *tmp = realloc(traced, sizeof(traced_path_t) * max_paths);
+            if (!tmp) {
+                ok = false;
+                break;
+            }
+            traced = tmp;
+        }
+        traced[num_paths] = (traced_path_t){rank[num], num_paths, strdup(trv.path)};
+        ok                = traced[num_paths++].path != NULL;
+    }
+    if (opened) {
+        ok = ok && err == SQFS_OK;
+        sqfs_traverse_close(&trv);
+    }
+
+    char **files = ok ? malloc(sizeof(char *) * (num_paths ? num_paths : 1)) : NULL;
+    ok           = ok && files;
+    if (ok) {
+        qsort(traced, num_paths, sizeof(traced_path_t), compare_traced);
+        for (size_t i = 0; i < num_paths; i++) files[i] = traced[i].path;
+        ok = private_write_sort_file(trace->path, files, num_paths);
+        if (ok) fprintf(stderr, "trace: wrote %zu accessed files to %s\n", num_paths, trace->path);
+    }
+
+    for (size_t i = 0; i < num_paths; i++) free(traced[i].path);
+    free(traced);
+    free(files);
+    free(rank);
+    return ok;
+}
+
+void private_trace_free(private_trace_t *trace) {
+    if (!trace) return;
+
+    if (trace->order && atomic_load(&trace->count) > 0) {
+        // Traversing the image uses the squashfuse caches, which are guarded by the mount lock
+        pthread_mutex_lock(&trace->mount->lock);
+        if (!write_trace(trace)) fprintf(stderr, "trace: failed to write the sort file %s\n", trace->path);
+        pthread_mutex_unlock(&trace->mount->lock);
+    }
+
+    free(trace->path);
+    free((void *)trace->seen);
+    free(trace->order);
+    free(trace);
+}
@@ -0,0 +1,224 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Giving memory back. A mount that stays around for a long running application keeps its caches filled with blocks
+ * that were only needed during startup. Two triggers shrink them:
+ *
+ *  - Idle: after trim_idle seconds without a request, the block cache entries of the mount, the squashfuse caches and
+ *    the directory lookup tables are dropped once, and malloc is asked to return the freed pages to the kernel. The
+ *    caches refill on demand.
+ *  - Pressure: a PSI trigger on the memory pressure of the cgroup (or of the system, without cgroup v2) fires once
+ *    the stalls exceed trim_pressure % of a window. The block cache budget is then cut to a quarter and the caches
+ *    are trimmed as above. While the budget is reduced, the "some avg10" value is polled every few seconds and the
+ *    budget is restored once it falls below half of the threshold. Kernels that do not let us create a trigger
+ *    (before Linux 6.5 without CAP_SYS_RESOURCE) fall back to polling avg10 all the time.
+ *
+ * Nothing here runs on a fixed tick: the session loop sleeps until the deadline returned by private_trim_tick or until
+ * the trigger watcher wakes it up.
+ *
+ * Hosted mounts share the block cache of the per-user daemon, so they only drop their own key range and leave the
+ * budget alone.
+ */
+
+#define _GNU_SOURCE
+
+#include "ll_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PRESSURE_CHECK_SECS 5
+#define PRESSURE_BUDGET_DIV 4
+#define PRESSURE_WINDOW_US 2000000 // Unprivileged triggers need a multiple of 2 s
+
+static char *         pressure_path;
+static pthread_once_t pressure_once = PTHREAD_ONCE_INIT;
+
+/* Prefer the pressure of our own cgroup, the system wide value also counts unrelated containers */
+static void find_pressure_path(void) {
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (f) {
+        char * line = NULL;
+        size_t size = 0;
+        while (!pressure_path && getline(&line, &size, f) != -1) {
+            if (strncmp(line, "0::", 3) != 0) continue;
+            line[strcspn(line, "\n")] = '\0';
+
+            char *path;
+            if (asprintf(&path, "/sys/fs/cgroup%s/memory.pressure", line + 3) == -1) break;
+            if (access(path, R_OK) == 0) {
+                pressure_path = path;
+            } else {
+                free(path);
+            }
+        }
+        free(line);
+        fclose(f);
+    }
+    if (!pressure_path && access("/proc/pressure/memory", R_OK) == 0) pressure_path = strdup("/proc/pressure/memory");
+}
+
+/* Returns the "some avg10" value in %, or -1 without PSI */
+static double read_pressure(void) {
+    pthread_once(&pressure_once, find_pressure_path);
+    if (!pressure_path) return -1;
+
+    FILE *f = fopen(pressure_path, "r");
+    if (!f) return -1;
+    double avg10 = -1;
+    if (fscanf(f, "some avg10=%lf", &avg10) != 1) avg10 = -1;
+    fclose(f);
+    return avg10;
+}
+
+/* Empty a squashfuse cache, keeping its size. On failure, the old cache stays: squashfuse can not work without one. */
+static bool reset_cache(sqfs_cache *cache) {
+    sqfs_cache empty;
+    if (sqfs_cache_init(&empty, sizeof(sqfs_block_cache_entry), cache->count, cache->dispose)) return false;
+    sqfs_cache_destroy(cache);
+    *cache = empty;
+    return true;
+}
+
+static void trim_caches(private_mount_t *mount) {
+    if (mount->block_cache) {
+        const uint64_t base = mount->cache_key_base;
+        private_block_cache_drop(mount->block_cache, base, mount->host ? PRIVATE_HOST_KEY_LAST(base) : UINT64_MAX);
+    }
+
+    pthread_mutex_lock(&mount->lock);
+    bool ok = reset_cache(&mount->ll->fs.md_cache);
+    ok      = reset_cache(&mount->ll->fs.data_cache) && ok;
+    ok      = reset_cache(&mount->ll->fs.frag_cache) && ok;
+    private_dir_index_clear(mount->dir_index);
+    pthread_mutex_unlock(&mount->lock);
+    if (!ok) fprintf(stderr, "trim: failed to reset the squashfuse caches, keeping them\n");
+
+    malloc_trim(0);
+}
+
+static void *pressure_watcher(void *data) {
+    private_trim_state_t *trim = data;
+    struct pollfd         pfd  = {.fd = trim->trigger_fd, .events = POLLPRI};
+
+    while (true) {
+        int res = poll(&pfd, 1, -1);
+        if (res == -1 && errno == EINTR) continue;
+        if (res == -1 || (pfd.revents & POLLERR)) break; // The cgroup is gone
+        if (pfd.revents & POLLPRI) {
+            atomic_store(&trim->triggered, true);
+            sem_post(trim->wake);
+        }
+    }
+    return NULL;
+}
+
+void private_trim_start(private_mount_t *mount, sem_t *wake) {
+    private_trim_state_t *trim      = &mount->trim;
+    const unsigned        threshold = mount->opts.trim_pressure < 100 ? mount->opts.trim_pressure : 100;
+    char                  trigger[64];
+
+    trim->wake = wake;
+    if (threshold == 0) return;
+    pthread_once(&pressure_once, find_pressure_path);
+    if (!pressure_path) return;
+
+    // The trigger is registered by writing to the pressure file and lives as long as the fd
+    const unsigned stall = PRESSURE_WINDOW_US / 100 * threshold;
+    const int      len   = snprintf(trigger, sizeof(trigger), "some %u %u", stall, PRESSURE_WINDOW_US);
+    const int      fd    = open(pressure_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1 || write(fd, trigger, (size_t)len + 1) != len + 1) {
+        if (fd != -1) close(fd);
+        return;
+    }
+
+    // The signal handlers only need to run in the main thread
+    sigset_t oldset, newset;
+    sigfillset(&newset);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    trim->trigger_fd = fd;
+    if (pthread_create(&trim->watcher, NULL, pressure_watcher, trim) != 0) {
+        close(fd);
+        trim->trigger_fd = -1;
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+
+void private_trim_stop(private_mount_t *mount) {
+    private_trim_state_t *trim = &mount->trim;
+    if (trim->trigger_fd != -1) {
+        pthread_cancel(trim->watcher);
+        pthread_join(trim->watcher, NULL);
+        close(trim->trigger_fd);
+        trim->trigger_fd = -1;
+    }
+    trim->wake = NULL;
+}
+
+static void check_pressure(private_mount_t *mount, long long now) {
+    private_trim_state_t *trim      = &mount->trim;
+    const bool            triggered = atomic_exchange(&trim->triggered, false);
+    if (!triggered && now < trim->next_check) return;
+
+    // The trigger already compared the stalls with the threshold, avg10 lags behind it
+    const double threshold = mount->opts.trim_pressure;
+    double       pressure  = triggered ? threshold : read_pressure();
+    if (pressure < 0) {
+        // No PSI on this kernel, do not look again
+        trim->next_check = LLONG_MAX;
+        return;
+    }
+
+    if (!trim->under_pressure && pressure >= threshold) {
+        trim->under_pressure = true;
+        if (mount->block_cache && !mount->host) {
+            private_block_cache_stats_t stats;
+            private_block_cache_get_stats(mount->block_cache, &stats);
+            trim->budget = stats.budget;
+            private_block_cache_set_budget(mount->block_cache, stats.budget / PRESSURE_BUDGET_DIV);
+        }
+        trim_caches(mount);
+    } else if (trim->under_pressure && pressure < threshold / 2) {
+        trim->under_pressure = false;
+        if (mount->block_cache && !mount->host) private_block_cache_set_budget(mount->block_cache, trim->budget);
+    }
+
+    // With a trigger, avg10 is only needed to notice that the pressure is gone again
+    trim->next_check = trim->under_pressure || trim->trigger_fd == -1 ? now + PRESSURE_CHECK_SECS : LLONG_MAX;
+}
+
+long long private_trim_tick(private_mount_t *mount) {
+    private_trim_state_t *trim     = &mount->trim;
+    const long long       now      = (long long)time(NULL);
+    const long long       idle     = (long long)mount->opts.trim_idle_secs;
+    long long             deadline = LLONG_MAX;
+
+    if (mount->opts.trim_pressure) {
+        check_pressure(mount, now);
+        deadline = trim->next_check;
+    }
+    if (idle == 0) return deadline;
+
+    const long long last = atomic_load(&mount->last_request);
+    if (now - last < idle) {
+        trim->idle_trimmed = false;
+    } else if (!trim->idle_trimmed) {
+        trim->idle_trimmed = true;
+        trim_caches(mount);
+    }
+
+    // Once trimmed, only look for new requests now and then, the next trim is due idle seconds after them anyway
+    const long long idle_end = trim->idle_trimmed ? now + idle : last + idle;
+    return idle_end < deadline ? idle_end : deadline;
+}
@@ -3,7 +3,7 @@
 // Copyright 2021    Daniel Mensinger
 // SPDX-License-Identifier: MIT
 
-#define _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
 #define _XOPEN_SOURCE 500
 
 #include "libruntime.h"
@@ -34,7 +34,8 @@ static void *write_pipe_thread(void *arg) {
         /* Write until we block, on broken pipe, exit */
         res = write(keepalive_pipe[1], c, sizeof(c));
         if (res == -1) {
-            kill(fuse_pid, SIGTERM);
+            // A shared mount stays until the other launches are gone as well
+            if (!private_share_unref()) kill(fuse_pid, SIGTERM);
             break;
         }
     }
@@ -47,13 +48,42 @@ void fuse_mounted(void) {
     pthread_create(&thread, NULL, write_pipe_thread, NULL);
 }
 
+/* Keep a handle to the mount in a well known fd and run the application */
+static bool run_mounted(appimage_context_t *const context,
+                        const char *              mount_path,
+                        appimage_cb_mounted       mounted_cb,
+                        void *                    cb_user_data) {
+    int dir_fd = open(mount_path, O_RDONLY);
+    if (dir_fd == -1) {
+        perror("open dir error");
+        return false;
+    }
+
+    if (dup2(dir_fd, 1023) == -1) {
+        perror("dup2 error");
+        return false;
+    }
+    close(dir_fd);
+
+    mounted_cb(context, cb_user_data);
+    return true;
+}
+
 bool appimage_self_mount(appimage_context_t *const context,
                          const char *              mount_path,
                          appimage_cb_mounted       mounted_cb,
                          void *                    cb_user_data) {
-    int   dir_fd, res;
     pid_t pid;
 
+    // Privileged launches use the squashfs driver of the kernel, FUSE is the fallback
+    if (private_kernel_mount_enabled() &&
+        private_kernel_mount(context->appimage_path, (size_t)context->fs_offset, mount_path)) {
+        return run_mounted(context, mount_path, mounted_cb, cb_user_data);
+    }
+
+    // Without fusermount, the launcher mounts in a user namespace and the daemon only serves the /dev/fuse fd
+    int fuse_fd = private_userns_enabled() ? private_userns_mount(context->appimage_path, mount_path) : -1;
+
     if (pipe(keepalive_pipe) == -1) {
         perror("pipe error");
         return false;
@@ -75,8 +105,25 @@ bool appimage_self_mount(appimage_context_t *const context,
 
         char *dir = realpath(context->appimage_path, NULL);
 
-        char options[100];
-        sprintf(options, "ro,offset=%lu", context->fs_offset);
+        // Additional mount daemon options (e.g. max_threads=8) can be passed via the environment
+        const char *extra_options = getenv("APPIMAGE_FUSE_OPTIONS");
+        if (extra_options == NULL) extra_options = "";
+
+        // A mount in a user namespace is only visible to this launch, it can not be shared
+        char mount_option[32] = ",share";
+        if (fuse_fd != -1) {
+            sprintf(mount_option, ",fuse_fd=%d", fuse_fd);
+        } else if (!private_share_enabled()) {
+            mount_option[0] = '\0';
+        }
+
+        char *options = malloc(64 + strlen(extra_options) + 1);
+        sprintf(options,
+                "ro,offset=%lu%s%s%s",
+                context->fs_offset,
+                mount_option,
+                extra_options[0] ? "," : "",
+                extra_options);
 
         child_argv[0] = dir;
         child_argv[1] = "-o";
@@ -99,6 +146,7 @@ bool appimage_self_mount(appimage_context_t *const context,
 
         /* close write pipe */
         close(keepalive_pipe[1]);
+        if (fuse_fd != -1) close(fuse_fd);
 
         /* Pause until mounted */
         read(keepalive_pipe[0], &c, 1);
@@ -106,21 +154,6 @@ bool appimage_self_mount(appimage_context_t *const context,
         /* Fuse process has now daemonized, reap our child */
         waitpid(pid, NULL, 0);
 
-        dir_fd = open(mount_path, O_RDONLY);
-        if (dir_fd == -1) {
-            perror("open dir error");
-            return false;
-        }
-
-        res = dup2(dir_fd, 1023);
-        if (res == -1) {
-            perror("dup2 error");
-            return false;
-        }
-        close(dir_fd);
-
-        mounted_cb(context, cb_user_data);
+        return run_mounted(context, mount_path, mounted_cb, cb_user_data);
     }
-
-    return true;
 }
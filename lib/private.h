@@ -26,4 +26,79 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
+struct pollfd;
+
 int fusefs_main(int argc, char *argv[], void (*mounted)(void));
+
+// ll_daemon.c: Main loop of the per-user daemon that serves the mounts of all images of the user. Handles the mount
+// requests sent to listen_fd (see appimage_daemon_mount) and returns the exit code once it has been idle for a while.
+int private_daemon_main(int listen_fd, const char *const socket_path);
+
+// Write an mksquashfs -sort file, files are paths relative to the image root in the order of their first access
+bool private_write_sort_file(const char *const path, char *const *const files, size_t count);
+
+// share.c: Mounts are shared unless APPIMAGE_SHARE_MOUNT=0
+bool private_share_enabled(void);
+
+// Per-user rendezvous socket of the mount of an image (NULL if the image or the directory is not usable)
+char *private_share_socket_path(const char *const image, size_t offset);
+
+// Per-user directory of the rendezvous sockets, only accessible by the user (NULL if it is not usable)
+char *private_socket_dir(void);
+
+// Connect to a unix socket. Reads time out after a few seconds, the fd is not close on exec.
+int private_socket_connect(const char *const socket_path);
+
+// Read a '\n' terminated line and strip the '\n'. False on timeout, EOF or if the line does not fit.
+bool private_socket_read_line(int fd, char *line, size_t size);
+
+// Listen on a non-blocking, close on exec socket. A stale socket file left behind by a crashed process is replaced,
+// -1 if another process listens already.
+int private_socket_listen(const char *const path);
+
+// Mount daemon side. The launch that started the daemon holds the initial reference, it is dropped with
+// private_share_unref (false if the mount is not shared). The daemon terminates itself linger_secs after the last
+// reference is gone.
+bool private_share_start(const char *const socket_path, const char *const mountpoint, unsigned linger_secs);
+void private_share_stop(void);
+bool private_share_unref(void);
+
+// userns.c: Mount in a user namespace instead of with fusermount. Used if APPIMAGE_USERNS_MOUNT=1 or if there is no
+// fusermount, never with FUSE 2.
+bool private_userns_enabled(void);
+
+// Move the calling process into a new user and mount namespace and mount a FUSE filesystem at mount_path there.
+// Returns the /dev/fuse fd (close on exec) that the mount daemon has to serve, -1 if the namespace can not be used (the
+// calling process is unchanged then). Exits the process if the mount fails after it entered the namespace.
+int private_userns_mount(const char *const image, const char *const mount_path);
+
+// kernel_mount.c: Mount with the squashfs driver of the kernel through a loop device. Only used with
+// APPIMAGE_KERNEL_MOUNT=1 and CAP_SYS_ADMIN.
+bool private_kernel_mount_enabled(void);
+
+// The mount is detached once the calling process and all of its children exited
+bool private_kernel_mount(const char *const image, size_t offset, const char *const mount_path);
+
+// util.c: Detach a forked child like a FUSE daemon: a new session and a second fork, so that it neither holds the
+// terminal nor becomes a zombie of the launcher, stdio on /dev/null and / as working directory. Only the detached
+// process returns.
+void private_daemonize(void);
+
+// CLOCK_MONOTONIC in milliseconds
+long long private_now_ms(void);
+
+// Upper limit of the open connections of a socket loop (share.c, ll_daemon.c)
+#define PRIVATE_MAX_CLIENTS 1024
+
+// Wake up a poll loop through the non-blocking write end of a pipe, a full pipe wakes it up as well
+void private_wake_pipe(int fd);
+
+// Empty the non-blocking read end of a wake up pipe
+void private_drain_pipe(int fd);
+
+// The clients of the socket loops never send anything (after their request), readable means closed. Calls remove for
+// every client whose entry in fds has events, backwards, so that remove may move the last client into the freed slot.
+void private_remove_closed_clients(const struct pollfd *fds, size_t num_clients, void (*remove)(size_t i));
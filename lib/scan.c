@@ -0,0 +1,166 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+#include <features.h>
+
+#include "libruntime.h"
+#include "thread_pool.h"
+#include "libappimage/appimage_shared.h"
+#include "libappimage/md5.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+typedef struct scan_state {
+    appimage_scan_cb found_cb;
+    void *           cb_user_data;
+    bool             calc_digest;
+    pthread_mutex_t  cb_lock; // callbacks are serialized
+} scan_state_t;
+
+typedef struct scan_task {
+    scan_state_t *state;
+    char *        path;
+} scan_task_t;
+
+/* Cheap check that does not require mapping the file: ELF magic + AppImage type 2 magic ("AI\x02" at offset 8) */
+static bool is_type2_appimage(const char *const path) {
+    unsigned char magic[11];
+    int           fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    ssize_t res = pread(fd, magic, sizeof(magic), 0);
+    close(fd);
+
+    if (res != (ssize_t)sizeof(magic)) return false;
+    return memcmp(magic, "\x7f" "ELF", 4) == 0 && magic[8] == 'A' && magic[9] == 'I' && magic[10] == 0x02;
+}
+
+static void scan_file(void *arg) {
+    scan_task_t *         task  = arg;
+    scan_state_t *        state = task->state;
+    appimage_scan_entry_t entry;
+
+    if (!is_type2_appimage(task->path)) goto cleanup;
+
+    appimage_image_t *image = appimage_image_open(task->path);
+    if (image == NULL) goto cleanup;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.path        = task->path;
+    entry.fs_offset   = appimage_image_get_elf_size(image);
+    entry.update_info = appimage_image_get_update_info(image);
+    entry.signature   = appimage_image_get_signature(image);
+
+    if (state->calc_digest) {
+        char digest[MD5_HASH_SIZE];
+        if (appimage_image_digest_md5(image, digest)) {
+            char *hex = appimage_hexlify((const uint8_t *)digest, sizeof(digest));
+            strcpy(entry.digest_md5, hex);
+            free(hex);
+        }
+    }
+
+    appimage_image_close(image);
+
+    pthread_mutex_lock(&state->cb_lock);
+    state->found_cb(&entry, state->cb_user_data);
+    pthread_mutex_unlock(&state->cb_lock);
+
+    free(entry.update_info);
+    free(entry.signature);
+
+cleanup:
+    free(task->path);
+    free(task);
+}
+
+static bool scan_dir(private_thread_pool_t *pool, scan_state_t *state, const char *const path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "Failed to open directory %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    bool           rv  = true;
+    size_t         len = strlen(path);
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL) {
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) continue;
+
+        char *child = malloc(len + 1 + strlen(d->d_name) + 1);
+        if (child == NULL) {
+            rv = false;
+            break;
+        }
+        strcpy(child, path);
+        if (len == 0 || path[len - 1] != '/') strcat(child, "/");
+        strcat(child, d->d_name);
+
+        unsigned char type = d->d_type;
+        if (type == DT_UNKNOWN) {
+            // Not all file systems fill d_type, fall back to lstat (symlinks are never followed)
+            struct stat st;
+            if (lstat(child, &st) == 0) type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if (type == DT_DIR) {
+            scan_dir(pool, state, child);
+            free(child);
+        } else if (type == DT_REG) {
+            scan_task_t *task = malloc(sizeof(scan_task_t));
+            if (task == NULL) {
+                free(child);
+                rv = false;
+                break;
+            }
+            task->state = state;
+            task->path  = child;
+            if (!private_thread_pool_submit(pool, scan_file, task)) {
+                free(task);
+                free(child);
+                rv = false;
+                break;
+            }
+        } else {
+            free(child);
+        }
+    }
+
+    closedir(dir);
+    return rv;
+}
+
+bool appimage_scan_directory(const char *const path,
+                             unsigned          num_threads,
+                             bool              calc_digest,
+                             appimage_scan_cb  found_cb,
+                             void *            cb_user_data) {
+    scan_state_t state;
+    state.found_cb     = found_cb;
+    state.cb_user_data = cb_user_data;
+    state.calc_digest  = calc_digest;
+    pthread_mutex_init(&state.cb_lock, NULL);
+
+    private_thread_pool_t *pool = private_thread_pool_new(num_threads);
+    if (pool == NULL) {
+        pthread_mutex_destroy(&state.cb_lock);
+        return false;
+    }
+
+    // The directory walk itself is cheap, the actual work (opening, parsing and hashing the files) is done in the pool
+    bool rv = scan_dir(pool, &state, path);
+
+    private_thread_pool_free(pool);
+    pthread_mutex_destroy(&state.cb_lock);
+    return rv;
+}
@@ -0,0 +1,24 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PRIVATE_SHA256_SIZE 32
+
+// FIPS 180-4 SHA-256, for keys that must not collide even for crafted input (md5.c does not qualify)
+typedef struct private_sha256 {
+    uint32_t state[8];
+    uint64_t length; // Bytes hashed so far
+    uint8_t  buf[64];
+    size_t   buf_len;
+} private_sha256_t;
+
+void private_sha256_init(private_sha256_t *ctx);
+void private_sha256_update(private_sha256_t *ctx, const void *data, size_t size);
+void private_sha256_final(private_sha256_t *ctx, uint8_t digest[PRIVATE_SHA256_SIZE]);
+
+// One shot version of the above
+void private_sha256(const void *data, size_t size, uint8_t digest[PRIVATE_SHA256_SIZE]);
@@ -0,0 +1,401 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Sharing one mount between all launches of an image. The mount daemon listens on a per-user unix socket that is
+ * named after the device, inode, mtime and offset of the image. A later launch connects to it and receives the mount
+ * path. The connection is then inherited by the application (like the keepalive pipe of the launch that started the
+ * daemon) and serves as reference: once all references are gone, the daemon lingers for linger_secs and unmounts if
+ * no new launch attached in the meantime.
+ *
+ * Daemon side: private_share_start / private_share_stop / private_share_unref
+ * Launcher side: appimage_attach_mount
+ *
+ * The per-user daemon (ll_daemon.c) uses the same socket directory and reference semantics, appimage_daemon_mount
+ * sends it the mount request and starts it if it is not running yet.
+ */
+
+#define _GNU_SOURCE
+
+#include "libruntime.h"
+#include "private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define ATTACH_TIMEOUT_SECS 2
+
+typedef struct share {
+    int         listen_fd;
+    int         wake[2]; // Wakes the share thread on unref and stop
+    char *      socket_path;
+    char *      mountpoint;
+    unsigned    linger_secs;
+    atomic_int  refs;
+    atomic_bool stop;
+    pthread_t   thread;
+    bool        running;
+    int         clients[PRIVATE_MAX_CLIENTS];
+    size_t      num_clients;
+} share_t;
+
+// There is only one mount per daemon
+static share_t share = {.listen_fd = -1, .wake = {-1, -1}};
+
+/* The directory must belong to us and must not be accessible by anyone else, otherwise others could hijack mounts */
+static bool private_dir(const char *const path) {
+    struct stat st;
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) return false;
+    return lstat(path, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == getuid() && (st.st_mode & 077) == 0;
+}
+
+bool private_share_enabled(void) {
+    const char *env = getenv("APPIMAGE_SHARE_MOUNT");
+    return env == NULL || strcmp(env, "0") != 0;
+}
+
+char *private_socket_dir(void) {
+    char *      dir;
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    const char *tmp_dir     = getenv("TMPDIR");
+
+    if (runtime_dir && runtime_dir[0] == '/') {
+        if (asprintf(&dir, "%s/appimage", runtime_dir) == -1) return NULL;
+    } else {
+        if (asprintf(&dir, "%s/appimage-%u", tmp_dir && tmp_dir[0] == '/' ? tmp_dir : "/tmp", (unsigned)getuid()) ==
+            -1) {
+            return NULL;
+        }
+    }
+
+    if (!private_dir(dir)) {
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+/* sun_path is limited to 108 bytes */
+static char *check_socket_path(char *path) {
+    if (path && strlen(path) >= sizeof(((struct sockaddr_un *)NULL)->sun_path)) {
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+char *private_share_socket_path(const char *const image, size_t offset) {
+    struct stat st;
+    char *      dir;
+    char *      path;
+
+    if (stat(image, &st) != 0 || !(dir = private_socket_dir())) return NULL;
+
+    bool ok = asprintf(&path,
+                       "%s/%llx-%llx-%llx-%zx.sock",
+                       dir,
+                       (unsigned long long)st.st_dev,
+                       (unsigned long long)st.st_ino,
+                       (unsigned long long)st.st_mtime,
+                       offset) != -1;
+    free(dir);
+    return ok ? check_socket_path(path) : NULL;
+}
+
+static void socket_address(const char *const path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+}
+
+int private_socket_connect(const char *const socket_path) {
+    struct sockaddr_un addr;
+    struct timeval     timeout = {ATTACH_TIMEOUT_SECS, 0};
+
+    // Not close on exec: the application inherits the reference
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+
+    socket_address(socket_path, &addr);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+bool private_socket_read_line(int fd, char *line, size_t size) {
+    size_t len = 0;
+    while (len + 1 < size) {
+        ssize_t res = read(fd, line + len, size - len - 1);
+        if (res <= 0) break;
+        len += (size_t)res;
+        if (line[len - 1] == '\n') break;
+    }
+
+    // A daemon that is shutting down closes the connection without an answer
+    if (len == 0 || line[len - 1] != '\n') return false;
+    line[len - 1] = '\0';
+    return true;
+}
+
+/* Connect and read the mount path. The returned fd is the reference to the mount. */
+static int share_connect(const char *const socket_path, char *mount_path, size_t size) {
+    int fd = private_socket_connect(socket_path);
+    if (fd != -1 && !private_socket_read_line(fd, mount_path, size)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Keep the reference fd open for the application and return the mount path */
+static char *hold_mount(int fd, const char *const mount_path) {
+    // Same as for a new mount: keep a handle to the mount in a well known fd
+    int dir_fd = open(mount_path, O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1 || dup2(dir_fd, 1023) == -1) {
+        if (dir_fd != -1) close(dir_fd);
+        close(fd);
+        return NULL;
+    }
+    close(dir_fd);
+
+    struct timeval no_timeout = {0, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
+    return strdup(mount_path);
+}
+
+char *appimage_attach_mount(appimage_context_t *const context) {
+    char  mount_path[4096];
+    char *socket_path = private_share_enabled() ? private_share_socket_path(context->appimage_path,
+                                                                            (size_t)context->fs_offset)
+                                                : NULL;
+    if (socket_path == NULL) return NULL;
+
+    int fd = share_connect(socket_path, mount_path, sizeof(mount_path));
+    free(socket_path);
+    if (fd == -1) return NULL;
+    return hold_mount(fd, mount_path);
+}
+
+bool appimage_user_daemon_enabled(void) {
+    const char *env = getenv("APPIMAGE_USER_DAEMON");
+    return env != NULL && strcmp(env, "1") == 0;
+}
+
+/* Start the per-user daemon in the background. The socket is bound here, so it can be connected to right away. */
+static void spawn_daemon(const char *const socket_path) {
+    int listen_fd = private_socket_listen(socket_path);
+    if (listen_fd == -1) return; // Another launcher was faster
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Detach from the session of the launcher, the daemon outlives it
+        private_daemonize();
+        _exit(private_daemon_main(listen_fd, socket_path));
+    }
+
+    close(listen_fd);
+    if (pid != -1) waitpid(pid, NULL, 0);
+}
+
+char *appimage_daemon_mount(appimage_context_t *const context, const char *const mount_path) {
+    char  reply[4096];
+    char *dir         = private_socket_dir();
+    char *socket_path = NULL;
+    char *image       = realpath(context->appimage_path, NULL);
+    char *request     = NULL;
+
+    if (dir && asprintf(&socket_path, "%s/daemon.sock", dir) == -1) socket_path = NULL;
+    free(dir);
+    socket_path = check_socket_path(socket_path);
+
+    // Per-launch options of the mount daemon apply to the image of this launch, see appimage_self_mount
+    const char *extra_options = getenv("APPIMAGE_FUSE_OPTIONS");
+
+    // The request is one field per line, a newline in a field would shift the others (e.g. into the options)
+    if ((image && strchr(image, '\n')) || strchr(mount_path, '\n') || (extra_options && strchr(extra_options, '\n'))) {
+        fprintf(stderr, "Not using the mount daemon: the image path or APPIMAGE_FUSE_OPTIONS contains a newline\n");
+        free(image);
+        free(socket_path);
+        return NULL;
+    }
+
+    if (!image || !socket_path ||
+        asprintf(&request,
+                 "%s\n%lu\n%s\n%s\n",
+                 image,
+                 context->fs_offset,
+                 mount_path,
+                 extra_options ? extra_options : "") == -1) {
+        free(image);
+        free(socket_path);
+        return NULL;
+    }
+    free(image);
+
+    int fd = private_socket_connect(socket_path);
+    if (fd == -1) {
+        spawn_daemon(socket_path);
+        fd = private_socket_connect(socket_path);
+    }
+    free(socket_path);
+
+    size_t len = strlen(request);
+    bool   ok  = fd != -1 && send(fd, request, len, MSG_NOSIGNAL) == (ssize_t)len &&
+              private_socket_read_line(fd, reply, sizeof(reply));
+    free(request);
+    if (!ok) {
+        if (fd != -1) close(fd);
+        return NULL;
+    }
+
+    // The daemon serves the image already, the directory created for this launch is not used
+    if (strcmp(reply, mount_path) != 0) rmdir(mount_path);
+    return hold_mount(fd, reply);
+}
+
+static void remove_client(size_t i) {
+    close(share.clients[i]);
+    share.clients[i] = share.clients[--share.num_clients];
+    atomic_fetch_sub(&share.refs, 1);
+}
+
+static void accept_client(void) {
+    int fd = accept4(share.listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd == -1) return;
+
+    // The path is short, it always fits into the socket buffer
+    size_t len = strlen(share.mountpoint);
+    if (share.num_clients == PRIVATE_MAX_CLIENTS || write(fd, share.mountpoint, len) != (ssize_t)len ||
+        write(fd, "\n", 1) != 1) {
+        close(fd);
+        return;
+    }
+    share.clients[share.num_clients++] = fd;
+    atomic_fetch_add(&share.refs, 1);
+}
+
+static void *share_thread(void *arg) {
+    struct pollfd fds[PRIVATE_MAX_CLIENTS + 2];
+    long long     idle_since = -1;
+    (void)arg;
+
+    while (!atomic_load(&share.stop)) {
+        fds[0] = (struct pollfd){share.wake[0], POLLIN, 0};
+        fds[1] = (struct pollfd){share.listen_fd, POLLIN, 0};
+        for (size_t i = 0; i < share.num_clients; i++) fds[i + 2] = (struct pollfd){share.clients[i], POLLIN, 0};
+
+        // Linger once the last reference is gone
+        int timeout = -1;
+        if (atomic_load(&share.refs) == 0) {
+            if (idle_since < 0) idle_since = private_now_ms();
+            long long left = idle_since + (long long)share.linger_secs * 1000 - private_now_ms();
+            if (left <= 0) break;
+            timeout = (int)left;
+        } else {
+            idle_since = -1;
+        }
+
+        if (poll(fds, share.num_clients + 2, timeout) == -1 && errno != EINTR) break;
+
+        if (fds[0].revents) private_drain_pipe(share.wake[0]);
+        private_remove_closed_clients(fds + 2, share.num_clients, remove_client);
+        if (fds[1].revents & POLLIN) accept_client();
+    }
+
+    // Stop accepting before unmounting, so that no launch attaches to a mount that goes away
+    unlink(share.socket_path);
+    close(share.listen_fd);
+    share.listen_fd = -1;
+    if (!atomic_load(&share.stop)) kill(getpid(), SIGTERM); // Ends the session loop, like the keepalive pipe
+    return NULL;
+}
+
+int private_socket_listen(const char *const path) {
+    struct sockaddr_un addr;
+    socket_address(path, &addr);
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (fd == -1) return -1;
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(fd, 64) == 0) return fd;
+        int error = errno;
+        close(fd);
+        if (error != EADDRINUSE) return -1;
+
+        // Another daemon listens already, or a crashed one left its socket behind
+        int other = private_socket_connect(path);
+        if (other != -1 || errno != ECONNREFUSED) {
+            if (other != -1) close(other);
+            return -1;
+        }
+        unlink(path);
+    }
+    return -1;
+}
+
+bool private_share_start(const char *const socket_path, const char *const mountpoint, unsigned linger_secs) {
+    share.socket_path = strdup(socket_path);
+    share.mountpoint  = strdup(mountpoint);
+    share.linger_secs = linger_secs;
+    atomic_init(&share.refs, 1); // The launch that started the daemon, see private_share_unref
+    atomic_init(&share.stop, false);
+
+    if (!share.socket_path || !share.mountpoint || pipe2(share.wake, O_CLOEXEC | O_NONBLOCK) != 0 ||
+        (share.listen_fd = private_socket_listen(socket_path)) == -1 ||
+        pthread_create(&share.thread, NULL, share_thread, NULL) != 0) {
+        if (share.listen_fd != -1) {
+            unlink(socket_path);
+            close(share.listen_fd);
+            share.listen_fd = -1;
+        }
+        private_share_stop();
+        return false;
+    }
+    share.running = true;
+    return true;
+}
+
+bool private_share_unref(void) {
+    if (!share.running) return false;
+    atomic_fetch_sub(&share.refs, 1);
+    private_wake_pipe(share.wake[1]);
+    return true;
+}
+
+void private_share_stop(void) {
+    if (share.running) {
+        atomic_store(&share.stop, true);
+        private_wake_pipe(share.wake[1]);
+        pthread_join(share.thread, NULL);
+        share.running = false;
+    }
+
+    for (size_t i = 0; i < share.num_clients; i++) close(share.clients[i]);
+    share.num_clients = 0;
+    for (int i = 0; i < 2; i++) {
+        if (share.wake[i] != -1) close(share.wake[i]);
+        share.wake[i] = -1;
+    }
+    free(share.socket_path);
+    free(share.mountpoint);
+    share.socket_path = NULL;
+    share.mountpoint  = NULL;
+}
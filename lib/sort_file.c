@@ -0,0 +1,119 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * mksquashfs -sort files from access traces. Each line of a sort file is "<path> <priority>" and mksquashfs places
+ * files with a higher priority first in the image. The first file that was accessed gets the highest priority, so an
+ * image rebuilt with the sort file stores the data needed at startup contiguously at its front. Files that were not
+ * accessed are not listed and keep the default priority 0.
+ *
+ * Paths are relative to the root of the image, which matches a mksquashfs call with the AppDir as only source.
+ */
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 500
+#include <features.h>
+
+#include "libruntime.h"
+#include "private.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <ftw.h>
+
+#define MAX_PRIORITY 32767
+
+typedef struct accessed_file {
+    char *          path;
+    struct timespec atime;
+} accessed_file_t;
+
+/* Escape whitespace and backslashes, mksquashfs would otherwise split the path there */
+static void write_path(FILE *f, const char *path) {
+    for (; *path; path++) {
+        if (isspace((unsigned char)*path) || *path == '\\') fputc('\\', f);
+        fputc(*path, f);
+    }
+}
+
+bool private_write_sort_file(const char *const path, char *const *const files, size_t count) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Failed to write the sort file %s\n", path);
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        // Stay above the default priority of the files that were not accessed
+        long priority = i < MAX_PRIORITY ? MAX_PRIORITY - (long)i : 1;
+        write_path(f, files[i]);
+        fprintf(f, " %ld\n", priority);
+    }
+
+    bool ok = !ferror(f);
+    return fclose(f) == 0 && ok;
+}
+
+// nftw has no user data argument
+static accessed_file_t *collected       = NULL;
+static size_t           collected_count = 0;
+static size_t           collected_size  = 0;
+static size_t           prefix_len      = 0;
+static struct timespec  collect_since;
+
+static bool timespec_before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static int compare_atime(const void *a, const void *b) {
+    const accessed_file_t *x = a, *y = b;
+    if (timespec_before(&x->atime, &y->atime)) return -1;
+    if (timespec_before(&y->atime, &x->atime)) return 1;
+    return strcmp(x->path, y->path);
+}
+
+static int collect_callback(const char *path, const struct stat *st, const int type, struct FTW *ftw) {
+    (void)ftw;
+    if (type != FTW_F || !S_ISREG(st->st_mode) || timespec_before(&st->st_atim, &collect_since)) return 0;
+
+    if (collected_count == collected_size) {
+        size_t           size = collected_size ? collected_size * 2 : 256;
+        accessed_file_t *tmp  = realloc(collected, size * sizeof(accessed_file_t));
+        if (tmp == NULL) return 1;
+        collected      = tmp;
+        collected_size = size;
+    }
+
+    const char *rel = path + prefix_len;
+    while (*rel == '/') rel++;
+    if ((collected[collected_count].path = strdup(rel)) == NULL) return 1;
+    collected[collected_count++].atime = st->st_atim;
+    return 0;
+}
+
+bool appimage_write_sort_file(const char *const prefix, const char *const sort_path, const struct timespec *since) {
+    collected       = NULL;
+    collected_count = 0;
+    collected_size  = 0;
+    prefix_len      = strlen(prefix);
+    collect_since   = *since;
+
+    // The first read of a freshly extracted file updates its access time, even with relatime
+    bool ok = nftw(prefix, &collect_callback, 16, FTW_MOUNT | FTW_PHYS) == 0;
+    if (ok) {
+        qsort(collected, collected_count, sizeof(accessed_file_t), compare_atime);
+
+        char **files = malloc(sizeof(char *) * (collected_count ? collected_count : 1));
+        for (size_t i = 0; files && i < collected_count; i++) files[i] = collected[i].path;
+        ok = files && private_write_sort_file(sort_path, files, collected_count);
+        free(files);
+    }
+
+    for (size_t i = 0; i < collected_count; i++) free(collected[i].path);
+    free(collected);
+    collected = NULL;
+    return ok;
+}
@@ -0,0 +1,143 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#include <features.h>
+
+#include "thread_pool.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+typedef struct private_task {
+    private_task_fn      fn;
+    void *               arg;
+    struct private_task *next;
+} private_task_t;
+
+struct private_thread_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t  work_cond; // signaled when a task was queued or the pool is stopped
+    pthread_cond_t  idle_cond; // signaled when the last running task finished
+
+    private_task_t *head;
+    private_task_t *tail;
+
+    unsigned   num_threads;
+    unsigned   num_running; // tasks currently being executed
+    bool       stop;
+    pthread_t *threads;
+};
+
+unsigned private_cpu_count(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (unsigned)cpus : 1;
+}
+
+static void *worker_thread(void *arg) {
+    private_thread_pool_t *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->head == NULL && !pool->stop) pthread_cond_wait(&pool->work_cond, &pool->lock);
+        if (pool->head == NULL) break; // stopped and nothing left to do
+
+        private_task_t *task = pool->head;
+        pool->head           = task->next;
+        if (pool->head == NULL) pool->tail = NULL;
+        pool->num_running++;
+        pthread_mutex_unlock(&pool->lock);
+
+        task->fn(task->arg);
+        free(task);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->num_running--;
+        if (pool->num_running == 0 && pool->head == NULL) pthread_cond_broadcast(&pool->idle_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+private_thread_pool_t *private_thread_pool_new(unsigned num_threads) {
+    private_thread_pool_t *pool = calloc(1, sizeof(private_thread_pool_t));
+    if (pool == NULL) return NULL;
+
+    if (num_threads == 0) num_threads = private_cpu_count();
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    pool->threads = calloc(num_threads, sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        private_thread_pool_free(pool);
+        return NULL;
+    }
+
+    for (unsigned i = 0; i < num_threads; i++) {
+        int res = pthread_create(&pool->threads[i], NULL, worker_thread, pool);
+        if (res != 0) {
+            fprintf(stderr, "Failed to create worker thread: %s\n", strerror(res));
+            break;
+        }
+        pool->num_threads++;
+    }
+
+    if (pool->num_threads == 0) {
+        private_thread_pool_free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+bool private_thread_pool_submit(private_thread_pool_t *pool, private_task_fn fn, void *arg) {
+    private_task_t *task = malloc(sizeof(private_task_t));
+    if (task == NULL) return false;
+
+    task->fn   = fn;
+    task->arg  = arg;
+    task->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail) {
+        pool->tail->next = task;
+    } else {
+        pool->head = task;
+    }
+    pool->tail = task;
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return true;
+}
+
+void private_thread_pool_wait(private_thread_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head != NULL || pool->num_running > 0) pthread_cond_wait(&pool->idle_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void private_thread_pool_free(private_thread_pool_t *pool) {
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,25 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stdbool.h>
+
+typedef void (*private_task_fn)(void *);
+
+typedef struct private_thread_pool private_thread_pool_t;
+
+// Number of online CPUs (at least 1)
+unsigned private_cpu_count(void);
+
+// Create a pool with num_threads workers. 0 selects one worker per online CPU.
+private_thread_pool_t *private_thread_pool_new(unsigned num_threads);
+
+// Queue a task. Tasks are executed in FIFO order by the first idle worker.
+bool private_thread_pool_submit(private_thread_pool_t *pool, private_task_fn fn, void *arg);
+
+// Block until the queue is empty and all workers are idle
+void private_thread_pool_wait(private_thread_pool_t *pool);
+
+// Wait for all queued tasks, then stop and join all workers
+void private_thread_pool_free(private_thread_pool_t *pool);
@@ -0,0 +1,139 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Mounting without fusermount. libfuse mounts through the setuid fusermount helper, which costs a process spawn and a
+ * few round trips over a socket, and is missing in many containers. Since Linux 4.18, FUSE can be mounted by the owner
+ * of a user namespace instead: the launcher moves itself into a new user and mount namespace, opens /dev/fuse and
+ * calls mount(2) directly. The mount daemon then only takes over the /dev/fuse fd (libfuse accepts /dev/fd/N as
+ * mountpoint since 3.3, so this needs FUSE 3).
+ *
+ * The application runs inside the namespace as well, it is the only place where the mount is visible. Its user and
+ * group ids are mapped 1:1, but setuid binaries do not work in there.
+ *
+ * A process can not leave its new namespaces again, so a failure after unshare would strand the launcher in a
+ * namespace where the fusermount fallback does not work. The whole setup is therefore tried in a forked child first
+ * (e.g. distributions that restrict unprivileged user namespaces only fail at the uid_map write). Only if that
+ * succeeded does the launcher enter the namespaces itself, and a failure from then on ends the launch.
+ */
+
+#define _GNU_SOURCE
+
+#include "private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+
+#if FUSE_USE_VERSION >= 30
+/* libfuse looks for fusermount3 in its install prefix and in PATH */
+static bool have_fusermount(void) {
+    const char *path  = getenv("PATH");
+    char *      dirs  = strdup(path && path[0] ? path : "/usr/local/bin:/usr/bin:/bin");
+    bool        found = access("/usr/bin/fusermount3", X_OK) == 0;
+
+    char *save = NULL;
+    for (char *dir = dirs ? strtok_r(dirs, ":", &save) : NULL; dir && !found; dir = strtok_r(NULL, ":", &save)) {
+        char *exe;
+        if (asprintf(&exe, "%s/fusermount3", dir) == -1) break;
+        found = access(exe, X_OK) == 0;
+        free(exe);
+    }
+    free(dirs);
+    return found;
+}
+#endif
+
+bool private_userns_enabled(void) {
+#if FUSE_USE_VERSION >= 30
+    const char *env = getenv("APPIMAGE_USERNS_MOUNT");
+    if (env) return strcmp(env, "1") == 0;
+    return !have_fusermount();
+#else
+    return false;
+#endif
+}
+
+static bool write_file(const char *const path, const char *const content) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    size_t len = strlen(content);
+    bool   ok  = write(fd, content, len) == (ssize_t)len;
+    return close(fd) == 0 && ok;
+}
+
+/* Enter the namespaces and mount, returns the /dev/fuse fd or -1 */
+static int enter_and_mount(const char *const image, const char *const mount_path) {
+    char  map[64];
+    char  options[128];
+    uid_t uid = getuid();
+    gid_t gid = getgid();
+
+    if (unshare(CLONE_NEWUSER | CLONE_NEWNS) != 0) {
+        perror("unshare error");
+        return -1;
+    }
+
+    // Writing gid_map is only allowed for unprivileged users once setgroups is disabled
+    snprintf(map, sizeof(map), "%u %u 1\n", (unsigned)uid, (unsigned)uid);
+    bool ok = write_file("/proc/self/uid_map", map) && write_file("/proc/self/setgroups", "deny");
+    snprintf(map, sizeof(map), "%u %u 1\n", (unsigned)gid, (unsigned)gid);
+    ok = ok && write_file("/proc/self/gid_map", map);
+
+    // Keep the mount out of the parent namespace, the mounts of the parent still show up in here
+    ok = ok && mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) == 0;
+
+    // The kernel only accepts a /dev/fuse fd that was opened in the user namespace of the mount
+    int fd = ok ? open("/dev/fuse", O_RDWR | O_CLOEXEC) : -1;
+    ok     = fd != -1;
+
+    snprintf(options,
+             sizeof(options),
+             "fd=%d,rootmode=40000,user_id=%u,group_id=%u",
+             fd,
+             (unsigned)uid,
+             (unsigned)gid);
+    ok = ok && mount(image, mount_path, "fuse.squashfuse", MS_RDONLY | MS_NOSUID | MS_NODEV, options) == 0;
+
+    if (!ok) {
+        perror("mount in user namespace error");
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int private_userns_mount(const char *const image, const char *const mount_path) {
+    int status;
+
+    // Check the device before entering the namespace, nothing has changed yet if it is not usable
+    if (access("/dev/fuse", R_OK | W_OK) != 0) {
+        perror("access /dev/fuse error");
+        return -1;
+    }
+
+    // The mount of the child disappears with its namespace when it exits
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork error");
+        return -1;
+    }
+    if (pid == 0) _exit(enter_and_mount(image, mount_path) == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) return -1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) return -1;
+
+    int fd = enter_and_mount(image, mount_path);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to mount in the user namespace after entering it, cannot fall back to fusermount\n");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
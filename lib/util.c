@@ -13,11 +13,15 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <ftw.h>
 #include <libgen.h>
 
 #include "libruntime.h"
+#include "private.h"
 
 /* Check whether directory is writable */
 bool appimage_is_writable_directory(char *str) {
@@ -121,6 +125,69 @@ bool appimage_rm_recursive(const char *const path) {
     return rv == 0;
 }
 
+char *appimage_get_cache_dir(const char *const subdir) {
+    const char *base   = getenv("XDG_CACHE_HOME");
+    const char *suffix = "/appimage/";
+
+    // Relative values of XDG_CACHE_HOME are invalid according to the XDG base directory specification
+    if (base == NULL || base[0] != '/') {
+        base   = getenv("HOME");
+        suffix = "/.cache/appimage/";
+    }
+    if (base == NULL || base[0] == '\0') {
+        return NULL;
+    }
+
+    char *dir = malloc(strlen(base) + strlen(suffix) + strlen(subdir) + 1);
+    if (dir == NULL) {
+        return NULL;
+    }
+    strcpy(dir, base);
+    strcat(dir, suffix);
+    strcat(dir, subdir);
+
+    if (!appimage_mkdir_p(dir)) {
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+void private_daemonize(void) {
+    if (setsid() == -1 || fork() != 0) _exit(EXIT_SUCCESS);
+
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd != -1) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (null_fd > STDERR_FILENO) close(null_fd);
+    }
+    if (chdir("/") != 0) _exit(EXIT_FAILURE);
+}
+
+long long private_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void private_wake_pipe(int fd) {
+    // EAGAIN means the pipe is full, which wakes the loop up just as well
+    while (write(fd, "x", 1) == -1 && errno == EINTR) {}
+}
+
+void private_drain_pipe(int fd) {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+}
+
+void private_remove_closed_clients(const struct pollfd *fds, size_t num_clients, void (*remove)(size_t i)) {
+    for (size_t i = num_clients; i-- > 0;) {
+        if (fds[i].revents) remove(i);
+    }
+}
+
 char *appimage_generate_mount_path(appimage_context_t *const context, const char *const prefix) {
     const size_t maxnamelen = 6;
 
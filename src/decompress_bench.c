@@ -0,0 +1,186 @@
+// Copyright 2021 Daniel Mensinger
+// SPDX-License-Identifier: MIT
+
+/*
+ * Per block cost of the squashfuse decompressors compared to the ones with per-thread contexts (decompress_ctx.c).
+ * Every compression type that was found at build time compresses a metadata sized (8 KiB) and a data sized (128 KiB)
+ * block like mksquashfs would, then both decompressors decode it in a loop. The difference of the two columns is the
+ * setup cost that the reused contexts save per block. With libdeflate, its row compares it to the zlib based one.
+ *
+ * Usage: decompress_bench [iterations of the metadata block]
+ */
+
+#include "decompress_ctx.h"
+#include "squashfs_fs.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4hc.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define DATA_BLOCK_SIZE (128 * 1024)
+
+/* Returns the compressed size, 0 on errors */
+typedef size_t (*compress_func)(const uint8_t *in, size_t insz, uint8_t *out, size_t outsz);
+
+#ifdef HAVE_ZLIB
+static size_t compress_zlib(const uint8_t *in, size_t insz, uint8_t *out, size_t outsz) {
+    uLongf size = outsz;
+    return compress2(out, &size, in, insz, Z_BEST_COMPRESSION) == Z_OK ? size : 0;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static size_t compress_xz(const uint8_t *in, size_t insz, uint8_t *out, size_t outsz) {
+    // mksquashfs uses the block size as dictionary size
+    lzma_options_lzma opts;
+    if (lzma_lzma_preset(&opts, 6)) return 0;
+    opts.dict_size = DATA_BLOCK_SIZE;
+
+    lzma_filter filters[] = {{LZMA_FILTER_LZMA2, &opts}, {LZMA_VLI_UNKNOWN, NULL}};
+    size_t      size      = 0;
+    lzma_ret    ret       = lzma_stream_buffer_encode(filters, LZMA_CHECK_CRC32, NULL, in, insz, out, &size, outsz);
+    return ret == LZMA_OK ? size : 0;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static size_t compress_lz4(const uint8_t *in, size_t insz, uint8_t *out, size_t outsz) {
+    int size = LZ4_compress_HC((const char *)in, (char *)out, (int)insz, (int)outsz, LZ4HC_CLEVEL_DEFAULT);
+    return size > 0 ? (size_t)size : 0;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static size_t compress_zstd(const uint8_t *in, size_t insz, uint8_t *out, size_t outsz) {
+    size_t size = ZSTD_compress(out, outsz, in, insz, 15);
+    return ZSTD_isError(size) ? 0 : size;
+}
+#endif
+
+static const struct {
+    const char *          name;
+    sqfs_compression_type type;
+    compress_func         compress;
+} compressors[] = {
+#if defined(HAVE_ZLIB) && defined(HAVE_LIBDEFLATE)
+    {"libdeflate", ZLIB_COMPRESSION, compress_zlib},
+#elif defined(HAVE_ZLIB)
+    {"zlib", ZLIB_COMPRESSION, compress_zlib},
+#endif
+#ifdef HAVE_LZMA
+    {"xz", XZ_COMPRESSION, compress_xz},
+#endif
+#ifdef HAVE_LZ4
+    {"lz4", LZ4_COMPRESSION, compress_lz4},
+#endif
+#ifdef HAVE_ZSTD
+    {"zstd", ZSTD_COMPRESSION, compress_zstd},
+#endif
+    {NULL, 0, NULL},
+};
+
+/* Text with a vocabulary like file names and ELF symbols, compresses about as well as squashfs metadata */
+static void fill_block(uint8_t *block, size_t size) {
+    static const char *const words[] = {"lib", "usr", "share", "icons", "python3", ".so", "_init", "gtk", "x86_64",
+                                        "locale", "png", "32x32", "__cxa", "main", "Qt5", "@GLIBC_2.17", "/", "\n"};
+    uint64_t state = 0x9E3779B97F4A7C15u;
+    size_t   pos   = 0;
+    while (pos < size) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        const char *word = words[state % (sizeof(words) / sizeof(words[0]))];
+        for (; *word && pos < size; word++) block[pos++] = (uint8_t)*word;
+        if (pos < size) block[pos++] = (uint8_t)(state >> 32);
+    }
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* Average ns per block, negative on errors */
+static double
+time_decompressor(sqfs_decompressor decompress, uint8_t *in, size_t insz, uint8_t *out, size_t size, unsigned n) {
+    const double start = now_ns();
+    for (unsigned i = 0; i < n; i++) {
+        size_t outsz = size;
+        if (decompress(in, insz, out, &outsz) != SQFS_OK || outsz != size) return -1;
+    }
+    return (now_ns() - start) / n;
+}
+
+int main(int argc, char **argv) {
+    unsigned iterations = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 10) : 20000;
+    if (iterations == 0) iterations = 1;
+
+    uint8_t *raw        = malloc(DATA_BLOCK_SIZE);
+    uint8_t *compressed = malloc(DATA_BLOCK_SIZE * 2);
+    uint8_t *out        = malloc(DATA_BLOCK_SIZE);
+    if (!raw || !compressed || !out) return 1;
+    fill_block(raw, DATA_BLOCK_SIZE);
+
+    if (!compressors[0].name) {
+        fprintf(stderr, "No decompressor with a per-thread context was built\n");
+        return 1;
+    }
+
+    printf("%-10s %8s %10s %12s %12s %12s\n", "type", "block", "compressed", "squashfuse", "reused", "saved");
+    int ret = 0;
+    for (size_t i = 0; compressors[i].name; i++) {
+        sqfs_decompressor stock  = sqfs_decompressor_get(compressors[i].type);
+        sqfs_decompressor reused = private_decompressor_get(compressors[i].type);
+        if (!stock || !reused) {
+            printf("%-10s not supported by squashfuse\n", compressors[i].name);
+            continue;
+        }
+
+        const size_t sizes[] = {SQUASHFS_METADATA_SIZE, DATA_BLOCK_SIZE};
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            const size_t   size = sizes[s];
+            const unsigned n    = (unsigned)(iterations / (size / SQUASHFS_METADATA_SIZE)) + 1;
+            const size_t   insz = compressors[i].compress(raw, size, compressed, DATA_BLOCK_SIZE * 2);
+
+            // Warm up, this also creates the context of this thread
+            double stock_ns  = insz ? time_decompressor(stock, compressed, insz, out, size, 1) : -1;
+            double reused_ns = insz ? time_decompressor(reused, compressed, insz, out, size, 1) : -1;
+            if (stock_ns < 0 || reused_ns < 0 || memcmp(out, raw, size) != 0) {
+                printf("%-10s %8zu failed\n", compressors[i].name, size);
+                ret = 1;
+                continue;
+            }
+
+            stock_ns  = time_decompressor(stock, compressed, insz, out, size, n);
+            reused_ns = time_decompressor(reused, compressed, insz, out, size, n);
+            printf("%-10s %8zu %10zu %10.0fns %10.0fns %10.0fns\n",
+                   compressors[i].name,
+                   size,
+                   insz,
+                   stock_ns,
+                   reused_ns,
+                   stock_ns - reused_ns);
+        }
+    }
+
+    free(raw);
+    free(compressed);
+    free(out);
+    return ret;
+}
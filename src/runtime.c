@@ -138,6 +138,17 @@ void portable_option(const char *arg, const char *appimage_path, const char *nam
     }
 }
 
+void print_section(const char *appimage_path, const char *section_name) {
+    appimage_image_t *image = appimage_image_open(appimage_path);
+    if (image == NULL) exit(1);
+
+    char *data = appimage_image_read_section(image, section_name);
+    printf("%s\n", data ? data : "");
+
+    free(data);
+    appimage_image_close(image);
+}
+
 typedef struct mount_data {
     char * arg;
     char * mount_dir;
@@ -254,6 +265,11 @@ int main(int argc, char *argv[]) {
             exit(EXIT_EXECERROR);
         }
 
+        // Optionally record which of the extracted files the application reads (see appimage_write_sort_file)
+        const char *    trace_sort = getenv("APPIMAGE_TRACE_SORT");
+        struct timespec run_start;
+        clock_gettime(CLOCK_REALTIME_COARSE, &run_start);
+
         int pid;
         if ((pid = fork()) == -1) {
             int error = errno;
@@ -267,6 +283,12 @@ int main(int argc, char *argv[]) {
         int rv     = waitpid(pid, &status, 0);
         status     = rv > 0 && WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_EXECERROR;
 
+        if (trace_sort != NULL && trace_sort[0] != '\0') {
+            if (appimage_write_sort_file(prefix, trace_sort, &run_start)) {
+                fprintf(stderr, "Wrote the mksquashfs sort file %s\n", trace_sort);
+            }
+        }
+
         if (getenv("NO_CLEANUP") == NULL) {
             if (!appimage_rm_recursive(prefix)) {
                 fprintf(stderr, "Failed to clean up cache directory\n");
@@ -287,24 +309,12 @@ int main(int argc, char *argv[]) {
     }
 
     if (arg && (strcmp(arg, "appimage-updateinformation") == 0 || strcmp(arg, "appimage-updateinfo") == 0)) {
-        unsigned long offset = 0;
-        unsigned long length = 0;
-        appimage_get_elf_section_offset_and_length(context.appimage_path, ".upd_info", &offset, &length);
-        // fprintf(stderr, "offset: %lu\n", offset);
-        // fprintf(stderr, "length: %lu\n", length);
-        // print_hex(appimage_path, offset, length);
-        appimage_print_binary(context.appimage_path, offset, length);
+        print_section(context.appimage_path, ".upd_info");
         exit(0);
     }
 
     if (arg && strcmp(arg, "appimage-signature") == 0) {
-        unsigned long offset = 0;
-        unsigned long length = 0;
-        appimage_get_elf_section_offset_and_length(context.appimage_path, ".sha256_sig", &offset, &length);
-        // fprintf(stderr, "offset: %lu\n", offset);
-        // fprintf(stderr, "length: %lu\n", length);
-        // print_hex(appimage_path, offset, length);
-        appimage_print_binary(context.appimage_path, offset, length);
+        print_section(context.appimage_path, ".sha256_sig");
         exit(0);
     }
 
@@ -318,13 +328,30 @@ int main(int argc, char *argv[]) {
         exit(EXIT_EXECERROR);
     }
 
-    // allocate enough memory (size of name won't exceed 60 bytes)
-    char *       mount_dir = appimage_generate_mount_path(&context, NULL);
     mount_data_t cb_data;
-    cb_data.arg       = arg;
+    cb_data.arg  = arg;
+    cb_data.argc = argc;
+    cb_data.argv = argv;
+
+    // Reuse the mount of another launch of this AppImage if there is one
+    char *mount_dir = appimage_attach_mount(&context);
+    if (mount_dir) {
+        cb_data.mount_dir = mount_dir;
+        mounted_cb(&context, &cb_data);
+        return 0;
+    }
+
+    // allocate enough memory (size of name won't exceed 60 bytes)
+    mount_dir         = appimage_generate_mount_path(&context, NULL);
     cb_data.mount_dir = mount_dir;
-    cb_data.argc      = argc;
-    cb_data.argv      = argv;
+
+    // Let the per-user daemon serve the image, mount it in a daemon of its own if that does not work
+    char *daemon_dir = appimage_user_daemon_enabled() ? appimage_daemon_mount(&context, mount_dir) : NULL;
+    if (daemon_dir) {
+        cb_data.mount_dir = daemon_dir;
+        mounted_cb(&context, &cb_data);
+        return 0;
+    }
 
     if (!appimage_self_mount(&context, mount_dir, &mounted_cb, &cb_data)) {
         exit(EXIT_EXECERROR);